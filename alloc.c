@@ -0,0 +1,179 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Memory allocation with the allocator supplied by the application.
+ */
+
+
+#include "libexpression-private.h"
+
+
+//Allocator set with exp_set_allocator(), NULL is the C library
+const exp_allocator_t *exp_global_allocator=NULL;
+
+//Allocator and phase of the call of the library that runs in the thread
+__thread heap_t exp_heap HEAP_TLS_MODEL={ NULL, EXP_PHASE_COMPILE};
+
+
+void exp_set_allocator( const exp_allocator_t *allocator){
+	exp_global_allocator=allocator;
+}
+
+
+void *exp_mem_malloc( size_t size){
+	const exp_allocator_t *a=exp_heap.allocator;
+
+	return a ? a->malloc( a->opaque, size) : malloc( size);
+}
+
+
+void *exp_mem_calloc( size_t nmemb, size_t size){
+	const exp_allocator_t *a=exp_heap.allocator;
+	void *ret;
+
+	if( NULL==a){
+		return calloc( nmemb, size);
+	}
+	if( size && nmemb>(size_t)-1/size){
+		return NULL;
+	}
+	if(( ret=a->malloc( a->opaque, nmemb*size))){
+		memset( ret, 0, nmemb*size);
+	}
+	return ret;
+}
+
+
+void *exp_mem_realloc( void *ptr, size_t size){
+	const exp_allocator_t *a=exp_heap.allocator;
+
+	return a ? a->realloc( a->opaque, ptr, size) : realloc( ptr, size);
+}
+
+
+void exp_mem_free( void *ptr){
+	const exp_allocator_t *a=exp_heap.allocator;
+
+	if( NULL==a){
+		free( ptr);
+	}else if( ptr){
+		a->free( a->opaque, ptr);
+	}
+}
+
+
+char *exp_mem_strdup( const char *s){
+	size_t len=strlen( s)+1;
+	char *ret;
+
+	if(( ret=exp_mem_malloc( len))){
+		memcpy( ret, s, len);
+	}
+	return ret;
+}
+
+
+/*
+ * Callbacks of the counting allocator. The phase is the phase of the call of
+ * the library that allocates the memory.
+ */
+static void *counting_malloc( void *opaque, size_t size){
+	exp_counting_allocator_t *c=opaque;
+	exp_alloc_count_t *n=&c->count[exp_heap.phase];
+
+	__atomic_fetch_add( &n->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add( &n->bytes, size, __ATOMIC_RELAXED);
+	return c->parent ? c->parent->malloc( c->parent->opaque, size) : malloc( size);
+}
+
+static void *counting_realloc( void *opaque, void *ptr, size_t size){
+	exp_counting_allocator_t *c=opaque;
+	exp_alloc_count_t *n=&c->count[exp_heap.phase];
+
+	__atomic_fetch_add( &n->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add( &n->bytes, size, __ATOMIC_RELAXED);
+	return c->parent ? c->parent->realloc( c->parent->opaque, ptr, size) : realloc( ptr, size);
+}
+
+static void counting_free( void *opaque, void *ptr){
+	exp_counting_allocator_t *c=opaque;
+
+	__atomic_fetch_add( &c->count[exp_heap.phase].frees, 1, __ATOMIC_RELAXED);
+	if( c->parent){
+		c->parent->free( c->parent->opaque, ptr);
+	}else{
+		free( ptr);
+	}
+}
+
+
+//The counting allocator without parent allocates memory with malloc(), so
+//it shares the strings with the C library like the default allocator does
+#define is_libc( a) ( NULL==(a) ||\
+	( (a)->malloc==counting_malloc && NULL==((exp_counting_allocator_t *)(a)->opaque)->parent))
+
+
+/*
+ * Moves the string returned by user callback from the C library to the
+ * allocator of the call. With the allocator of the C library the string is
+ * taken as is.
+ *
+ * @return The string or NULL if memory error occured, the string of the
+ *         callback is taken over in both cases
+ */
+char *exp_mem_import( char *s){
+	char *ret;
+
+	if( is_libc( exp_heap.allocator) || NULL==s){
+		return s;
+	}
+	ret=exp_mem_strdup( s);
+	free( s);
+	return ret;
+}
+
+
+/*
+ * Moves the string of the result from the allocator of the call to the C
+ * library, so that the caller frees it with free().
+ *
+ * @return The string or NULL if memory error occured, the string `s' is
+ *         taken over in both cases
+ */
+char *exp_mem_export( char *s){
+	char *ret;
+
+	if( is_libc( exp_heap.allocator) || NULL==s){
+		return s;
+	}
+	ret=strdup( s);
+	exp_mem_free( s);
+	return ret;
+}
+
+
+void exp_counting_allocator_init( exp_counting_allocator_t *counter, const exp_allocator_t *parent){
+	memset( counter, 0, sizeof( exp_counting_allocator_t));
+	counter->allocator.malloc=counting_malloc;
+	counter->allocator.realloc=counting_realloc;
+	counter->allocator.free=counting_free;
+	counter->allocator.opaque=counter;
+	counter->parent=parent;
+}
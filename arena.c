@@ -0,0 +1,105 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Arena allocator for the tokens of expression that is compiled.
+ */
+
+#include "libexpression-private.h"
+
+
+//Size of the header of block, allocations in the block are aligned too
+#define ARENA_ALIGN( n)  (((n)+15) & ~(size_t)15)
+#define ARENA_HEADER     ARENA_ALIGN( sizeof( arena_block_t))
+
+//Blocks are allocated with this size, unless larger size is requested
+#define ARENA_BLOCK 8192
+
+
+/*
+ * Initializes the arena with the buffer of the caller (that is usually on the
+ * stack), more memory is allocated in blocks when the buffer is full.
+ */
+void exp_arena_init( arena_t *a, void *buffer, size_t len){
+	a->blocks=NULL;
+	a->next=(char *)ARENA_ALIGN( (uintptr_t)buffer);
+	a->end=(char *)buffer+len;
+	if( a->next>a->end){
+		a->next=a->end;
+	}
+}
+
+
+/*
+ * Allocates zeroed memory in the arena. The memory is not freed until the
+ * arena is freed with exp_arena_free().
+ *
+ * @return Pointer to the memory or NULL if memory error occured
+ */
+void *exp_arena_alloc( arena_t *a, size_t size){
+	arena_block_t *b;
+	size_t len;
+	char *ret;
+
+	size=ARENA_ALIGN( size);
+	if( (size_t)( a->end-a->next)<size){
+		len=size>ARENA_BLOCK-ARENA_HEADER ? size+ARENA_HEADER : ARENA_BLOCK;
+		if( NULL==( b=exp_mem_malloc( len))){
+			return NULL;
+		}
+		b->next=a->blocks;
+		a->blocks=b;
+		a->next=(char *)b+ARENA_HEADER;
+		a->end=(char *)b+len;
+	}
+	ret=a->next;
+	a->next+=size;
+	memset( ret, 0, size);
+	return ret;
+}
+
+
+/*
+ * Copies at most `n' characters of the string to the arena
+ */
+char *exp_arena_strdupn( arena_t *a, const char *s, size_t n){
+	char *ret, *p;
+
+	if(( ret=p=exp_arena_alloc( a, n+1))){
+		while( *s && n){
+			*p++=*s++;
+			n--;
+		}
+	}
+	return ret;
+}
+
+
+/*
+ * Frees all memory allocated in the arena
+ */
+void exp_arena_free( arena_t *a){
+	arena_block_t *b;
+
+	while(( b=a->blocks)){
+		a->blocks=b->next;
+		exp_mem_free( b);
+	}
+	a->next=a->end=NULL;
+}
@@ -0,0 +1,648 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Evaluation of compiled program over columns of parameters.
+ */
+
+#include "libexpression-private.h"
+
+
+/*
+ * Releases strings owned by the rows of vector
+ */
+static void vector_clear( vector_t *v, int rows){
+	int r;
+
+	for( r=0; r<rows; r++){
+		if( v->type[r]==T_STRING && !v->borrowed[r]){
+			exp_mem_free( v->value[r].string);
+		}
+		v->type[r]=T_NONE;
+	}
+	v->types=0;
+}
+
+
+/*
+ * Releases strings that were stored in the result column
+ */
+static void free_results( exp_column_t *result, int from, int to){
+	if( result->type==EXP_STRING){
+		while( from<to){
+			free( result->data.string[from]);
+			result->data.string[from++]=NULL;
+		}
+	}
+}
+
+
+/*
+ * Fills the selected rows of vector with the rows of the column. Strings are
+ * not copied, they are owned by the caller.
+ */
+static void bind_column( vector_t *v, const exp_column_t *column, int base, const unsigned short *sel, int n){
+	int r, i;
+
+	if( NULL==sel){
+		v->types=0;
+	}
+	switch( column->type){
+		case EXP_INTEGER:
+			for_selected( r, i, sel, n){
+				v->type[r]=T_INTEGER;
+				v->borrowed[r]=0;
+				v->value[r].integer=column->data.integer[base+r];
+			}
+			v->types|=TYPE_INTEGER;
+			break;
+		case EXP_REAL:
+			for_selected( r, i, sel, n){
+				v->type[r]=T_REAL;
+				v->borrowed[r]=0;
+				v->value[r].real=column->data.real[base+r];
+			}
+			v->types|=TYPE_REAL;
+			break;
+		case EXP_BOOLEAN:
+			for_selected( r, i, sel, n){
+				v->type[r]=T_BOOLEAN;
+				v->borrowed[r]=0;
+				v->value[r].boolean=column->data.boolean[base+r] ? 1 : 0;
+			}
+			v->types|=TYPE_BOOLEAN;
+			break;
+		default:
+			for_selected( r, i, sel, n){
+				v->type[r]=T_STRING;
+				v->borrowed[r]=1;
+				v->value[r].string=column->data.string[base+r] ? column->data.string[base+r] : "NULL";
+			}
+			v->types|=TYPE_STRING;
+			break;
+	}
+}
+
+
+/*
+ * Converts the value to the type of the result column and stores it in the
+ * given row. The value is released.
+ */
+static int store_result( value_t *v, exp_column_t *result, int row, exp_error_t *ercode, char *error){
+	int64_t i;
+	double d;
+	int b;
+	char *s;
+	int status=0;
+
+	switch( result->type){
+		case EXP_INTEGER:
+			if( 0==( status=exp_to_integer( v, &i))){
+				result->data.integer[row]=i;
+			}
+			break;
+		case EXP_REAL:
+			if( 0==( status=exp_to_double( v, &d))){
+				result->data.real[row]=d;
+			}
+			break;
+		case EXP_BOOLEAN:
+			if( 0==( status=exp_to_boolean( v, &b))){
+				result->data.boolean[row]=b;
+			}
+			break;
+		default:
+			if( v->type==T_STRING && !v->borrowed){
+				//the string is passed to the caller, so it is not copied
+				s=v->value.string;
+				v->type=T_NONE;
+			}else if( 0 !=( status=exp_to_string( v, &s))){
+				break;
+			}
+			//strings of results are freed by the caller with free()
+			if( NULL==( result->data.string[row]=exp_mem_export( s))){
+				status=EXP_ER_NOMEM;
+			}
+			break;
+	}
+	exp_value_clear( v);
+	if( 0 !=status){
+		*ercode=status;
+		if( status==EXP_ER_NOMEM){
+			strcpy( error, "Memory error");
+		}else{
+			strcpy( error, "Result can not be converted to the type of result column");
+		}
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Evaluates operator or calls function for every selected row. The operands
+ * are moved from the vectors to the value stack `temp' one row at a time.
+ *
+ * If error occurs, the operands of the failed row are moved back, so every
+ * row of the vectors keeps a valid value.
+ */
+static int eval_rows( expression_t *exp, program_t *program, instruction_t *curr, vector_t *vectors, value_t *temp, int *len, const unsigned short *sel, int n){
+	int first=*len-curr->argc;
+	int r, i, j, c, status;
+
+	if( curr->argc==0){
+		//function without arguments pushes a new vector
+		for_selected( r, j, sel, n){
+			vectors[first].type[r]=T_NONE;
+		}
+		(*len)++;
+	}
+	if( NULL==sel){
+		vectors[first].types=0;
+	}
+	for_selected( r, j, sel, n){
+		for( i=0; i<curr->argc; i++){
+			vector_load( &vectors[first+i], r, &temp[i]);
+		}
+		c=curr->argc;
+		switch( curr->opcode){
+			case I_OPERATOR:
+				status=exp_eval_operator( temp, curr->operand, &c);
+				break;
+			case I_CONCAT:
+				status=exp_eval_concat( temp, curr->argc, &c);
+				break;
+			case I_FUNCTION:
+				status=exp_call_resolved( NULL, curr->operand, curr->argc, temp, &c);
+				break;
+			default:
+				status=exp_call_function( exp, program->constants[curr->operand].value.function, curr->argc, temp, &c);
+				break;
+		}
+		if( 0 !=status){
+			for( i=0; i<c; i++){
+				vector_store( &vectors[first+i], r, &temp[i]);
+			}
+			return status;
+		}
+		vector_store( &vectors[first], r, &temp[0]);
+		for( i=1; i<curr->argc; i++){
+			//the operand is consumed
+			vectors[first+i].type[r]=T_NONE;
+		}
+	}
+	*len=first+1;
+	return 0;
+}
+
+
+/*
+ * Evaluates the condition on the top of the stack for the selected rows and
+ * splits the selection: rows where the condition is true are moved to the
+ * beginning of `sel', the others follow them. Both parts keep the order of
+ * rows, `scratch' is a buffer of EXP_BATCH_CHUNK rows.
+ *
+ * @return 0 and number of rows where condition is true in `true_len', or
+ *         status if the condition of a row is not boolean
+ */
+static int split_selection( vector_t *v, unsigned short *sel, int n, unsigned short *scratch, int *true_len){
+	value_t temp;
+	int i, t=0, f=0, b, status;
+
+	for( i=0; i<n; i++){
+		vector_load( v, sel[i], &temp);
+		if( 0 !=( status=exp_to_boolean( &temp, &b))){
+			return status;
+		}
+		//the condition is consumed
+		exp_value_clear( &temp);
+		v->type[sel[i]]=T_NONE;
+		if( b){
+			sel[t++]=sel[i];
+		}else{
+			scratch[f++]=sel[i];
+		}
+	}
+	memcpy( sel+t, scratch, sizeof( unsigned short)*f);
+	*true_len=t;
+	return 0;
+}
+
+
+/*
+ * Evaluates the left operand of && or || on the top of the stack for the
+ * selected rows and splits the selection like split_selection() does. Rows
+ * where the operand is equal to `decides' get the boolean result and are
+ * moved to the end of `sel', the operand stays in other rows, because it is
+ * used by the operator.
+ *
+ * @return 0 and number of rows where right operand is evaluated in
+ *         `undecided_len', or status if the operand of a row is not boolean
+ */
+static int split_shortcut( vector_t *v, unsigned short *sel, int n, int decides, unsigned short *scratch, int *undecided_len){
+	value_t temp;
+	int i, t=0, f=0, b, status;
+
+	for( i=0; i<n; i++){
+		vector_load( v, sel[i], &temp);
+		if( 0 !=( status=exp_to_boolean( &temp, &b))){
+			return status;
+		}
+		if( b==decides){
+			exp_value_clear( &temp);
+			temp.type=T_BOOLEAN;
+			temp.value.boolean=b;
+			vector_store( v, sel[i], &temp);
+			scratch[f++]=sel[i];
+		}else{
+			sel[t++]=sel[i];
+		}
+	}
+	memcpy( sel+t, scratch, sizeof( unsigned short)*f);
+	*undecided_len=t;
+	return 0;
+}
+
+
+//Conditional expression or shortcut of && and || that is being executed by
+//run_chunk()
+typedef struct {
+	int else_pc;     // first instruction of the second branch
+	int end_pc;      // I_ENDIF of the expression
+	int sel;         // offset of the selection of the expression in the selection vector
+	int n;           // length of the selection of the expression
+	int true_len;    // length of the selection of the first branch (rows where right operand is evaluated)
+	int stack_len;   // the both branches start with this number of vectors on the stack
+	int shortcut;    // I_SHORTCUT whose right operand is evaluated for all rows of the selection, or -1
+} branch_t;
+
+
+/*
+ * Checks that the parameters of the right operand of the shortcut at `pc'
+ * are bound to columns. Other parameters are resolved by the parameter
+ * handler row by row, so the rows where the left operand decides the result
+ * are skipped.
+ */
+static int dense_shortcut( program_t *program, const exp_column_t *columns, int pc){
+	int i;
+
+	if( 0==( program->code[pc].flags & INSTRUCTION_DENSE)){
+		return 0;
+	}
+	for( i=pc+1; i<program->code[pc].operand; i++){
+		if( program->code[i].opcode==I_PARAM && ( NULL==columns || columns[program->code[i].operand].type==EXP_NONE)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Right operand of the dense shortcut on the top of `branches' failed, the
+ * failed row may be the one where the left operand decides the result. The
+ * vectors of the right operand are cleared and the shortcut is executed again
+ * with split selection, so the errors are reported like exp_rpn() does.
+ *
+ * @return Index of I_SHORTCUT to execute again or -1 if the error is not in
+ *         the right operand of dense shortcut
+ */
+static int retry_shortcut( vector_t *vectors, branch_t *branches, int *depth, int *len, int rows){
+	branch_t *br;
+
+	if( *depth==0 || -1==branches[*depth-1].shortcut){
+		return -1;
+	}
+	br=&branches[--(*depth)];
+	while( *len>br->stack_len+1){
+		vector_clear( &vectors[--(*len)], rows);
+	}
+	return br->shortcut;
+}
+
+
+/*
+ * Executes the program for a chunk of rows. Every instruction is executed
+ * for all selected rows of the chunk before the next one, the stack consists
+ * of vectors with a value for every row.
+ *
+ * Conditional expressions split the selection vector: the condition selects
+ * the rows where each branch is executed, so every row executes only one
+ * branch. The branches store their results in different rows of the same
+ * vector, so the results are merged without copying. Conditional expressions
+ * are nested like intervals in the program, so they are tracked with a stack.
+ * The selection of a nested expression is a part of the selection of the
+ * branch where it is nested. Shortcuts of && and || split the selection the
+ * same way, the right operand is executed only for rows where the left operand
+ * does not decide the result. But the right operand that is made of operators
+ * is evaluated for all rows, and the operator combines the both operands with
+ * vector kernel, this is faster than splitting the selection.
+ *
+ * While all rows are selected, the instructions are executed without
+ * selection vector, and the kernels can use vector instructions.
+ */
+static int run_chunk( expression_t *exp, program_t *program, const exp_column_t *columns, int base, int rows, vector_t *vectors, value_t *temp, unsigned short *selection, branch_t *branches, exp_error_t *ercode, char *error, int *error_pos){
+	instruction_t *curr;
+	branch_t *br;
+	value_t *c;
+	vector_t *v;
+	unsigned short *sel=NULL;
+	int64_t k;
+	int pc=0, len=0, depth=0, retry=-1;
+	int r, i, n=rows, status;
+
+	for( i=0; i<rows; i++){
+		selection[i]=i;
+	}
+	while( pc<program->code_len){
+		curr=&program->code[pc++];
+		switch( curr->opcode){
+			case I_PUSH:
+				//string constants are owned by the program, they are not copied
+				v=&vectors[len++];
+				c=&program->constants[curr->operand];
+				for_selected( r, i, sel, n){
+					v->type[r]=c->type;
+					v->borrowed[r]=1;
+					v->value[r]=c->value;
+				}
+				v->types=sel ? v->types | TYPE_OF( c->type) : TYPE_OF( c->type);
+				break;
+
+			case I_PARAM:
+				v=&vectors[len];
+				if( columns && columns[curr->operand].type !=EXP_NONE){
+					bind_column( v, &columns[curr->operand], base, sel, n);
+				}else{
+					if( NULL==sel){
+						v->types=0;
+					}
+					for_selected( r, i, sel, n){
+						if( 0 !=exp_resolve_parameter( exp, program->params[curr->operand]->name, temp, ercode, error)){
+							*error_pos=curr->position;
+							return -1;
+						}
+						vector_store( v, r, temp);
+					}
+				}
+				len++;
+				break;
+
+			case I_KERNEL:
+				if( 0 !=( status=exp_eval_kernel_vector( vectors, curr->argc, &len, rows, sel, n))){
+					if( -1 !=( retry=retry_shortcut( vectors, branches, &depth, &len, rows))){
+						pc=retry;
+						break;
+					}
+					exp_operator_error( status, curr->operand, error);
+					*ercode=status;
+					*error_pos=curr->position;
+					return -1;
+				}
+				break;
+
+			case I_OPERATOR:
+			case I_CONCAT:
+			case I_FUNCTION:
+			case I_CALL:
+				if( 0 !=( status=eval_rows( exp, program, curr, vectors, temp, &len, sel, n))){
+					if( -1 !=( retry=retry_shortcut( vectors, branches, &depth, &len, rows))){
+						pc=retry;
+						break;
+					}
+					if( curr->opcode==I_OPERATOR || curr->opcode==I_CONCAT){
+						exp_operator_error( status, curr->operand, error);
+					}else{
+						exp_function_error( status, error);
+					}
+					*ercode=status;
+					*error_pos=curr->position;
+					return -1;
+				}
+				break;
+
+			case I_JUMPIFNOT:
+				br=&branches[depth++];
+				br->else_pc=curr->operand;
+				br->end_pc=program->code[curr->operand-1].operand;
+				br->shortcut=-1;
+				br->sel=sel ? sel-selection : 0;
+				br->n=n;
+				br->stack_len=--len;
+				if( 0 !=( status=split_selection( &vectors[len], selection+br->sel, n, selection+rows, &br->true_len))){
+					exp_condition_error( status, error);
+					*ercode=status;
+					*error_pos=curr->position;
+					return -1;
+				}
+				if( NULL==sel){
+					//all rows of the vector get the result of a branch
+					vectors[len].types=0;
+				}
+				//execute the first branch with the rows where condition is true
+				n=br->true_len;
+				sel=n==rows ? NULL : selection+br->sel;
+				if( n==0){
+					pc=br->else_pc-1;
+				}
+				break;
+
+			case I_SHORTCUT:
+				br=&branches[depth++];
+				br->else_pc=curr->operand;
+				br->end_pc=curr->operand;
+				br->sel=sel ? sel-selection : 0;
+				br->n=n;
+				br->stack_len=len-1;
+				br->shortcut=-1;
+				if( pc-1 !=retry && dense_shortcut( program, columns, pc-1)){
+					//the operand and the operator are evaluated for the same rows
+					//as the left operand, the shortcut is executed again if they fail
+					br->shortcut=pc-1;
+					br->true_len=n;
+					break;
+				}
+				if( 0 !=( status=split_shortcut( &vectors[len-1], selection+br->sel, n, curr->argc==O_BOOLOR, selection+rows, &br->true_len))){
+					exp_operator_error( status, curr->argc, error);
+					*ercode=status;
+					*error_pos=curr->position;
+					return -1;
+				}
+				//evaluate the right operand and the operator with the rows
+				//where the left operand does not decide the result
+				n=br->true_len;
+				sel=n==rows ? NULL : selection+br->sel;
+				if( n==0){
+					pc=br->end_pc;
+				}
+				break;
+
+			case I_JUMP:
+				//the first branch is done, execute the second one
+				br=&branches[depth-1];
+				n=br->n-br->true_len;
+				sel=n==rows ? NULL : selection+br->sel+br->true_len;
+				len=br->stack_len;
+				pc=n ? br->else_pc : br->end_pc;
+				break;
+
+			case I_ENDIF:
+				if( curr->argc==2){
+					//the both branches are done, the results are merged
+					br=&branches[--depth];
+					n=br->n;
+					sel=n==rows ? NULL : selection+br->sel;
+					len=br->stack_len+1;
+				}
+				v=&vectors[len-1];
+				if( v->types & TYPE_REAL){
+					if( NULL==sel){
+						v->types=0;
+					}
+					for_selected( r, i, sel, n){
+						vector_load( v, r, temp);
+						if( temp->type==T_REAL && 0==exp_is_integer( temp, &k)){
+							temp->type=T_INTEGER;
+							temp->value.integer=k;
+						}
+						vector_store( v, r, temp);
+					}
+				}
+				break;
+
+			default:
+				*ercode=EXP_ER_INVALEXPR;
+				strcpy( error, "Invalid or unsupported instruction");
+				*error_pos=curr->position;
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Stores the results of the chunk in the result column. If error occurs, the
+ * results of the chunk are released.
+ */
+static int store_chunk( vector_t *v, int base, int rows, exp_column_t *result, exp_error_t *ercode, char *error, int *error_pos){
+	value_t temp;
+	int r;
+
+	//numeric results are stored without conversion of every value
+	if( result->type==EXP_INTEGER && v->types==TYPE_INTEGER){
+		for( r=0; r<rows; r++){
+			result->data.integer[base+r]=v->value[r].integer;
+		}
+		return 0;
+	}else if( result->type==EXP_REAL && 0==( v->types & ~( TYPE_INTEGER | TYPE_REAL))){
+		for( r=0; r<rows; r++){
+			result->data.real[base+r]=v->type[r]==T_INTEGER ? (double)v->value[r].integer : v->value[r].real;
+		}
+		return 0;
+	}else if( result->type==EXP_BOOLEAN && v->types==TYPE_BOOLEAN){
+		for( r=0; r<rows; r++){
+			result->data.boolean[base+r]=v->value[r].boolean;
+		}
+		return 0;
+	}
+
+	for( r=0; r<rows; r++){
+		vector_load( v, r, &temp);
+		v->type[r]=T_NONE;
+		if( 0 !=store_result( &temp, result, base+r, ercode, error)){
+			free_results( result, base, base+r);
+			*error_pos=0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Solves the program for every row of the columns of parameters.
+ * @return 0 on success, otherwise -1 is returned and error string is set.
+ *         Strings in the result column should be freed.
+ */
+int exp_batch( expression_t *exp, program_t *program, const exp_column_t *columns, int rows, exp_column_t *result, exp_error_t *ercode, char *error, int *error_pos){
+	vector_t *vectors;
+	value_t *temp;
+	unsigned short *selection;
+	branch_t *branches;
+	int base, n, i, conditions=0;
+	int status=0;
+
+	if( rows<0 || NULL==result || result->type<EXP_INTEGER || result->type>EXP_STRING){
+		*ercode=EXP_ER_INVALARGV;
+		strcpy( error, "Invalid result column");
+		*error_pos=0;
+		return -1;
+	}
+	for( i=0; columns && i<program->params_len; i++){
+		if( columns[i].type<EXP_NONE || columns[i].type>EXP_STRING){
+			*ercode=EXP_ER_INVALPARAM;
+			snprintf( error, EXP_ERLEN, "Invalid type of parameter '%s'", program->params[i]->name);
+			*error_pos=0;
+			return -1;
+		}
+	}
+
+	for( i=0; i<program->code_len; i++){
+		if( program->code[i].opcode==I_JUMPIFNOT || program->code[i].opcode==I_SHORTCUT){
+			conditions++;
+		}
+	}
+
+	//Rows of vectors that do not hold a value have type T_NONE, so the
+	//vectors can be cleared at any moment
+	vectors=exp_mem_calloc( program->max_depth, sizeof( vector_t));
+	temp=exp_mem_malloc( sizeof( value_t)*program->max_depth);
+	//selection vector and scratch buffer for split_selection()
+	selection=exp_mem_malloc( sizeof( unsigned short)*EXP_BATCH_CHUNK*2);
+	branches=exp_mem_malloc( sizeof( branch_t)*( conditions+1));
+	if( NULL==vectors || NULL==temp || NULL==selection || NULL==branches){
+		exp_mem_free( vectors);
+		exp_mem_free( temp);
+		exp_mem_free( selection);
+		exp_mem_free( branches);
+		*ercode=EXP_ER_NOMEM;
+		strcpy( error, "Memory error");
+		*error_pos=0;
+		return -1;
+	}
+
+	for( base=0; base<rows; base+=EXP_BATCH_CHUNK){
+		n=rows-base<EXP_BATCH_CHUNK ? rows-base : EXP_BATCH_CHUNK;
+		if( 0 !=( status=run_chunk( exp, program, columns, base, n, vectors, temp, selection, branches, ercode, error, error_pos)) ||
+				0 !=( status=store_chunk( &vectors[0], base, n, result, ercode, error, error_pos))){
+			for( i=0; i<program->max_depth; i++){
+				vector_clear( &vectors[i], n);
+			}
+			free_results( result, 0, base);
+			break;
+		}
+	}
+
+	exp_mem_free( vectors);
+	exp_mem_free( temp);
+	exp_mem_free( selection);
+	exp_mem_free( branches);
+	return 0 !=status ? -1 : 0;
+}
@@ -0,0 +1,476 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Microbenchmarks of libexpression. The program measures the time and the
+ * number of memory allocations per operation of exp_create(), of solving
+ * representative expressions, of every operator and built-in function, of
+ * the parameter and function handlers, and of exp_solve_batch().
+ *
+ * Every result is printed on its own line as tab separated fields:
+ *    group  name  iterations  ns/op  allocs/op  bytes/op
+ * Lines that start with `#' are comments. The output of two runs can be
+ * compared line by line. Allocations of libexpression are counted with the
+ * counting allocator: exp_create() and exp_free() are counted in the compile
+ * phase, other benchmarks in the solve phase. Strings allocated by handlers
+ * are not counted.
+ *
+ * Run `make bench' to build and execute this program. The optional argument
+ * is the number of iterations of every solve benchmark, exp_create() is
+ * measured with one tenth of that. Batch benchmarks solve the expression once
+ * for that number of rows, their time is per row.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#include "libexpression.h"
+
+
+#define DEFAULT_ITERATIONS 200000
+
+
+//Allocator of libexpression that counts allocations
+static exp_counting_allocator_t counter;
+
+
+/*
+ * Values of parameters. Parameters are bound with exp_solve_params(), so
+ * that they are not folded into constants when the expression is created.
+ */
+static const struct{
+	const char *name;
+	exp_value_t value;
+}parameters[]={
+	{ "x", { EXP_REAL,    { .real=0.5}}},
+	{ "y", { EXP_REAL,    { .real=2.25}}},
+	{ "n", { EXP_INTEGER, { .integer=42}}},
+	{ "m", { EXP_INTEGER, { .integer=5}}},
+	{ "s", { EXP_STRING,  { .string="  Hello World  "}}},
+	{ "t", { EXP_STRING,  { .string="hello world"}}},
+	{ "b", { EXP_STRING,  { .string="101101"}}},
+	{ "h", { EXP_STRING,  { .string="ff"}}},
+	{ "o", { EXP_STRING,  { .string="755"}}},
+};
+
+#define PARAMETERS_COUNT (sizeof( parameters)/sizeof( parameters[0]))
+
+
+/*
+ * Representative expressions, measured both by exp_create() and by solve.
+ */
+static const char *expressions[]={
+	"42",
+	"x+1",
+	"x*y+n-m/2",
+	"(x+y)*(x-y)/(n+m)",
+	"sqrt(x*x+y*y)",
+	"n>10 && m<10 || x==y",
+	"x>y ? n : x<y ? m : 0",
+	"strtoupper(s)+' '+t",
+	"substr(t, 0, 5)=='hello' ? strlen(s) : -1",
+	"0xff & n | m << 2",
+	"min(x, y, n, m)*max(x, y, n, m)+pow(y, 2)-fmod(n, m)",
+};
+
+
+/*
+ * Expressions solved by exp_solve_batch() with real columns named x, y, z
+ * and w.
+ */
+static const char *batch_expressions[]={
+	"x*y+z",
+	"x<y",
+	"x<y && z<w",
+	"x<y && z<w && x<w",
+	"x<y || z<w",
+};
+
+
+/*
+ * Operators of eval.c. Each operator is measured with real, integer and
+ * string operands where the operator accepts them.
+ */
+static const char *operators[]={
+	"-x", "+x", "!n", "~n",
+	"x+y", "x-y", "x*y", "x/y", "x^y",
+	"x>y", "x<y", "x>=y", "x<=y", "x==y", "x=y", "x!=y",
+	"n+m", "n-m", "n*m", "n/m", "n%m", "n^m",
+	"n<<m", "n>>m", "n&m", "n|m", "n&&m", "n||m",
+	"n>m", "n<m", "n>=m", "n<=m", "n==m", "n=m", "n!=m",
+	"n ? x : y",
+	"s+t", "s==t", "s=t", "s!=t", "s>t", "s<t", "s>=t", "s<=t",
+};
+
+
+/*
+ * Arguments of the built-in functions that do not take a single real
+ * number. Functions of functions.def that are not listed here are called
+ * with `x' as every required argument.
+ */
+static const struct{
+	const char *name;
+	const char *args;
+}function_args[]={
+	{ "atan2",      "x, y"},
+	{ "fmod",       "y, x"},
+	{ "min",        "x, y, n"},
+	{ "max",        "x, y, n"},
+	{ "pow",        "y, x"},
+	{ "rand",       ""},
+	{ "random",     "n"},
+	{ "bin2dec",    "b"},
+	{ "dec2bin",    "n"},
+	{ "dec2hex",    "n"},
+	{ "dec2oct",    "n"},
+	{ "hex2dec",    "h"},
+	{ "oct2dec",    "o"},
+	{ "ltrim",      "s"},
+	{ "rtrim",      "s"},
+	{ "strcasecmp", "s, t"},
+	{ "strcmp",     "s, t"},
+	{ "strlen",     "s"},
+	{ "strtolower", "s"},
+	{ "strlwr",     "s"},
+	{ "tolower",    "s"},
+	{ "lowercase",  "s"},
+	{ "strtoupper", "s"},
+	{ "strupr",     "s"},
+	{ "toupper",    "s"},
+	{ "upeercase",  "s"},
+	{ "capitalise", "s"},
+	{ "substr",     "t, 2, 5"},
+	{ "substring",  "t, 2, 5"},
+	{ "trim",       "s"},
+};
+
+#define FUNCTION( name, implementation, min_argc, max_argc, flags) { name, min_argc},
+static const struct{
+	const char *name;
+	int min_argc;
+}functions[]={
+#include "functions.def"
+};
+#undef FUNCTION
+
+
+static double now( void){
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+
+/*
+ * Benchmark state: the start time and the allocation counters of the phase
+ * when the measurement started.
+ */
+typedef struct{
+	double start;
+	exp_phase_t phase;
+	exp_alloc_count_t count;
+}bench_t;
+
+static void bench_start( bench_t *b, exp_phase_t phase){
+	b->phase=phase;
+	b->count=counter.count[phase];
+	b->start=now();
+}
+
+static void bench_report( bench_t *b, const char *group, const char *name, long iterations){
+	double ns=now()-b->start;
+	unsigned long long calls=counter.count[b->phase].calls-b->count.calls;
+	unsigned long long bytes=counter.count[b->phase].bytes-b->count.bytes;
+
+	printf( "%s\t%s\t%ld\t%.1f\t%.2f\t%.1f\n", group, name, iterations, ns/iterations,
+		(double)calls/iterations, (double)bytes/iterations);
+}
+
+static void report_error( const char *group, const char *name, const char *error){
+	printf( "# %s\t%s\terror: %s\n", group, name, error);
+}
+
+
+/*
+ * Fill the array of parameter values of the expression. Parameters that are
+ * not known to the benchmark are left to the parameter handler.
+ */
+static exp_value_t *bind_parameters( expression_t *exp){
+	exp_value_t *params;
+	int count=exp_param_count( exp);
+	int i, j;
+
+	params=calloc( count? count: 1, sizeof( exp_value_t));
+	if( !params){
+		return NULL;
+	}
+	for( i=0; i<count; i++){
+		params[i].type=EXP_NONE;
+		for( j=0; j<PARAMETERS_COUNT; j++){
+			if( 0==strcmp( exp_param_name( exp, i), parameters[j].name)){
+				params[i]=parameters[j].value;
+				break;
+			}
+		}
+	}
+	return params;
+}
+
+
+static void bench_create( const char *group, const char *e, long iterations){
+	exp_error_t ercode;
+	char error[1024];
+	int erpos;
+	expression_t *exp;
+	bench_t b;
+	long i;
+
+	bench_start( &b, EXP_PHASE_COMPILE);
+	for( i=0; i<iterations; i++){
+		exp=exp_create( e, &ercode, error, &erpos);
+		if( !exp){
+			report_error( group, e, error);
+			return;
+		}
+		exp_free( exp);
+	}
+	bench_report( &b, group, e, iterations);
+}
+
+
+/*
+ * Solve the expression with parameters bound by bind_parameters(). If
+ * @c phandler is not NULL, it is used instead of bound parameters, and if
+ * @c fhandler is not NULL, it is set as the function handler.
+ */
+static void bench_solve( const char *group, const char *name, const char *e, long iterations, exp_parameter_handler_f *phandler, exp_function_handler_f *fhandler){
+	exp_error_t ercode;
+	char error[1024];
+	int erpos;
+	expression_t *exp;
+	exp_value_t *params;
+	exp_value_t result;
+	bench_t b;
+	long i;
+
+	exp=exp_create( e, &ercode, error, &erpos);
+	if( !exp){
+		report_error( group, name, error);
+		return;
+	}
+	if( phandler){
+		exp_set_parameter_handler( exp, phandler);
+		params=NULL;
+	}else if( NULL==( params=bind_parameters( exp))){
+		report_error( group, name, "Out of memory");
+		exp_free( exp);
+		return;
+	}
+	if( fhandler){
+		exp_set_function_handler( exp, fhandler);
+	}
+
+	bench_start( &b, EXP_PHASE_SOLVE);
+	for( i=0; i<iterations; i++){
+		if( exp_solve_params( exp, params, &result, &ercode, error, &erpos)){
+			report_error( group, name, error);
+			break;
+		}
+		if( result.type==EXP_STRING){
+			free( result.value.string);
+		}
+	}
+	if( i==iterations){
+		bench_report( &b, group, name, iterations);
+	}
+	free( params);
+	exp_free( exp);
+}
+
+
+/*
+ * Handlers that resolve the same parameter and function that the bound
+ * parameters and the registered function provide, so that the cost of the
+ * callbacks can be compared with them.
+ */
+static int phandler( void *user_data, char *parameter_name, exp_value_t *result){
+	if( 0==strcmp( parameter_name, "x")){
+		*result=parameters[0].value;
+		return 0;
+	}
+	return 1;
+}
+
+static int fhandler( void *user_data, char *function_name, int argc, exp_value_t *argv, exp_value_t *result){
+	if( 0==strcmp( function_name, "handled")){
+		if( argc!=1 || argv[0].type!=EXP_REAL){
+			return 2;
+		}
+		result->type=EXP_REAL;
+		result->value.real=argv[0].value.real*2;
+		return 0;
+	}
+	return 1;
+}
+
+static int registered_twice( void *user_data, int argc, const exp_value_t *argv, exp_value_t *result){
+	if( argv[0].type!=EXP_REAL){
+		return 2;
+	}
+	result->type=EXP_REAL;
+	result->value.real=argv[0].value.real*2;
+	return 0;
+}
+
+
+/*
+ * Solve the expression for `rows' rows of columns of pseudo-random reals.
+ * The result column is boolean for comparisons and real otherwise.
+ */
+static void bench_batch( const char *e, double *data, long rows){
+	exp_error_t ercode;
+	char error[1024];
+	int erpos;
+	expression_t *exp;
+	exp_column_t *columns, result;
+	const char *name;
+	void *out;
+	bench_t b;
+	int i, count;
+
+	exp=exp_create( e, &ercode, error, &erpos);
+	if( !exp){
+		report_error( "batch", e, error);
+		return;
+	}
+	count=exp_param_count( exp);
+	columns=calloc( count? count: 1, sizeof( exp_column_t));
+	out=malloc( sizeof( double)*rows);
+	if( !columns || !out){
+		report_error( "batch", e, "Out of memory");
+		free( columns);
+		free( out);
+		exp_free( exp);
+		return;
+	}
+	for( i=0; i<count; i++){
+		name=exp_param_name( exp, i);
+		columns[i].type=EXP_REAL;
+		columns[i].data.real=data+rows*( strchr( "xyzw", name[0])-"xyzw");
+	}
+	if( strchr( e, '<')){
+		result.type=EXP_BOOLEAN;
+		result.data.boolean=out;
+	}else{
+		result.type=EXP_REAL;
+		result.data.real=out;
+	}
+
+	bench_start( &b, EXP_PHASE_SOLVE);
+	if( exp_solve_batch( exp, columns, rows, &result, &ercode, error, &erpos)){
+		report_error( "batch", e, error);
+	}else{
+		bench_report( &b, "batch", e, rows);
+	}
+	free( out);
+	free( columns);
+	exp_free( exp);
+}
+
+
+static void bench_functions( long iterations){
+	char e[256];
+	const char *args;
+	int i, j, len;
+
+	for( i=0; i<sizeof( functions)/sizeof( functions[0]); i++){
+		args=NULL;
+		for( j=0; j<sizeof( function_args)/sizeof( function_args[0]); j++){
+			if( 0==strcmp( functions[i].name, function_args[j].name)){
+				args=function_args[j].args;
+				break;
+			}
+		}
+		len=snprintf( e, sizeof( e), "%s(", functions[i].name);
+		if( args){
+			len+=snprintf( e+len, sizeof( e)-len, "%s", args);
+		}else{
+			for( j=0; j<functions[i].min_argc; j++){
+				len+=snprintf( e+len, sizeof( e)-len, j? ", x": "x");
+			}
+		}
+		snprintf( e+len, sizeof( e)-len, ")");
+		bench_solve( "function", e, e, iterations, NULL, NULL);
+	}
+}
+
+
+int main( int argc, char *argv[]){
+	long iterations=DEFAULT_ITERATIONS;
+	unsigned long long seed=1;
+	double *data;
+	long i;
+
+	if( argc>1 && ( iterations=atol( argv[1]))<=0){
+		fprintf( stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+		return 1;
+	}
+	if( exp_register_function( "registered", 1, 1, 0, registered_twice, NULL)){
+		fprintf( stderr, "Could not register function\n");
+		return 1;
+	}
+	exp_counting_allocator_init( &counter, NULL);
+	exp_set_allocator( &counter.allocator);
+
+	printf( "# libexpression benchmark\n");
+	printf( "# group\tname\titerations\tns/op\tallocs/op\tbytes/op\n");
+	for( i=0; i<sizeof( expressions)/sizeof( expressions[0]); i++){
+		bench_create( "create", expressions[i], iterations/10>0? iterations/10: 1);
+	}
+	for( i=0; i<sizeof( expressions)/sizeof( expressions[0]); i++){
+		bench_solve( "solve", expressions[i], expressions[i], iterations, NULL, NULL);
+	}
+	for( i=0; i<sizeof( operators)/sizeof( operators[0]); i++){
+		bench_solve( "operator", operators[i], operators[i], iterations, NULL, NULL);
+	}
+	bench_functions( iterations);
+
+	bench_solve( "handler", "bound parameter", "x+1", iterations, NULL, NULL);
+	bench_solve( "handler", "phandler", "x+1", iterations, phandler, NULL);
+	bench_solve( "handler", "registered function", "registered(x)", iterations, NULL, NULL);
+	bench_solve( "handler", "fhandler", "handled(x)", iterations, NULL, fhandler);
+
+	//columns x, y, z and w follow each other
+	if( NULL==( data=malloc( sizeof( double)*iterations*4))){
+		fprintf( stderr, "Out of memory\n");
+		return 1;
+	}
+	for( i=0; i<iterations*4; i++){
+		seed=seed*6364136223846793005ULL+1442695040888963407ULL;
+		data[i]=( seed>>11)*( 1.0/9007199254740992.0);
+	}
+	for( i=0; i<sizeof( batch_expressions)/sizeof( batch_expressions[0]); i++){
+		bench_batch( batch_expressions[i], data, iterations);
+	}
+	free( data);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Cache of compiled expressions.
+ */
+
+#include "libexpression-private.h"
+
+
+//The cache is split into shards with separate locks, so threads that look up
+//different expressions rarely wait for each other. Every shard holds at
+//least CACHE_SHARD_MIN expressions, so small caches have fewer shards and
+//the cache of less than 2*CACHE_SHARD_MIN expressions is a single LRU list.
+#define CACHE_SHARDS 16
+#define CACHE_SHARD_MIN 64
+
+
+typedef struct cache_entry_s{
+	struct cache_entry_s *next;      // next entry in the bucket
+	struct cache_entry_s *newer;     // LRU list of the shard
+	struct cache_entry_s *older;
+	char *e;                         // source text of the expression
+	program_t *program;
+} cache_entry_t;
+
+
+typedef struct {
+	char lock;
+	cache_entry_t **buckets;
+	int buckets_len;                 // power of two
+	cache_entry_t lru;               // head of the LRU list: lru.older is the most recently used entry
+	int len;
+	int maxlen;
+	unsigned long long hits;
+	unsigned long long misses;
+} cache_shard_t;
+
+
+struct exp_cache_s{
+	cache_shard_t shards[CACHE_SHARDS];
+	int shards_len;                  // power of two, the shards that are used
+};
+
+
+//The lock is held only while the entry is found and moved in the LRU list
+#define shard_lock( s) exp_spin_lock( &(s)->lock)
+#define shard_unlock( s) exp_spin_unlock( &(s)->lock)
+
+#define lru_unlink( entry) {\
+	(entry)->newer->older=(entry)->older;\
+	(entry)->older->newer=(entry)->newer;\
+}
+
+#define lru_push( s, entry) {\
+	(entry)->newer=&(s)->lru;\
+	(entry)->older=(s)->lru.older;\
+	(s)->lru.older->newer=(entry);\
+	(s)->lru.older=(entry);\
+}
+
+
+/*
+ * FNV-1a hash of the string
+ */
+uint64_t exp_hash_text( const char *s){
+	uint64_t h=0xcbf29ce484222325ULL;
+
+	while( *s){
+		h^=(unsigned char)*s++;
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+exp_cache_t *exp_cache_create( int capacity){
+	exp_cache_t *cache=NULL;
+	cache_shard_t *s;
+	int i;
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_COMPILE);
+
+	if( capacity>=1 && ( cache=exp_mem_calloc( 1, sizeof( exp_cache_t)))){
+		for( cache->shards_len=1; cache->shards_len<CACHE_SHARDS && capacity/( cache->shards_len*2)>=CACHE_SHARD_MIN; cache->shards_len<<=1);
+		for( i=0; i<cache->shards_len; i++){
+			s=&cache->shards[i];
+			s->maxlen=capacity/cache->shards_len+( i<capacity%cache->shards_len ? 1 : 0);
+			for( s->buckets_len=1; s->buckets_len<s->maxlen; s->buckets_len<<=1);
+			s->lru.newer=s->lru.older=&s->lru;
+			if( NULL==( s->buckets=exp_mem_calloc( s->buckets_len, sizeof( cache_entry_t *)))){
+				cache=exp_cache_free( cache);
+				break;
+			}
+		}
+	}
+	HEAP_LEAVE();
+	return cache;
+}
+
+
+exp_cache_t *exp_cache_free( exp_cache_t *cache){
+	cache_entry_t *entry, *next;
+	int i;
+
+	if( cache){
+		HEAP_ENTER( exp_global_allocator, EXP_PHASE_COMPILE);
+		for( i=0; i<cache->shards_len; i++){
+			for( entry=cache->shards[i].lru.older; entry && entry !=&cache->shards[i].lru; entry=next){
+				next=entry->older;
+				exp_program_free( entry->program);
+				exp_mem_free( entry->e);
+				exp_mem_free( entry);
+			}
+			exp_mem_free( cache->shards[i].buckets);
+		}
+		exp_mem_free( cache);
+		HEAP_LEAVE();
+	}
+	return NULL;
+}
+
+
+/*
+ * Finds the entry and makes it the most recently used one, the shard is
+ * locked by the caller.
+ *
+ * @return Program of the entry with a new reference or NULL if it is not found
+ */
+static program_t *shard_find( cache_shard_t *s, const char *e, uint64_t hash){
+	cache_entry_t *entry;
+
+	for( entry=s->buckets[hash & ( s->buckets_len-1)]; entry; entry=entry->next){
+		if( entry->program->hash==hash && 0==strcmp( entry->e, e)){
+			lru_unlink( entry);
+			lru_push( s, entry);
+			return exp_program_ref( entry->program);
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Removes the least recently used entry, the shard is locked by the caller.
+ */
+static void shard_evict( cache_shard_t *s){
+	cache_entry_t *entry=s->lru.newer, **prev;
+
+	for( prev=&s->buckets[entry->program->hash & ( s->buckets_len-1)]; *prev !=entry; prev=&(*prev)->next);
+	*prev=entry->next;
+	lru_unlink( entry);
+	s->len--;
+	exp_program_free( entry->program);
+	exp_mem_free( entry->e);
+	exp_mem_free( entry);
+}
+
+
+/*
+ * Returns the program of the expression from the cache, or compiles the
+ * expression and adds the program to the cache. The expression is compiled
+ * without lock, if another thread adds the same expression meanwhile, its
+ * program is used.
+ */
+static program_t *cache_program( exp_cache_t *cache, const char *e, exp_error_t *ercode, char *error, int *erpos){
+	cache_shard_t *s;
+	cache_entry_t *entry;
+	program_t *p, *found;
+	uint64_t hash=exp_hash_text( e);
+
+	//high bits of FNV-1a of similar texts are alike, they are mixed first
+	s=&cache->shards[(( hash*0x9e3779b97f4a7c15ULL)>>60) & ( cache->shards_len-1)];
+	shard_lock( s);
+	p=shard_find( s, e, hash);
+	if( p){
+		s->hits++;
+	}else{
+		s->misses++;
+	}
+	shard_unlock( s);
+	if( p){
+		return p;
+	}
+
+	if( NULL==( p=exp_compile( e, ercode, error, erpos))){
+		return NULL;
+	}
+	if( NULL==( entry=exp_mem_calloc( 1, sizeof( cache_entry_t))) || NULL==( entry->e=exp_mem_strdup( e))){
+		//the program is still valid, it is just not cached
+		exp_mem_free( entry);
+		return p;
+	}
+	entry->program=exp_program_ref( p);
+
+	shard_lock( s);
+	if(( found=shard_find( s, e, hash))){
+		shard_unlock( s);
+		exp_program_free( entry->program);
+		exp_mem_free( entry->e);
+		exp_mem_free( entry);
+		exp_program_free( p);
+		return found;
+	}
+	if( s->len>=s->maxlen){
+		shard_evict( s);
+	}
+	entry->next=s->buckets[hash & ( s->buckets_len-1)];
+	s->buckets[hash & ( s->buckets_len-1)]=entry;
+	lru_push( s, entry);
+	s->len++;
+	shard_unlock( s);
+	return p;
+}
+
+
+expression_t *exp_create_cached( exp_cache_t *cache, const char *e, exp_error_t *ercode, char *error, int *erpos){
+	expression_t *ret=NULL;
+	program_t *p;
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_COMPILE);
+
+	if(( p=cache_program( cache, e, ercode, error, erpos))){
+		if( NULL==( ret=exp_mem_calloc( 1, sizeof( expression_t))) || NULL==( ret->e=exp_mem_strdup( e))){
+			exp_mem_free( ret);
+			ret=NULL;
+			exp_program_free( p);
+			*ercode=EXP_ER_NOMEM;
+			strcpy( error, "Memory error");
+			*erpos=0;
+		}else{
+			ret->program=p;
+		}
+	}
+	HEAP_LEAVE();
+	return ret;
+}
+
+
+void exp_cache_stats( exp_cache_t *cache, unsigned long long *hits, unsigned long long *misses, int *len){
+	cache_shard_t *s;
+	int i;
+
+	*hits=0;
+	*misses=0;
+	*len=0;
+	for( i=0; i<cache->shards_len; i++){
+		s=&cache->shards[i];
+		shard_lock( s);
+		*hits+=s->hits;
+		*misses+=s->misses;
+		*len+=s->len;
+		shard_unlock( s);
+	}
+}
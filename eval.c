@@ -24,10 +24,29 @@
 
 #include "libexpression-private.h"
 
+
+//Integer and boolean operands are evaluated with integer kernels, without
+//conversion to double. The macro returns 1 and stores the value in `i' if
+//the operand is such.
+#define integer_operand( v, i) ({\
+	int _ret=1;\
+	if( (v)->type==T_INTEGER){\
+		*(i)=(v)->value.integer;\
+	}else if( (v)->type==T_BOOLEAN){\
+		*(i)=(v)->value.boolean? 1 : 0;\
+	}else{\
+		_ret=0;\
+	}\
+	_ret;\
+})
+
+
 /*
- * @return Returns 0 if the string contains a number or EXP_ER_NONNUMERIC otherwise
+ * Parses the number in the string, the number is stored to `ret'.
+ * @return Returns NUMBER_NONE if the string does not contain a number or the
+ * kind of the number otherwise
  */
-static int is_number( char *s, int64_t *i, double *d){
+static int is_number( char *s, scalar_t *ret){
 	int slen;
 	int rlen;
 	int c;
@@ -50,11 +69,10 @@ static int is_number( char *s, int64_t *i, double *d){
 			rlen++;
 		}
 		if(rlen==slen){
-			*i=(int64_t)num;
-			*d=(double)num;
-			return 0;
+			ret->integer=(int64_t)num;
+			return NUMBER_UNSIGNED;
 		}else{
-			return EXP_ER_NONNUMERIC;
+			return NUMBER_NONE;
 		}
 
 	}else{
@@ -107,38 +125,64 @@ static int is_number( char *s, int64_t *i, double *d){
 		rlen=p-s;
 		if(rlen==0 || (rlen==1 && pointfound)){
 			if( 0==slen){
-				return EXP_ER_NONNUMERIC;
+				return NUMBER_NONE;
 			}
 			//it might be a boolean string
 			if(0==strncasecmp( s, "true", slen) ||0==strncasecmp( s, "yes", slen) ||0==strncasecmp( s, "on", slen) ||
 					0==strncasecmp( s, "t", slen) ||0==strncasecmp( s, "y", slen)){
-				*i=1;
-				*d=1;
-				return 0;
+				ret->integer=1;
+				return NUMBER_INTEGER;
 			}else if(0==strncasecmp( s, "false", slen) ||0==strncasecmp( s, "no", slen) ||0==strncasecmp( s, "off", slen) ||
 					0==strncasecmp( s, "f", slen) ||0==strncasecmp( s, "n", slen)){
-				*i=0;
-				*d=0;
-				return 0;
+				ret->integer=0;
+				return NUMBER_INTEGER;
 			}
-			return EXP_ER_NONNUMERIC;
+			return NUMBER_NONE;
 
 		}else if(rlen==slen){
 			//ok, it's a number
 			if(is_real){
-				*i=(int64_t)atof( s);
-				*d=atof( s);
+				ret->real=atof( s);
+				return NUMBER_REAL;
 			}else{
-				*i=atoll( s);
-				*d=(double)atoll( s);
+				ret->integer=atoll( s);
+				return NUMBER_INTEGER;
 			}
-			return 0;
 		}else{
-			return EXP_ER_NONNUMERIC;
+			return NUMBER_NONE;
 		}
 	}
 }
 
+/*
+ * Converts the string value to a number. The string is parsed only once, the
+ * number is cached in the value, so that the string that is compared or used
+ * in arithmetic many times is not parsed again. Numeric form of string
+ * constants is cached at compile time.
+ * @return Returns 0 if the string contains a number or EXP_ER_NONNUMERIC otherwise
+ */
+int exp_string_number( value_t *v, int64_t *i, double *d){
+	if( v->number==NUMBER_UNKNOWN){
+		v->number=v->value.string ? is_number( v->value.string, &v->parsed) : NUMBER_NONE;
+	}
+	switch( v->number){
+		case NUMBER_INTEGER:
+			*i=v->parsed.integer;
+			*d=(double)v->parsed.integer;
+			return 0;
+		case NUMBER_UNSIGNED:
+			*i=v->parsed.integer;
+			*d=(double)(uint64_t)v->parsed.integer;
+			return 0;
+		case NUMBER_REAL:
+			*i=(int64_t)v->parsed.real;
+			*d=v->parsed.real;
+			return 0;
+		default:
+			return EXP_ER_NONNUMERIC;
+	}
+}
+
 int exp_to_boolean(value_t *v, int *ret){
 	char *s;
 	int slen;
@@ -197,7 +241,7 @@ int exp_to_double( value_t *v, double *ret){
 			}
 			break;
 		case T_STRING:
-			if(v->value.string==NULL ||( 0 !=is_number(v->value.string, &i, ret))){
+			if( 0 !=exp_string_number( v, &i, ret)){
 				return EXP_ER_NONNUMERIC;
 			}
 			break;
@@ -229,7 +273,7 @@ int exp_to_integer( value_t *v, int64_t *ret){
 			}
 			break;
 		case T_STRING:
-			if(v->value.string==NULL ||( 0 !=is_number(v->value.string, ret, &d))){
+			if( 0 !=exp_string_number( v, ret, &d)){
 				return EXP_ER_NONNUMERIC;
 			}
 			break;
@@ -249,7 +293,7 @@ int exp_is_integer( value_t *v, int64_t *i){
 			return 0;
 			break;
 		case T_REAL:
-			if( v->value.real>INT64_MAX || v->value.real< INT64_MIN){
+			if( !REAL_FITS_INTEGER( v->value.real)){
 				return EXP_ER_NONINTEGER;
 			}else if( round(v->value.real) !=v->value.real){
 				return EXP_ER_NONINTEGER;
@@ -263,9 +307,10 @@ int exp_is_integer( value_t *v, int64_t *i){
 			return 0;
 			break;
 		case T_STRING:
-			if(v->value.string==NULL ||( 0 !=is_number(v->value.string, &i1, &d1))){
+			if( 0 !=exp_string_number( v, &i1, &d1)){
 				return EXP_ER_NONNUMERIC;
-			}else if(d1<=INT64_MAX && d1>=INT64_MIN && i1==round( d1)){
+			}else if( REAL_FITS_INTEGER( d1) && i1==round( d1)){
+				*i=i1;
 				return 0;
 			}else{
 				return EXP_ER_NONINTEGER;
@@ -281,48 +326,75 @@ int exp_is_integer( value_t *v, int64_t *i){
 
 
 
-int exp_to_string(value_t *v, char **ret){
-	char *s;
-
+/*
+ * Returns string representation of the value without copying the string.
+ * Numbers are printed to the buffer of EXP_NUMBER_LEN characters.
+ *
+ * @return The string or NULL if the value can not be converted
+ */
+const char *exp_string_view( value_t *v, char *buffer){
 	switch( v->type){
 		case T_INTEGER:
-			if(( s=malloc(128))){
-				snprintf(s, 128, "%lld", (long long int)v->value.integer);
-			}else{
-				return EXP_ER_NOMEM;
-			}
-			break;
+			snprintf( buffer, EXP_NUMBER_LEN, "%lld", (long long int)v->value.integer);
+			return buffer;
 		case T_REAL:
-			if(( s=malloc(128))){
-				snprintf(s, 128, "%f", v->value.real);
-			}else{
-				return EXP_ER_NOMEM;
-			}
-			break;
+			snprintf( buffer, EXP_NUMBER_LEN, "%f", v->value.real);
+			return buffer;
 		case T_BOOLEAN:
-			if(( s=malloc(8))){
-				sprintf(s, "%s", v->value.boolean? "true" : "false");
-			}else{
-				return EXP_ER_NOMEM;
-			}
-			break;
+			return v->value.boolean? "true" : "false";
 		case T_STRING:
-			if(NULL==( s=strdup( v->value.string))){
-				return EXP_ER_NOMEM;
-			}
-			break;
+			return v->value.string;
 		default:
-			return EXP_ER_INVALARGV;
-			break;
+			return NULL;
+	}
+}
+
+
+int exp_to_string(value_t *v, char **ret){
+	char buffer[EXP_NUMBER_LEN];
+	const char *s;
+
+	if( NULL==( s=exp_string_view( v, buffer))){
+		return EXP_ER_INVALARGV;
+	}else if( NULL==( *ret=exp_mem_strdup( s))){
+		return EXP_ER_NOMEM;
 	}
-	*ret=s;
 	return 0;
 }
 
-static int operator_evaluate_boolnot( token_t *op, value_t *ret){
+
+/*
+ * Converts the value to a new string like exp_to_string(), but the string of
+ * the value is moved instead of copying, when the value owns it. The value
+ * is left without type in this case.
+ */
+int exp_take_string( value_t *v, char **ret){
+	if( v->type==T_STRING && v->value.string && !v->borrowed){
+		*ret=v->value.string;
+		v->type=T_NONE;
+		v->value.string=NULL;
+		return 0;
+	}
+	return exp_to_string( v, ret);
+}
+
+/*
+ * Releases memory held by the value and resets its type
+ */
+void exp_value_clear( value_t *v){
+	if( v->type==T_STRING && v->value.string && !v->borrowed){
+		exp_mem_free( v->value.string);
+	}
+	v->type=T_NONE;
+	v->borrowed=0;
+	v->number=NUMBER_UNKNOWN;
+	v->value.string=NULL;
+}
+
+static int operator_evaluate_boolnot( value_t *op, value_t *ret){
 	int status, i1=0;
 
-	if( 0 !=(status=exp_to_boolean( &op->param, &i1))){
+	if( 0 !=(status=exp_to_boolean( &op[0], &i1))){
 		return status;
 	}
 	ret->value.boolean= i1? 0 : 1;
@@ -330,11 +402,11 @@ static int operator_evaluate_boolnot( token_t *op, value_t *ret){
 	return 0;
 }
 
-static int operator_evaluate_bitnot( token_t *op, value_t *ret){
+static int operator_evaluate_bitnot( value_t *op, value_t *ret){
 	int status;
 	int64_t i1=0;
 
-	if( 0 !=(status=exp_is_integer( &op->param, &i1))){
+	if( 0 !=(status=exp_is_integer( &op[0], &i1))){
 		return status;
 	}
 	ret->value.integer= ~i1;
@@ -342,20 +414,26 @@ static int operator_evaluate_bitnot( token_t *op, value_t *ret){
 	return 0;
 }
 
-static int operator_evaluate_uminus( token_t *op, value_t *ret){
-	if(op->param.type==T_INTEGER){
-		ret->value.integer=-op->param.value.integer;
-		ret->type=T_INTEGER;
-	}else if( op->param.type==T_REAL){
-		ret->value.real=-op->param.value.real;
+static int operator_evaluate_uminus( value_t *op, value_t *ret){
+	if(op[0].type==T_INTEGER){
+		if( op[0].value.integer==INT64_MIN){
+			//the result does not fit into integer
+			ret->value.real=-(double)op[0].value.integer;
+			ret->type=T_REAL;
+		}else{
+			ret->value.integer=-op[0].value.integer;
+			ret->type=T_INTEGER;
+		}
+	}else if( op[0].type==T_REAL){
+		ret->value.real=-op[0].value.real;
 		ret->type=T_REAL;
-	}else if( op->param.type==T_BOOLEAN){
-		ret->value.integer=op->param.value.boolean? -1 : 0;
+	}else if( op[0].type==T_BOOLEAN){
+		ret->value.integer=op[0].value.boolean? -1 : 0;
 		ret->type=T_INTEGER;
-	}else if(op->param.type==T_STRING){
+	}else if(op[0].type==T_STRING){
 		int64_t i;
 		double d;
-		if(op->param.value.string && 0==is_number( op->param.value.string, &i, &d)){
+		if( 0==exp_string_number( &op[0], &i, &d)){
 			ret->value.real=-d;
 			ret->type=T_REAL;
 		}else{
@@ -367,20 +445,20 @@ static int operator_evaluate_uminus( token_t *op, value_t *ret){
 	return 0;
 }
 
-static int operator_evaluate_uplus( token_t *op, value_t *ret){
-	if(op->param.type==T_INTEGER){
-		ret->value.integer=op->param.value.integer;
+static int operator_evaluate_uplus( value_t *op, value_t *ret){
+	if(op[0].type==T_INTEGER){
+		ret->value.integer=op[0].value.integer;
 		ret->type=T_INTEGER;
-	}else if( op->param.type==T_REAL){
-		ret->value.real=op->param.value.real;
+	}else if( op[0].type==T_REAL){
+		ret->value.real=op[0].value.real;
 		ret->type=T_REAL;
-	}else if( op->param.type==T_BOOLEAN){
-		ret->value.integer=op->param.value.boolean? 1 : 0;
+	}else if( op[0].type==T_BOOLEAN){
+		ret->value.integer=op[0].value.boolean? 1 : 0;
 		ret->type=T_INTEGER;
-	}else if(op->param.type==T_STRING){
+	}else if(op[0].type==T_STRING){
 		int64_t i;
 		double d;
-		if(op->param.value.string && 0==is_number( op->param.value.string, &i, &d)){
+		if( 0==exp_string_number( &op[0], &i, &d)){
 			ret->value.real=d;
 			ret->type=T_REAL;
 		}else{
@@ -392,13 +470,31 @@ static int operator_evaluate_uplus( token_t *op, value_t *ret){
 	return 0;
 }
 
-static int operator_evaluate_hat( token_t *op, value_t *ret){
+static int operator_evaluate_hat( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2, r;
+
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2) && i2>0){
+		//exponentiation by squaring, falls through to pow() on overflow
+		r=1;
+		while( 1){
+			if(( i2 & 1) && __builtin_mul_overflow( r, i1, &r)){
+				break;
+			}
+			i2>>=1;
+			if( 0==i2){
+				ret->value.integer=r;
+				ret->type=T_INTEGER;
+				return 0;
+			}
+			if( __builtin_mul_overflow( i1, i1, &i1)){
+				break;
+			}
+		}
+	}
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
 		return status;
 	}else{
 		if((d1==0) && (d2<=0)){
@@ -407,7 +503,7 @@ static int operator_evaluate_hat( token_t *op, value_t *ret){
 		}else{
 			if(d1<0){
 				int64_t i2;
-				if(0==(status=exp_is_integer( &op->next->param, &i2))){
+				if(0==(status=exp_is_integer( &op[1], &i2))){
 					ret->value.real=pow( d1, i2);
 					ret->type=T_REAL;
 					return 0;
@@ -428,13 +524,29 @@ static int operator_evaluate_hat( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_div( token_t *op, value_t *ret){
+static int operator_evaluate_div( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		if( i2==0){
+			return EXP_ER_DIVBYZERO;
+		}else if( i2 !=-1 && i1 % i2==0){
+			ret->value.integer=i1 / i2;
+			ret->type=T_INTEGER;
+			return 0;
+		}else if( i2==-1 && i1 !=INT64_MIN){
+			ret->value.integer=-i1;
+			ret->type=T_INTEGER;
+			return 0;
+		}
+		ret->value.real=(double)i1 / (double)i2;
+		ret->type=T_REAL;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
 		return status;
 	}else if(d2==0){
 		return EXP_ER_DIVBYZERO;
@@ -445,37 +557,41 @@ static int operator_evaluate_div( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_mod( token_t *op, value_t *ret){
+static int operator_evaluate_mod( value_t *op, value_t *ret){
 	int status;
+	int64_t i1=0, i2=0;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-
-	}else{
-		int64_t i1=0, i2=0;
-		if((0==(status=exp_is_integer( &op->param, &i1))) && (0==(status=exp_is_integer( &op->next->param, &i2)))){
-			if(i2==0){
-				return EXP_ER_DIVBYZERO;
-			}else{
-				ret->value.integer=i1 % i2;
-				ret->type=T_INTEGER;
-				return 0;
-			}
-
-
+	if((0==(status=exp_is_integer( &op[0], &i1))) && (0==(status=exp_is_integer( &op[1], &i2)))){
+		if(i2==0){
+			return EXP_ER_DIVBYZERO;
 		}else{
-			return status;
+			//INT64_MIN % -1 overflows
+			ret->value.integer=( i2==-1)? 0 : i1 % i2;
+			ret->type=T_INTEGER;
+			return 0;
 		}
+	}else{
+		return status;
 	}
 }
 
-static int operator_evaluate_mul( token_t *op, value_t *ret){
+static int operator_evaluate_mul( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		if( !__builtin_mul_overflow( i1, i2, &ret->value.integer)){
+			ret->type=T_INTEGER;
+		}else{
+			//the result does not fit into integer, it is promoted to real
+			ret->value.real=(double)i1 * (double)i2;
+			ret->type=T_REAL;
+		}
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
 		return status;
 	}else{
 		ret->value.real=d1 * d2;
@@ -484,44 +600,63 @@ static int operator_evaluate_mul( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_concat( token_t *op, value_t *ret){
-	int status;
+/*
+ * Concatenates the operands. The operands are read in place, the string of the
+ * left operand is extended when it is owned by the operand, so that chains
+ * like a+b+c+d do not copy the left part again and again.
+ */
+static int operator_concat( value_t *op, value_t *ret){
+	char b1[EXP_NUMBER_LEN], b2[EXP_NUMBER_LEN];
+	const char *s1, *s2;
+	size_t l1, l2;
+	char *s;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if( op->param.type==T_STRING ||op->next->param.type==T_STRING ){
-		char *s1;
-		if( 0==(status=exp_to_string( &op->param, &s1))){
-			char *s2;
-			if( 0==(status=exp_to_string( &op->next->param, &s2))){
-				char *s;
-				int l=strlen(s1)+strlen(s2);
-				if(( s=malloc( l+1))){
-					snprintf( s, l+1, "%s%s", s1, s2);
-					ret->type=T_STRING;
-					ret->value.string=s;
-				}else{
-					status=EXP_ER_NOMEM;
-				}
-				free( s2);
+	if( op[0].type==T_STRING ||op[1].type==T_STRING ){
+		if( NULL==( s1=exp_string_view( &op[0], b1)) || NULL==( s2=exp_string_view( &op[1], b2))){
+			return EXP_ER_INVALARGV;
+		}
+		l1=strlen( s1);
+		l2=strlen( s2);
+		if( op[0].type==T_STRING && !op[0].borrowed){
+			if( NULL==( s=exp_mem_realloc( op[0].value.string, l1+l2+1))){
+				return EXP_ER_NOMEM;
 			}
-			free( s1);
+			//the string is moved to the result
+			op[0].type=T_NONE;
+			op[0].value.string=NULL;
+		}else if( NULL==( s=exp_mem_malloc( l1+l2+1))){
+			return EXP_ER_NOMEM;
+		}else{
+			memcpy( s, s1, l1);
 		}
-		return status;
+		memcpy( s+l1, s2, l2+1);
+		ret->type=T_STRING;
+		ret->value.string=s;
+		return 0;
 
 	}else{
 		return EXP_ER_NONSTRING;
 	}
 }
 
-static int operator_evaluate_plus( token_t *op, value_t *ret){
+static int operator_evaluate_plus( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING ||op->next->param.type==T_STRING ){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		if( !__builtin_add_overflow( i1, i2, &ret->value.integer)){
+			ret->type=T_INTEGER;
+		}else{
+			//the result does not fit into integer, it is promoted to real
+			ret->value.real=(double)i1 + (double)i2;
+			ret->type=T_REAL;
+		}
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING ||op[1].type==T_STRING ){
 			if( 0 != operator_concat( op, ret)){
 				return status;
 			}else{
@@ -537,13 +672,23 @@ static int operator_evaluate_plus( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_minus( token_t *op, value_t *ret){
+static int operator_evaluate_minus( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		if( !__builtin_sub_overflow( i1, i2, &ret->value.integer)){
+			ret->type=T_INTEGER;
+		}else{
+			//the result does not fit into integer, it is promoted to real
+			ret->value.real=(double)i1 - (double)i2;
+			ret->type=T_REAL;
+		}
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
 		return status;
 	}else{
 		ret->value.real=d1 - d2;
@@ -552,51 +697,48 @@ static int operator_evaluate_minus( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_shiftleft( token_t *op, value_t *ret){
+static int operator_evaluate_shiftleft( value_t *op, value_t *ret){
 	int status;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
+	if((0==(status=exp_is_integer( &op[0], &i1))) && (0==(status=exp_is_integer( &op[1], &i2)))){
+		ret->value.integer=i1 << i2;
+		ret->type=T_INTEGER;
+		return 0;
 	}else{
-		int64_t i1, i2;
-		if((0==(status=exp_is_integer( &op->param, &i1))) && (0==(status=exp_is_integer( &op->next->param, &i2)))){
-			ret->value.integer=i1 << i2;
-			ret->type=T_INTEGER;
-			return 0;
-		}else{
-			return EXP_ER_NONINTEGER;
-		}
+		return EXP_ER_NONINTEGER;
 	}
 }
 
-static int operator_evaluate_shiftright( token_t *op, value_t *ret){
+static int operator_evaluate_shiftright( value_t *op, value_t *ret){
 	int status;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
+	if((0==(status=exp_is_integer( &op[0], &i1))) && (0==(status=exp_is_integer( &op[1], &i2)))){
+		ret->value.integer=i1 >> i2;
+		ret->type=T_INTEGER;
+		return 0;
 	}else{
-		int64_t i1, i2;
-		if((0==(status=exp_is_integer( &op->param, &i1))) && (0==(status=exp_is_integer( &op->next->param, &i2)))){
-			ret->value.integer=i1 >> i2;
-			ret->type=T_INTEGER;
-			return 0;
-		}else{
-			return EXP_ER_NONINTEGER;
-		}
+		return EXP_ER_NONINTEGER;
 	}
 }
 
-static int operator_evaluate_gt( token_t *op, value_t *ret){
+static int operator_evaluate_gt( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 > i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)>0){
+				if( strcmp( op[0].value.string, op[1].value.string)>0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -615,17 +757,22 @@ static int operator_evaluate_gt( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_lt( token_t *op, value_t *ret){
+static int operator_evaluate_lt( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 < i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)<0){
+				if( strcmp( op[0].value.string, op[1].value.string)<0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -644,17 +791,22 @@ static int operator_evaluate_lt( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_ge( token_t *op, value_t *ret){
+static int operator_evaluate_ge( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 >= i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)>=0){
+				if( strcmp( op[0].value.string, op[1].value.string)>=0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -673,17 +825,22 @@ static int operator_evaluate_ge( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_le( token_t *op, value_t *ret){
+static int operator_evaluate_le( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 <= i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)<=0){
+				if( strcmp( op[0].value.string, op[1].value.string)<=0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -702,17 +859,22 @@ static int operator_evaluate_le( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_boolequals( token_t *op, value_t *ret){
+static int operator_evaluate_boolequals( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 == i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)==0){
+				if( strcmp( op[0].value.string, op[1].value.string)==0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -732,17 +894,22 @@ static int operator_evaluate_boolequals( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_notequals( token_t *op, value_t *ret){
+static int operator_evaluate_notequals( value_t *op, value_t *ret){
 	int status;
 	double d1, d2;
+	int64_t i1, i2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
-		if( op->param.type==T_STRING && op->next->param.type==T_STRING){
-			if(op->param.value.string && op->next->param.value.string){
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		ret->value.boolean=i1 != i2 ? 1 : 0;
+		ret->type=T_BOOLEAN;
+		return 0;
+	}
+
+	if((0 !=(status=exp_to_double( &op[0], &d1))) ||(0 !=(status=exp_to_double( &op[1], &d2)))){
+		if( op[0].type==T_STRING && op[1].type==T_STRING){
+			if(op[0].value.string && op[1].value.string){
 				ret->type=T_BOOLEAN;
-				if( strcmp( op->param.value.string, op->next->param.value.string)!=0){
+				if( strcmp( op[0].value.string, op[1].value.string)!=0){
 					ret->value.boolean=1;
 				}else{
 					ret->value.boolean=0;
@@ -761,47 +928,37 @@ static int operator_evaluate_notequals( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_bitand( token_t *op, value_t *ret){
+static int operator_evaluate_bitand( value_t *op, value_t *ret){
 	int status;
 	int64_t i1=0, i2=0;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
+	if((0==(status=exp_is_integer( &op[0], &i1))) && (0==(status=exp_is_integer( &op[1], &i2)))){
+		ret->value.integer=i1 & i2;
+		ret->type=T_INTEGER;
+		return 0;
 	}else{
-		if((0==(status=exp_is_integer( &op->param, &i1))) && (0==(status=exp_is_integer( &op->next->param, &i2)))){
-			ret->value.integer=i1 & i2;
-			ret->type=T_INTEGER;
-			return 0;
-		}else{
-			return EXP_ER_NONINTEGER;
-		}
+		return EXP_ER_NONINTEGER;
 	}
 }
 
-static int operator_evaluate_bitor( token_t *op, value_t *ret){
+static int operator_evaluate_bitor( value_t *op, value_t *ret){
 	int status;
 	int64_t i1=0, i2=0;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
+	if((0==(status=exp_is_integer( &op[0], &i1))) && (0==(status=exp_is_integer( &op[1], &i2)))){
+		ret->value.integer=i1 | i2;
+		ret->type=T_INTEGER;
+		return 0;
 	}else{
-		if((0==(status=exp_is_integer( &op->param, &i1))) && (0==(status=exp_is_integer( &op->next->param, &i2)))){
-			ret->value.integer=i1 | i2;
-			ret->type=T_INTEGER;
-			return 0;
-		}else{
-			return EXP_ER_NONINTEGER;
-		}
+		return EXP_ER_NONINTEGER;
 	}
 }
 
-static int operator_evaluate_booland( token_t *op, value_t *ret){
+static int operator_evaluate_booland( value_t *op, value_t *ret){
 	int status;
 	int d1, d2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_boolean( &op->param, &d1))) ||(0 !=(status=exp_to_boolean( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_boolean( &op[0], &d1))) ||(0 !=(status=exp_to_boolean( &op[1], &d2)))){
 		return status;
 	}else{
 		ret->value.boolean=d1 && d2;
@@ -810,13 +967,11 @@ static int operator_evaluate_booland( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_boolor( token_t *op, value_t *ret){
+static int operator_evaluate_boolor( value_t *op, value_t *ret){
 	int status;
 	int d1, d2;
 
-	if( NULL==op->next){
-		return EXP_ER_INVALARGC;
-	}else if((0 !=(status=exp_to_boolean( &op->param, &d1))) ||(0 !=(status=exp_to_boolean( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_boolean( &op[0], &d1))) ||(0 !=(status=exp_to_boolean( &op[1], &d2)))){
 		return status;
 	}else{
 		ret->value.boolean=d1 || d2;
@@ -825,19 +980,18 @@ static int operator_evaluate_boolor( token_t *op, value_t *ret){
 	}
 }
 
-static int operator_evaluate_equals( token_t *op, value_t *ret){
+static int operator_evaluate_equals( value_t *op, value_t *ret){
 	return operator_evaluate_boolequals( op, ret);
 }
 
 
 
-typedef int operator_f( token_t *, value_t *);
+typedef int operator_f( value_t *, value_t *);
 
-int exp_eval_operator( token_t **stack, operator_t operator, int *stack_len){
-	token_t *s=*stack;
-	token_t *temp, *opqueue, *result;
+int exp_eval_operator( value_t *stack, operator_t operator, int *stack_len){
+	value_t *op, result;
 	int status;
-	int c;
+	int c, i;
 	operator_f *f;
 
 
@@ -874,47 +1028,479 @@ int exp_eval_operator( token_t **stack, operator_t operator, int *stack_len){
 		return EXP_ER_INVALARGC;
 
 	}else{
-		(*stack_len)-=c;
-		opqueue=NULL;
-		while( c){
-			temp=s;
-			s=s->next;
+		op=stack+(*stack_len)-c;
+		memset( &result, 0, sizeof( value_t));
 
-			temp->next=opqueue;
-			opqueue=temp;
+		if(0 !=(status=(*f)( op, &result))){
+			exp_value_clear( &result);
+			return status;
+
+		}else{
+			int64_t r;
 
-			c--;
+			if( result.type==T_REAL && 0==exp_is_integer( &result, &r)){
+				result.type=T_INTEGER;
+				result.value.integer=r;
+			}
+			//Replace operands with the result
+			for( i=0; i<c; i++){
+				exp_value_clear( &op[i]);
+			}
+			op[0]=result;
+			(*stack_len)-=c-1;
+			return 0;
 		}
-		if(NULL==(result=calloc( 1, sizeof(token_t)))){
-			exp_token_free(opqueue);
-			*stack=s;
-			return EXP_ER_NOMEM;
+	}
+}
+
+
+/*
+ * Tells if the string is not a number and it does not become a number when
+ * anything is appended to it, see is_number(). Numbers start with a digit,
+ * a sign or a point, boolean strings are prefixes of the words below.
+ */
+static int is_text( const char *s){
+	static const char *words[]={ "true", "yes", "on", "false", "no", "off", NULL};
+	int i, k;
+
+	while( IS_SPACE( *s)) s++;
+	if( IS_NUMERIC( *s) || *s=='.' || *s=='+' || *s=='-'){
+		return 0;
+	}
+	for( i=0; words[i]; i++){
+		for( k=0; s[k] && tolower( s[k])==words[i][k]; k++);
+		while( IS_BLANK( s[k])) k++;
+		if( !s[k]){
+			//the string is a prefix of the word (or it is blank)
+			return 0;
 		}
+	}
+	return 1;
+}
 
-		if(0 !=(status=(*f)( opqueue, &result->param))){
-			exp_token_free(opqueue);
-			exp_token_free(result);
-			*stack=s;
-			return status;
+
+/*
+ * Evaluates a chain of + operators, a+b+c+..., that is compiled into a single
+ * instruction with `argc' operands. The result is the same as when the
+ * operators are evaluated one by one from the left. Strings are appended to
+ * a buffer that grows geometrically, so a long chain takes linear time in the
+ * length of the result rather than quadratic.
+ */
+int exp_eval_concat( value_t *stack, int argc, int *stack_len){
+	value_t *op=stack+(*stack_len)-argc;
+	char b0[EXP_NUMBER_LEN], b1[EXP_NUMBER_LEN];
+	const char *s0, *s1;
+	size_t len=0, cap=0, l;  // the buffer is the string of op[0] when `cap' is not 0
+	int text=0;              // op[0] is a string that never becomes a number
+	value_t pair[2];
+	int i, c, concat;
+	int status=0;
+	double d;
+	char *n;
+
+	for( i=1; i<argc && status==0; i++){
+		//strings are concatenated unless both operands are numbers, see
+		//operator_evaluate_plus()
+		concat=0;
+		if( op[0].type==T_STRING || op[i].type==T_STRING){
+			if( 0 !=exp_to_double( &op[i], &d)){
+				concat=1;
+			}else if( op[0].type==T_STRING && op[0].value.string){
+				if( !text){
+					text=is_text( op[0].value.string);
+				}
+				concat=text || 0 !=exp_to_double( &op[0], &d);
+			}else{
+				concat=0 !=exp_to_double( &op[0], &d);
+			}
+		}
+
+		if( !concat){
+			pair[0]=op[0];
+			pair[1]=op[i];
+			c=2;
+			if( 0==( status=exp_eval_operator( pair, O_PLUS, &c))){
+				//the operands are consumed
+				op[0]=pair[0];
+				op[i].type=T_NONE;
+				op[i].value.string=NULL;
+				cap=0;
+				text=0;
+			}
+
+		}else if( NULL==( s1=exp_string_view( &op[i], b1))){
+			status=EXP_ER_INVALARGV;
 
 		}else{
-			int64_t r;
+			l=strlen( s1);
+			if( cap==0){
+				//the left operand is moved (or copied) to the buffer
+				if( NULL==( s0=exp_string_view( &op[0], b0))){
+					status=EXP_ER_INVALARGV;
+					break;
+				}
+				len=strlen( s0);
+				cap=( len+l+1)*2;
+				if( op[0].type==T_STRING && !op[0].borrowed){
+					n=exp_mem_realloc( op[0].value.string, cap);
+				}else if(( n=exp_mem_malloc( cap))){
+					memcpy( n, s0, len);
+				}
+				if( NULL==n){
+					cap=0;
+					status=EXP_ER_NOMEM;
+					break;
+				}
+				op[0].type=T_STRING;
+				op[0].borrowed=0;
+				op[0].value.string=n;
+			}else if( len+l+1>cap){
+				if( NULL==( n=exp_mem_realloc( op[0].value.string, ( len+l+1)*2))){
+					status=EXP_ER_NOMEM;
+					break;
+				}
+				cap=( len+l+1)*2;
+				op[0].value.string=n;
+			}
+			memcpy( op[0].value.string+len, s1, l+1);
+			op[0].number=NUMBER_UNKNOWN;
+			len+=l;
+			exp_value_clear( &op[i]);
+		}
+	}
+	if( cap>len+1 && ( n=exp_mem_realloc( op[0].value.string, len+1))){
+		op[0].value.string=n;
+	}
+	if( 0==status){
+		(*stack_len)-=argc-1;
+	}
+	return status;
+}
+
+
+//Operand of numeric kernel: integer, real or boolean value is stored in `d'
+#define real_operand( v, d) ({\
+	int _ret=1;\
+	if( (v)->type==T_INTEGER){\
+		*(d)=(double)(v)->value.integer;\
+	}else if( (v)->type==T_REAL){\
+		*(d)=(v)->value.real;\
+	}else if( (v)->type==T_BOOLEAN){\
+		*(d)=(v)->value.boolean? 1 : 0;\
+	}else{\
+		_ret=0;\
+	}\
+	_ret;\
+})
+
+//Stores real result, integral values are converted to integer like
+//exp_eval_operator() does
+#define set_real( v, d) {\
+	double _d=(d);\
+	if( REAL_FITS_INTEGER( _d) && _d==(double)(int64_t)_d){\
+		(v)->type=T_INTEGER;\
+		(v)->value.integer=(int64_t)_d;\
+	}else{\
+		(v)->type=T_REAL;\
+		(v)->value.real=_d;\
+	}\
+}
+
+#define set_boolean( v, b) {\
+	(v)->type=T_BOOLEAN;\
+	(v)->value.boolean=(b)? 1 : 0;\
+}
+
+
+//Operator that is evaluated when operands of kernel are not of expected type
+static const operator_t kernel_operator[]={
+	[K_ADD]=O_PLUS,
+	[K_SUB]=O_MINUS,
+	[K_MUL]=O_MUL,
+	[K_DIV]=O_DIV,
+	[K_NEG]=O_UMINUS,
+	[K_LT]=O_LT,
+	[K_GT]=O_GT,
+	[K_LE]=O_LE,
+	[K_GE]=O_GE,
+	[K_EQ]=O_BOOLEQUALS,
+	[K_NE]=O_NOTEQUALS,
+	[K_AND]=O_BOOLAND,
+	[K_OR]=O_BOOLOR,
+	[K_NOT]=O_BOOLNOT,
+	[K_BITAND]=O_BITAND,
+	[K_BITOR]=O_BITOR,
+};
 
-			if( result->param.type==T_REAL && 0==exp_is_integer( &result->param, &r)){
-				result->param.type=T_INTEGER;
-				result->param.value.integer=r;
+
+/*
+ * Evaluates operator with type specialized kernel. Operands of expected types
+ * are not strings, so they are overwritten with the result without freeing.
+ *
+ * The result is the same as the result of exp_eval_operator().
+ */
+int exp_eval_kernel( value_t *stack, kernel_t kernel, int *stack_len){
+	value_t *op;
+	int64_t i1, i2;
+	double d1, d2;
+
+	if( kernel==K_NEG || kernel==K_NOT){
+		op=stack+(*stack_len)-1;
+		if( kernel==K_NEG){
+			if( op->type==T_INTEGER && op->value.integer !=INT64_MIN){
+				op->value.integer=-op->value.integer;
+				return 0;
+			}else if( op->type==T_REAL){
+				set_real( op, -op->value.real);
+				return 0;
 			}
-			exp_token_free(opqueue);
-			result->position=0;
-			result->next=s;
-			*stack=result;
-			(*stack_len)+=1;
+		}else if( integer_operand( op, &i1)){
+			set_boolean( op, !i1);
 			return 0;
 		}
+		return exp_eval_operator( stack, kernel_operator[kernel], stack_len);
 	}
+
+	op=stack+(*stack_len)-2;
+	if( integer_operand( &op[0], &i1) && integer_operand( &op[1], &i2)){
+		switch( kernel){
+			case K_ADD:
+				if( __builtin_add_overflow( i1, i2, &op[0].value.integer)){
+					set_real( &op[0], (double)i1 + (double)i2);
+				}else{
+					op[0].type=T_INTEGER;
+				}
+				break;
+			case K_SUB:
+				if( __builtin_sub_overflow( i1, i2, &op[0].value.integer)){
+					set_real( &op[0], (double)i1 - (double)i2);
+				}else{
+					op[0].type=T_INTEGER;
+				}
+				break;
+			case K_MUL:
+				if( __builtin_mul_overflow( i1, i2, &op[0].value.integer)){
+					set_real( &op[0], (double)i1 * (double)i2);
+				}else{
+					op[0].type=T_INTEGER;
+				}
+				break;
+			case K_DIV:
+				if( i2==0){
+					return EXP_ER_DIVBYZERO;
+				}else if( i2 !=-1 && i1 % i2==0){
+					op[0].type=T_INTEGER;
+					op[0].value.integer=i1 / i2;
+				}else if( i2==-1 && i1 !=INT64_MIN){
+					op[0].type=T_INTEGER;
+					op[0].value.integer=-i1;
+				}else{
+					set_real( &op[0], (double)i1 / (double)i2);
+				}
+				break;
+			case K_LT:  set_boolean( &op[0], i1<i2); break;
+			case K_GT:  set_boolean( &op[0], i1>i2); break;
+			case K_LE:  set_boolean( &op[0], i1<=i2); break;
+			case K_GE:  set_boolean( &op[0], i1>=i2); break;
+			case K_EQ:  set_boolean( &op[0], i1==i2); break;
+			case K_NE:  set_boolean( &op[0], i1 !=i2); break;
+			case K_AND: set_boolean( &op[0], i1 && i2); break;
+			case K_OR:  set_boolean( &op[0], i1 || i2); break;
+			case K_BITAND:
+				op[0].type=T_INTEGER;
+				op[0].value.integer=i1 & i2;
+				break;
+			case K_BITOR:
+				op[0].type=T_INTEGER;
+				op[0].value.integer=i1 | i2;
+				break;
+			default:
+				return EXP_ER_INVALOPERATOR;
+		}
+		(*stack_len)--;
+		return 0;
+
+	}else if( kernel<K_AND && real_operand( &op[0], &d1) && real_operand( &op[1], &d2)){
+		switch( kernel){
+			case K_ADD: set_real( &op[0], d1 + d2); break;
+			case K_SUB: set_real( &op[0], d1 - d2); break;
+			case K_MUL: set_real( &op[0], d1 * d2); break;
+			case K_DIV:
+				if( d2==0){
+					return EXP_ER_DIVBYZERO;
+				}
+				set_real( &op[0], d1 / d2);
+				break;
+			case K_LT:  set_boolean( &op[0], d1<d2); break;
+			case K_GT:  set_boolean( &op[0], d1>d2); break;
+			case K_LE:  set_boolean( &op[0], d1<=d2); break;
+			case K_GE:  set_boolean( &op[0], d1>=d2); break;
+			case K_EQ:  set_boolean( &op[0], d1==d2); break;
+			case K_NE:  set_boolean( &op[0], d1 !=d2); break;
+			default:
+				return EXP_ER_INVALOPERATOR;
+		}
+		(*stack_len)--;
+		return 0;
+	}
+	return exp_eval_operator( stack, kernel_operator[kernel], stack_len);
 }
 
 
+//Loop that stores boolean result of comparison of operands of type `field',
+//rows before `start' are already evaluated
+#define vector_compare( a, b, start, rows, field, op) {\
+	int _r;\
+	for( _r=(start); _r<(rows); _r++){\
+		int _b=(a)->value[_r].field op (b)->value[_r].field;\
+		(a)->type[_r]=T_BOOLEAN;\
+		(a)->value[_r].boolean=_b;\
+	}\
+	(a)->types=TYPE_BOOLEAN;\
+}
+
 
+/*
+ * Evaluates kernel for `rows' rows of the vectors on the top of the stack.
+ * The vectors that contain only integers, only reals or only booleans are
+ * evaluated by tight loops: vector instructions of the processor evaluate as
+ * many rows as they can (see simd.c) and the loops below evaluate the rest.
+ * The other vectors, and the rows of selection vector `sel' of length `n',
+ * are evaluated row by row with exp_eval_kernel(). If `sel' is NULL all rows
+ * are evaluated, `n' is the same as `rows' then.
+ *
+ * If error occurs, the operands of the failed row are left on the stack and
+ * every row keeps a valid value, so the caller can clear the vectors.
+ */
+int exp_eval_kernel_vector( vector_t *stack, kernel_t kernel, int *stack_len, int rows, const unsigned short *sel, int n){
+	vector_t *a, *b;
+	value_t op[2];
+	int r, i, len, status, types;
+	int unary=kernel==K_NEG || kernel==K_NOT;
+
+	b=stack+(*stack_len)-1;
+	a=unary? b : b-1;
+
+	if( NULL==sel && kernel==K_NEG && a->types==TYPE_REAL){
+		a->types=0;
+		for( r=0; r<rows; r++){
+			vector_set_real( a, r, -a->value[r].real);
+		}
+		return 0;
 
+	}else if( NULL==sel && !unary && kernel !=K_DIV && a->types==TYPE_INTEGER && b->types==TYPE_INTEGER){
+		r=exp_simd_kernel( a, b, kernel, rows, &types);
+		a->types|=types;
+		switch( kernel){
+			case K_ADD:
+			case K_SUB:
+			case K_MUL:
+				for( ; r<rows; r++){
+					int64_t i1=a->value[r].integer, i2=b->value[r].integer;
+					int overflow;
+					if( kernel==K_ADD){
+						overflow=__builtin_add_overflow( i1, i2, &a->value[r].integer);
+					}else if( kernel==K_SUB){
+						overflow=__builtin_sub_overflow( i1, i2, &a->value[r].integer);
+					}else{
+						overflow=__builtin_mul_overflow( i1, i2, &a->value[r].integer);
+					}
+					if( overflow){
+						vector_set_real( a, r, kernel==K_ADD ? (double)i1 + (double)i2 :
+								kernel==K_SUB ? (double)i1 - (double)i2 : (double)i1 * (double)i2);
+					}
+				}
+				break;
+			case K_BITAND:
+				for( ; r<rows; r++){
+					a->value[r].integer&=b->value[r].integer;
+				}
+				break;
+			case K_BITOR:
+				for( ; r<rows; r++){
+					a->value[r].integer|=b->value[r].integer;
+				}
+				break;
+			case K_LT:  vector_compare( a, b, r, rows, integer, <); break;
+			case K_GT:  vector_compare( a, b, r, rows, integer, >); break;
+			case K_LE:  vector_compare( a, b, r, rows, integer, <=); break;
+			case K_GE:  vector_compare( a, b, r, rows, integer, >=); break;
+			case K_EQ:  vector_compare( a, b, r, rows, integer, ==); break;
+			case K_NE:  vector_compare( a, b, r, rows, integer, !=); break;
+			case K_AND: vector_compare( a, b, r, rows, integer, &&); break;
+			case K_OR:  vector_compare( a, b, r, rows, integer, ||); break;
+			default:
+				return EXP_ER_INVALOPERATOR;
+		}
+		(*stack_len)--;
+		return 0;
 
+	}else if( NULL==sel && !unary && kernel<K_AND && a->types==TYPE_REAL && b->types==TYPE_REAL){
+		if( kernel==K_DIV){
+			for( r=0; r<rows; r++){
+				if( b->value[r].real==0){
+					return EXP_ER_DIVBYZERO;
+				}
+			}
+		}
+		r=exp_simd_kernel( a, b, kernel, rows, &types);
+		switch( kernel){
+			case K_ADD:
+			case K_SUB:
+			case K_MUL:
+			case K_DIV:
+				a->types=types;
+				for( ; r<rows; r++){
+					double d1=a->value[r].real, d2=b->value[r].real;
+					vector_set_real( a, r, kernel==K_ADD ? d1 + d2 : kernel==K_SUB ? d1 - d2 :
+							kernel==K_MUL ? d1 * d2 : d1 / d2);
+				}
+				break;
+			case K_LT:  vector_compare( a, b, r, rows, real, <); break;
+			case K_GT:  vector_compare( a, b, r, rows, real, >); break;
+			case K_LE:  vector_compare( a, b, r, rows, real, <=); break;
+			case K_GE:  vector_compare( a, b, r, rows, real, >=); break;
+			case K_EQ:  vector_compare( a, b, r, rows, real, ==); break;
+			case K_NE:  vector_compare( a, b, r, rows, real, !=); break;
+			default:
+				return EXP_ER_INVALOPERATOR;
+		}
+		(*stack_len)--;
+		return 0;
+
+	}else if( NULL==sel && !unary && kernel>=K_EQ && kernel<=K_OR && a->types==TYPE_BOOLEAN && b->types==TYPE_BOOLEAN){
+		//results of comparisons are combined
+		r=exp_simd_kernel( a, b, kernel, rows, &types);
+		switch( kernel){
+			case K_EQ:  vector_compare( a, b, r, rows, boolean, ==); break;
+			case K_NE:  vector_compare( a, b, r, rows, boolean, !=); break;
+			case K_AND: vector_compare( a, b, r, rows, boolean, &&); break;
+			default:    vector_compare( a, b, r, rows, boolean, ||); break;
+		}
+		(*stack_len)--;
+		return 0;
+	}
+
+	if( NULL==sel){
+		a->types=0;
+	}
+	for_selected( r, i, sel, n){
+		len=unary? 1 : 2;
+		vector_load( a, r, &op[0]);
+		if( !unary){
+			vector_load( b, r, &op[1]);
+		}
+		if( 0 !=( status=exp_eval_kernel( op, kernel, &len))){
+			return status;
+		}
+		vector_store( a, r, &op[0]);
+		if( !unary){
+			//the operand is consumed
+			b->type[r]=T_NONE;
+		}
+	}
+	if( !unary){
+		(*stack_len)--;
+	}
+	return 0;
+}
@@ -78,14 +78,11 @@
  * The @c abs(a) function returns the absolute value of the integer or double
  * argument @a @c x.
  */
-static int call_abs( token_t *op, value_t *ret){
+static int call_abs( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=fabs(d1);
@@ -104,14 +101,11 @@ static int call_abs( token_t *op, value_t *ret){
  * should be a number in the range (-1, 1). The function may return
  * @c EXP_ER_TRIGONOMETRIC error if computation is not possible.
  */
-static int call_acos( token_t *op, value_t *ret){
+static int call_acos( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if( d1<-1 || d1>1){
@@ -133,14 +127,11 @@ static int call_acos( token_t *op, value_t *ret){
  * should be a number in the range (-1, 1). The function may return
  * @c EXP_ER_TRIGONOMETRIC error if computation is not possible.
  */
-static int call_asin( token_t *op, value_t *ret){
+static int call_asin( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if( d1<-1 || d1>1){
@@ -161,14 +152,11 @@ static int call_asin( token_t *op, value_t *ret){
  * and returns its value in the range (-PI/2, PI/2).
  *
  */
-static int call_atan( token_t *op, value_t *ret){
+static int call_atan( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=atan( d1);
@@ -186,15 +174,11 @@ static int call_atan( token_t *op, value_t *ret){
  * return value. A @c EXP_ER_DIVBYZERO error occurs if @a @c y is zero.
  *
  */
-static int call_atan2( token_t *op, value_t *ret){
+static int call_atan2( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1, d2;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next==NULL) return EXP_ER_INVALARGCLOW;
-	if( op->next->next) return EXP_ER_INVALARGCHIGH;
-
-	if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_double( &argv[0], &d1))) ||(0 !=(status=exp_to_double( &argv[1], &d2)))){
 		return status;
 	}else{
 		if( d1 !=0 && d2==0){
@@ -216,14 +200,11 @@ static int call_atan2( token_t *op, value_t *ret){
  * towards the "ceiling").
  *
  */
-static int call_ceil( token_t *op, value_t *ret){
+static int call_ceil( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if(d1<INT64_MIN || d1>INT64_MAX){
@@ -243,14 +224,11 @@ static int call_ceil( token_t *op, value_t *ret){
  * This function computes the cosine of @a @c a (specified in radians).
  *
  */
-static int call_cos( token_t *op, value_t *ret){
+static int call_cos( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=cos( d1);
@@ -266,14 +244,11 @@ static int call_cos( token_t *op, value_t *ret){
  * This function computes the hyperbolic cosine (specified in radians) of @a @c a.
  * A @c EXP_ER_TRIGONOMETRIC error occurs if the magnitude of @a @c a is too large
  */
-static int call_cosh( token_t *op, value_t *ret){
+static int call_cosh( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		errno=0;
@@ -293,14 +268,11 @@ static int call_cosh( token_t *op, value_t *ret){
  *
  * The @c exp() function computes the exponential function of @a @c a (e^a).
  */
-static int call_exp( token_t *op, value_t *ret){
+static int call_exp( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=exp( d1);
@@ -315,14 +287,11 @@ static int call_exp( token_t *op, value_t *ret){
  *
  * This function computes the largest integer <= @a @c x (rounding towards the "floor").
  */
-static int call_floor( token_t *op, value_t *ret){
+static int call_floor( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if(d1<INT64_MIN || d1>INT64_MAX){
@@ -344,15 +313,11 @@ static int call_floor( token_t *op, value_t *ret){
  * which is the remainder of @c x/y, even if the quotient @c x/y isn't representable.
  * If @a @c y is zero, the function returns 0.
  */
-static int call_fmod( token_t *op, value_t *ret){
+static int call_fmod( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1, d2;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next==NULL) return EXP_ER_INVALARGCLOW;
-	if( op->next->next) return EXP_ER_INVALARGCHIGH;
-
-	if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_double( &argv[0], &d1))) ||(0 !=(status=exp_to_double( &argv[1], &d2)))){
 		return status;
 	}else{
 		errno=0;
@@ -375,14 +340,11 @@ static int call_fmod( token_t *op, value_t *ret){
  * The @c log() function computes the natural logarithm (base @c e) of @a @c x.
  * A @c EXP_ER_COMPLEX error occurs if @a @c x is not positive.
  */
-static int call_log( token_t *op, value_t *ret){
+static int call_log( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if( d1<=0){
@@ -402,14 +364,11 @@ static int call_log( token_t *op, value_t *ret){
  * The @c log10() function computes the base 10 logarithm of @a @c x.
  * A @c EXP_ER_COMPLEX error occurs if @a @c x is not positive.
  */
-static int call_log10( token_t *op, value_t *ret){
+static int call_log10( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if( d1<=0){
@@ -429,23 +388,20 @@ static int call_log10( token_t *op, value_t *ret){
  * The @c min() function returns the minimum argument from the list of supplied
  * arguments. The @c min() function accepts one or more arguments.
  */
-static int call_min( token_t *op, value_t *ret){
+static int call_min( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
+	int i;
 	double d1, min;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-
-	if((0 !=(status=exp_to_double( &op->param, &d1)))){
+	if((0 !=(status=exp_to_double( &argv[0], &d1)))){
 		return status;
 	}
 	min=d1;
-	op=op->next;
-	while( op){
-		if((0 !=(status=exp_to_double( &op->param, &d1)))){
+	for( i=1; i<argc; i++){
+		if((0 !=(status=exp_to_double( &argv[i], &d1)))){
 			return status;
 		}
 		min=d1<min? d1 : min;
-		op=op->next;
 	}
 
 	ret->value.real=min;
@@ -460,23 +416,20 @@ static int call_min( token_t *op, value_t *ret){
  * The @c max() function returns the maximum argument from the list of supplied
  * arguments. The @c max() function acepts one or more arguments.
  */
-static int call_max( token_t *op, value_t *ret){
+static int call_max( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
+	int i;
 	double d1, max;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-
-	if((0 !=(status=exp_to_double( &op->param, &d1)))){
+	if((0 !=(status=exp_to_double( &argv[0], &d1)))){
 		return status;
 	}
 	max=d1;
-	op=op->next;
-	while( op){
-		if((0 !=(status=exp_to_double( &op->param, &d1)))){
+	for( i=1; i<argc; i++){
+		if((0 !=(status=exp_to_double( &argv[i], &d1)))){
 			return status;
 		}
 		max=d1>max? d1 : max;
-		op=op->next;
 	}
 
 	ret->value.real=max;
@@ -492,15 +445,11 @@ static int call_max( token_t *op, value_t *ret){
  * A @c EXP_ER_DIVBYZERO error occurs if @a @c x = 0, and @a @c y <= 0, or if @a @c x is
  * negative, and @a @c y isn't an integer.
  */
-static int call_pow( token_t *op, value_t *ret){
+static int call_pow( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1, d2;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next==NULL) return EXP_ER_INVALARGCLOW;
-	if( op->next->next) return EXP_ER_INVALARGCHIGH;
-
-	if((0 !=(status=exp_to_double( &op->param, &d1))) ||(0 !=(status=exp_to_double( &op->next->param, &d2)))){
+	if((0 !=(status=exp_to_double( &argv[0], &d1))) ||(0 !=(status=exp_to_double( &argv[1], &d2)))){
 		return status;
 	}else{
 		if((d1==0) && (d2<=0)){
@@ -509,7 +458,7 @@ static int call_pow( token_t *op, value_t *ret){
 		}else{
 			if(d1<0){
 				int64_t i2;
-				if(0==(status=exp_is_integer( &op->next->param, &i2))){
+				if(0==(status=exp_is_integer( &argv[1], &i2))){
 					ret->value.real=pow( d1, i2);
 					ret->type=T_REAL;
 					return 0;
@@ -531,6 +480,50 @@ static int call_pow( token_t *op, value_t *ret){
 }
 
 
+#define rotl( x, k) (((x)<<(k)) | ((x)>>(64-(k))))
+
+/*
+ * Next number of xoshiro256** generator by David Blackman and Sebastiano
+ * Vigna. The generator is fast and its state is small, so every context has
+ * its own one.
+ */
+static uint64_t random_next( uint64_t *s){
+	uint64_t result=rotl( s[1]*5, 7)*9;
+	uint64_t t=s[1]<<17;
+
+	s[2]^=s[0];
+	s[3]^=s[1];
+	s[1]^=s[2];
+	s[0]^=s[3];
+	s[2]^=t;
+	s[3]=rotl( s[3], 45);
+	return result;
+}
+
+
+/*
+ * Initializes the state of generator from 64-bit seed with splitmix64, as
+ * the authors of xoshiro recommend. The state is never all zeros.
+ */
+void exp_random_seed( uint64_t *state, uint64_t seed){
+	uint64_t z;
+	int i;
+
+	for( i=0; i<4; i++){
+		z=( seed+=0x9e3779b97f4a7c15ULL);
+		z=( z^( z>>30))*0xbf58476d1ce4e5b9ULL;
+		z=( z^( z>>27))*0x94d049bb133111ebULL;
+		state[i]=z^( z>>31);
+	}
+}
+
+
+//Pseudo-random real number from 0 to 1. The generator of the context is used
+//when the function is called with context, otherwise rand() is used
+#define random_real( ctx) ( (ctx) ? (double)( random_next( (ctx)->random)>>11)*0x1.0p-53 :\
+		(double)rand()/(double)RAND_MAX)
+
+
 /**
  * @page math_functions
  * @section random random(a, b)
@@ -546,39 +539,41 @@ static int call_pow( token_t *op, value_t *ret){
  * The function does not start a new sequence of pseudo-random integers when
  * called. That is, a program code that uses @c libexpression library should
  * call @c srand() standard C function when initialising libexpression.
+ * Expressions solved with exp_solve_ctx() use the generator of the context
+ * instead (xoshiro256**), so threads do not share it, and the sequence can be
+ * started again with exp_ctx_seed().
  *
  * The function @c rand(a, b) is an alias to this function.
  */
-static int call_random( token_t *op, value_t *ret){
-	if(op){
+static int call_random( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
+	if( argc){
 		double rmin, rmax;
 		int status;
 
-		if( op->next){
+		if( argc>1){
 			//two arguments: low and high borders
-			if(op->next->next) return EXP_ER_INVALARGCHIGH;
-			if(0 !=(status=exp_to_double( &op->param, &rmin)) ||
-					0 !=(status=exp_to_double( &op->next->param, &rmax))){
+			if(0 !=(status=exp_to_double( &argv[0], &rmin)) ||
+					0 !=(status=exp_to_double( &argv[1], &rmax))){
 				return status;
 			}else{
-				ret->value.real=rmin+(double)rand()*(rmax-rmin)/(double)RAND_MAX;
+				ret->value.real=rmin+random_real( ctx)*(rmax-rmin);
 				ret->type=T_REAL;
 				return 0;
 			}
 
 		}else{
 			//one argument: high border
-			if(0 !=(status=exp_to_double( &op->param, &rmax))){
+			if(0 !=(status=exp_to_double( &argv[0], &rmax))){
 				return status;
 			}else{
-				ret->value.real=(double)rand()*rmax/(double)RAND_MAX;
+				ret->value.real=random_real( ctx)*rmax;
 				ret->type=T_REAL;
 				return 0;
 			}
 		}
 
 	}else{
-		ret->value.real=(double)rand()/(double)RAND_MAX;
+		ret->value.real=random_real( ctx);
 		ret->type=T_REAL;
 		return 0;
 	}
@@ -591,14 +586,11 @@ static int call_random( token_t *op, value_t *ret){
  * The @c round() function returns the closest integer to @a @c x.
  *
  */
-static int call_round( token_t *op, value_t *ret){
+static int call_round( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if(d1<INT64_MIN || d1>INT64_MAX){
@@ -618,14 +610,11 @@ static int call_round( token_t *op, value_t *ret){
  * The @c sin() function computes the sine (specified in radians) of @a @c a.
  *
  */
-static int call_sin( token_t *op, value_t *ret){
+static int call_sin( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=sin( d1);
@@ -642,14 +631,11 @@ static int call_sin( token_t *op, value_t *ret){
  * @a @c a. A @c EXP_ER_TRIGONOMETRIC error occurs if the magnitude of @a @c a is too large.
  *
  */
-static int call_sinh( token_t *op, value_t *ret){
+static int call_sinh( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		errno=0;
@@ -670,14 +656,11 @@ static int call_sinh( token_t *op, value_t *ret){
  * The @c sqr() function computes the square of an argument.
  *
  */
-static int call_sqr( token_t *op, value_t *ret){
+static int call_sqr( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=d1 * d1;
@@ -694,14 +677,11 @@ static int call_sqr( token_t *op, value_t *ret){
  * A @c EXP_ER_COMPLEX error occurs if the argument is negative.
  *
  */
-static int call_sqrt( token_t *op, value_t *ret){
+static int call_sqrt( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		if( d1<0){
@@ -721,14 +701,11 @@ static int call_sqrt( token_t *op, value_t *ret){
  * The function computes the tangent (specified in radians) of @a @c a.
  *
  */
-static int call_tan( token_t *op, value_t *ret){
+static int call_tan( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=tan( d1);
@@ -744,14 +721,11 @@ static int call_tan( token_t *op, value_t *ret){
  * These functions compute the hyperbolic tangent (specified in radians) of @a @c a.
  *
  */
-static int call_tanh( token_t *op, value_t *ret){
+static int call_tanh( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		errno=0;
@@ -786,18 +760,15 @@ static int call_tanh( token_t *op, value_t *ret){
  * notation to represent a number. Binary notation uses prefix @c 0b to represent
  * the numbers, e.g. @code 0b101 @endcode stands for 5.
  */
-static int call_bin2dec( token_t *op, value_t *ret){
+static int call_bin2dec( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t result;
 	char *s;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(op->param.type !=T_STRING) return EXP_ER_NONSTRING;
+	if(argv[0].type !=T_STRING) return EXP_ER_NONSTRING;
 
 	result=0;
-	if( op->param.value.string){
-		s=op->param.value.string;
+	if( argv[0].value.string){
+		s=argv[0].value.string;
 		while( *s){
 			if( *s=='0' || *s=='1'){
 				result=(result<<1) | (*s=='1'? 1 : 0);
@@ -825,14 +796,11 @@ static int call_bin2dec( token_t *op, value_t *ret){
  *
  * The function @c bool() is an alias to this function.
  */
-static int call_boolean( token_t *op, value_t *ret){
+static int call_boolean( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	int b1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_boolean( &op->param, &b1))){
+	if(0 !=(status=exp_to_boolean( &argv[0], &b1))){
 		return status;
 	}else{
 		ret->value.boolean=b1;
@@ -848,15 +816,12 @@ static int call_boolean( token_t *op, value_t *ret){
  * The function returns a string containing a binary representation of an argument.
  */
 
-static int call_dec2bin( token_t *op, value_t *ret){
+static int call_dec2bin( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t i1, c;
 	int64_t i;
 	char s[128];
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if( 0!=exp_is_integer( &op->param, &i)) return EXP_ER_NONINTEGER;
+	if( 0!=exp_is_integer( &argv[0], &i)) return EXP_ER_NONINTEGER;
 	i1=(uint64_t) i;
 	c=0;
 	do{
@@ -865,7 +830,7 @@ static int call_dec2bin( token_t *op, value_t *ret){
 	}while( i1);
 
 	s[c]=0;
-	if(NULL==( ret->value.string=malloc( c+1))) return EXP_ER_NOMEM;
+	if(NULL==( ret->value.string=exp_mem_malloc( c+1))) return EXP_ER_NOMEM;
 	ret->type=T_STRING;
 	for( i=0; i<=c; i++){
 		ret->value.string[i]=s[c-i-1];
@@ -880,15 +845,12 @@ static int call_dec2bin( token_t *op, value_t *ret){
  *
  * The function returns a string containing a hexademical representation of an argument.
  */
-static int call_dec2hex( token_t *op, value_t *ret){
+static int call_dec2hex( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t i1, c;
 	int64_t i;
 	char s[128];
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if( 0!=exp_is_integer( &op->param, &i)) return EXP_ER_NONINTEGER;
+	if( 0!=exp_is_integer( &argv[0], &i)) return EXP_ER_NONINTEGER;
 	i1=(uint64_t) i;
 	c=0;
 	do{
@@ -909,7 +871,7 @@ static int call_dec2hex( token_t *op, value_t *ret){
 	}while( i1);
 
 	s[c]=0;
-	if(NULL==( ret->value.string=malloc( c+1))) return EXP_ER_NOMEM;
+	if(NULL==( ret->value.string=exp_mem_malloc( c+1))) return EXP_ER_NOMEM;
 	ret->type=T_STRING;
 	for( i=0; i<=c; i++){
 		ret->value.string[i]=s[c-i-1];
@@ -924,15 +886,12 @@ static int call_dec2hex( token_t *op, value_t *ret){
  *
  * The function returns a string containing a octal representation of an argument.
  */
-static int call_dec2oct( token_t *op, value_t *ret){
+static int call_dec2oct( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t i1, c;
 	int64_t i;
 	char s[128];
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if( 0!=exp_is_integer( &op->param, &i)) return EXP_ER_NONINTEGER;
+	if( 0!=exp_is_integer( &argv[0], &i)) return EXP_ER_NONINTEGER;
 	i1=(uint64_t) i;
 	c=0;
 	do{
@@ -941,7 +900,7 @@ static int call_dec2oct( token_t *op, value_t *ret){
 	}while( i1);
 
 	s[c]=0;
-	if(NULL==( ret->value.string=malloc( c+1))) return EXP_ER_NOMEM;
+	if(NULL==( ret->value.string=exp_mem_malloc( c+1))) return EXP_ER_NOMEM;
 	ret->type=T_STRING;
 	for( i=0; i<=c; i++){
 		ret->value.string[i]=s[c-i-1];
@@ -960,14 +919,11 @@ static int call_dec2oct( token_t *op, value_t *ret){
  *
  * The function @c double() is an alias to this function.
  */
-static int call_double( token_t *op, value_t *ret){
+static int call_double( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	double d1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_double( &op->param, &d1))){
+	if(0 !=(status=exp_to_double( &argv[0], &d1))){
 		return status;
 	}else{
 		ret->value.real=d1;
@@ -987,19 +943,16 @@ static int call_double( token_t *op, value_t *ret){
  * notation to represent a number. Hex notation uses prefix @c 0x to represent
  * the numbers, e.g. @code 0xff @endcode stands for 255.
  */
-static int call_hex2dec( token_t *op, value_t *ret){
+static int call_hex2dec( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t result;
 	char *s;
 	int i;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(op->param.type !=T_STRING) return EXP_ER_NONSTRING;
+	if(argv[0].type !=T_STRING) return EXP_ER_NONSTRING;
 
 	result=0;
-	if( op->param.value.string){
-		s=op->param.value.string;
+	if( argv[0].value.string){
+		s=argv[0].value.string;
 		while( *s){
 			i=IS_HEXADEMICAL(*s);
 			if( -1==i){
@@ -1028,14 +981,11 @@ static int call_hex2dec( token_t *op, value_t *ret){
  *
  * The function @c int() is an alias to this function.
  */
-static int call_integer( token_t *op, value_t *ret){
+static int call_integer( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	int64_t i1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_integer( &op->param, &i1))){
+	if(0 !=(status=exp_to_integer( &argv[0], &i1))){
 		return status;
 	}else{
 		ret->value.integer=i1;
@@ -1055,19 +1005,16 @@ static int call_integer( token_t *op, value_t *ret){
  * notation to represent a number. Octal notation uses prefix @c 0o to represent
  * the numbers, e.g. @code 0o777 @endcode stands for 511.
  */
-static int call_oct2dec( token_t *op, value_t *ret){
+static int call_oct2dec( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	uint64_t result;
 	char *s;
 	int i;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(op->param.type !=T_STRING) return EXP_ER_NONSTRING;
+	if(argv[0].type !=T_STRING) return EXP_ER_NONSTRING;
 
 	result=0;
-	if( op->param.value.string){
-		s=op->param.value.string;
+	if( argv[0].value.string){
+		s=argv[0].value.string;
 		while( *s){
 			i=IS_OCTAL(*s);
 			if( -1==i){
@@ -1094,14 +1041,11 @@ static int call_oct2dec( token_t *op, value_t *ret){
  *
  * The function @c str() is an alias to this function.
  */
-static int call_string( token_t *op, value_t *ret){
+static int call_string( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		ret->value.string=s1;
@@ -1125,14 +1069,11 @@ static int call_string( token_t *op, value_t *ret){
  * The function strips whitespace from the beginning of a string.
  *
  */
-static int call_ltrim( token_t *op, value_t *ret){
+static int call_ltrim( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		char *s2=s1;
@@ -1153,14 +1094,11 @@ static int call_ltrim( token_t *op, value_t *ret){
  * The function strips whitespace from the end of a string.
  *
  */
-static int call_rtrim( token_t *op, value_t *ret){
+static int call_rtrim( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		char *s2=s1+strlen(s1);
@@ -1181,25 +1119,21 @@ static int call_rtrim( token_t *op, value_t *ret){
  * The function compares two strings case-insensitively and returns 0 if they are equal.
  *
  */
-static int call_strcasecmp( token_t *op, value_t *ret){
+static int call_strcasecmp( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1, *s2;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if(NULL==op->next) return EXP_ER_INVALARGCLOW;
-	if( op->next->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_to_string( &argv[0], &s1))){
 		return status;
 	}else{
-		if(0 !=(status=exp_to_string( &op->param, &s2))){
-			free( s1);
+		if(0 !=(status=exp_to_string( &argv[0], &s2))){
+			exp_mem_free( s1);
 			return status;
 		}else{
 			ret->value.boolean = (0==strcasecmp( s1, s2)? 1 : 0);
 			ret->type=T_BOOLEAN;
-			free( s1);
-			free( s2);
+			exp_mem_free( s1);
+			exp_mem_free( s2);
 			return 0;
 		}
 	}
@@ -1215,25 +1149,21 @@ static int call_strcasecmp( token_t *op, value_t *ret){
  * e.g. @code "Hello world"=="Hello"+" world" @endcode
  *
  */
-static int call_strcmp( token_t *op, value_t *ret){
+static int call_strcmp( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1, *s2;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if(NULL==op->next) return EXP_ER_INVALARGCLOW;
-	if( op->next->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_to_string( &argv[0], &s1))){
 		return status;
 	}else{
-		if(0 !=(status=exp_to_string( &op->param, &s2))){
-			free( s1);
+		if(0 !=(status=exp_to_string( &argv[0], &s2))){
+			exp_mem_free( s1);
 			return status;
 		}else{
 			ret->value.integer = strcmp( s1, s2);
 			ret->type=T_INTEGER;
-			free( s1);
-			free( s2);
+			exp_mem_free( s1);
+			exp_mem_free( s2);
 			return 0;
 		}
 	}
@@ -1246,19 +1176,15 @@ static int call_strcmp( token_t *op, value_t *ret){
  * The function returns the length of a string.
  *
  */
-static int call_strlen( token_t *op, value_t *ret){
-	int status;
-	char *s1;
+static int call_strlen( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
+	char buffer[EXP_NUMBER_LEN];
+	const char *s1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
-		return status;
+	if( NULL==( s1=exp_string_view( &argv[0], buffer))){
+		return EXP_ER_INVALARGV;
 	}else{
 		ret->value.integer=strlen( s1);
 		ret->type=T_INTEGER;
-		free( s1);
 		return 0;
 	}
 }
@@ -1271,15 +1197,12 @@ static int call_strlen( token_t *op, value_t *ret){
  *
  * The functions @c strlwr() and @c tolower() are aliases to this function.
  */
-static int call_strtolower( token_t *op, value_t *ret){
+static int call_strtolower( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 	int i, len;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		len=strlen(s1);
@@ -1300,15 +1223,12 @@ static int call_strtolower( token_t *op, value_t *ret){
  *
  * The functions @c strupr() and @c toupper() are aliases to this function.
  */
-static int call_strtoupper( token_t *op, value_t *ret){
+static int call_strtoupper( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 	int i, len;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		len=strlen(s1);
@@ -1327,15 +1247,12 @@ static int call_strtoupper( token_t *op, value_t *ret){
  *
  * The function returns capitalised string with first letter converted to uppercase
  */
-static int call_capitalise( token_t *op, value_t *ret){
+static int call_capitalise( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 	int i, len;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		len=strlen(s1);
@@ -1367,31 +1284,29 @@ static int call_capitalise( token_t *op, value_t *ret){
  * The function @c substring() is an alias to this function.
  *
  */
-static int call_substr( token_t *op, value_t *ret){
+static int call_substr( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 	int64_t start;
 	int string_length;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if(NULL==op->next) return EXP_ER_INVALARGCLOW;
-	if( NULL==op->next->next){
+	if( argc==2){
 		// Two arguments, substr( string, start)
-		if(0 !=(status=exp_to_string( &op->param, &s1))){
+		if(0 !=(status=exp_take_string( &argv[0], &s1))){
 			return status;
 		}else{
-			if(0 !=(status=exp_to_integer( &op->next->param, &start))){
-				free( s1);
+			if(0 !=(status=exp_to_integer( &argv[1], &start))){
+				exp_mem_free( s1);
 				return status;
 			}else{
 				string_length=strlen( s1);
 				if( start>string_length){
-					free( s1);
+					exp_mem_free( s1);
 					return EXP_ER_INVALARGV;
 				}else if( start>=0){
 					memmove( s1, s1+start, string_length-start+1);
 				}else if( start<-string_length){
-					free( s1);
+					exp_mem_free( s1);
 					return EXP_ER_INVALARGV;
 				}else{
 					memmove( s1, s1+string_length+start, -start+1);
@@ -1403,25 +1318,24 @@ static int call_substr( token_t *op, value_t *ret){
 		}
 	}else{
 		// Three arguments, substr( string, start, length)
-		if( op->next->next->next) return EXP_ER_INVALARGCHIGH;
-		if(0 !=(status=exp_to_string( &op->param, &s1))){
+		if(0 !=(status=exp_take_string( &argv[0], &s1))){
 			return status;
 		}else{
-			if(0 !=(status=exp_to_integer( &op->next->param, &start))){
-				free( s1);
+			if(0 !=(status=exp_to_integer( &argv[1], &start))){
+				exp_mem_free( s1);
 				return status;
 			}else{
 				int64_t length;
-				if(0 !=(status=exp_to_integer( &op->next->next->param, &length))){
-					free( s1);
+				if(0 !=(status=exp_to_integer( &argv[2], &length))){
+					exp_mem_free( s1);
 					return status;
 				}else{
 					string_length=strlen( s1);
 					if( length<0){
-						free( s1);
+						exp_mem_free( s1);
 						return EXP_ER_INVALARGV;
 					}else if( start>string_length){
-						free( s1);
+						exp_mem_free( s1);
 						return EXP_ER_INVALARGV;
 					}else if( start>=0){
 						if( length>string_length-start){
@@ -1431,7 +1345,7 @@ static int call_substr( token_t *op, value_t *ret){
 							s1[length]=0;
 						}
 					}else if(start < -string_length){
-						free( s1);
+						exp_mem_free( s1);
 						return EXP_ER_INVALARGV;
 					}else{
 						if( length>-start){
@@ -1457,14 +1371,11 @@ static int call_substr( token_t *op, value_t *ret){
  * The function strips whitespace from the beginning and end of a string.
  *
  */
-static int call_trim( token_t *op, value_t *ret){
+static int call_trim( exp_ctx_t *ctx, int argc, value_t *argv, value_t *ret){
 	int status;
 	char *s1;
 
-	if(NULL==op) return EXP_ER_INVALARGCLOW;
-	if( op->next) return EXP_ER_INVALARGCHIGH;
-
-	if(0 !=(status=exp_to_string( &op->param, &s1))){
+	if(0 !=(status=exp_take_string( &argv[0], &s1))){
 		return status;
 	}else{
 		char *s2=s1+strlen(s1);
@@ -1491,165 +1402,352 @@ static int call_trim( token_t *op, value_t *ret){
 
 static struct function_table_s{
 	char *name;
-	int (*func)( token_t *, value_t *);
+	int (*func)( exp_ctx_t *, int, value_t *, value_t *);
+	int min_argc;
+	int max_argc;
+	int flags;
 } function_table[]={
-	/*
-	 * Math functions
-	 */
-	{ "abs",    call_abs},
-	{ "acos",   call_acos},
-	{ "asin",   call_asin},
-	{ "atan",   call_atan},
-	{ "atan2",  call_atan2},
-	{ "ceil",   call_ceil},
-	{ "cos",    call_cos},
-	{ "cosh",   call_cosh},
-	{ "exp",    call_exp},
-	{ "floor",  call_floor},
-	{ "fmod",   call_fmod},
-	{ "log",    call_log},
-	{ "log10",  call_log10},
-	{ "min",    call_min},
-	{ "max",    call_max},
-	{ "pow",    call_pow},
-	{ "rand",   call_random},
-	{ "random", call_random},
-	{ "round",  call_round},
-	{ "sin",    call_sin},
-	{ "sinh",   call_sinh},
-	{ "sqr",    call_sqr},
-	{ "sqrt",   call_sqrt},
-	{ "tan",    call_tan},
-	{ "tanh",   call_tanh},
-	/*
-	 * Conversion functions
-	 */
-	{ "bin2dec", call_bin2dec},
-	{ "bool",    call_boolean},{ "boolean", call_boolean},
-	{ "dec2bin", call_dec2bin},
-	{ "dec2hex", call_dec2hex},
-	{ "dec2oct", call_dec2oct},
-	{ "float",   call_double}, { "double",  call_double},
-	{ "hex2dec", call_hex2dec},
-	{ "integer", call_integer},{ "int",     call_integer},
-	{ "oct2dec", call_oct2dec},
-	{ "string",  call_string}, { "str",     call_string},
-	/*
-	 * String functions
-	 */
-	{ "ltrim",      call_ltrim},
-	{ "rtrim",      call_rtrim},
-	{ "strcasecmp", call_strcasecmp},
-	{ "strcmp",     call_strcmp},
-	{ "strlen",     call_strlen},
-	{ "strtolower", call_strtolower}, { "strlwr",     call_strtolower}, { "tolower",    call_strtolower}, { "lowercase",    call_strtolower},
-	{ "strtoupper", call_strtoupper}, { "strupr",     call_strtoupper}, { "toupper",    call_strtoupper}, { "upeercase",    call_strtoupper},
-	{ "capitalise", call_capitalise},
-	{ "substr",     call_substr},
-	{ "substring",  call_substr},
-	{ "trim",       call_trim},
+#define FUNCTION( name, func, min, max, flags) { name, func, min, max, flags},
+#include "functions.def"
+#undef FUNCTION
 };
 
-int exp_call_function( expression_t *exp, char *fname, int argc, token_t **stack, int *stack_len){
-	token_t *opqueue, *temp, *s, *result;
-	int status;
-	int64_t r;
+//Perfect hash of function names generated by gen-functions
+#include "functions-hash.h"
+
+
+//Number of built-in functions. Registered functions are numbered after them.
+#define BUILTIN_COUNT ((int)( sizeof( function_table)/sizeof( function_table[0])))
+
+
+//Functions registered with exp_register_function(), the table lives as long
+//as the process, so it is allocated by the C library
+static struct registered_function_s{
+	symbol_t *name;
+	exp_user_function_f *func;
+	void *user_data;
+	int min_argc;
+	int max_argc;
+	int flags;
+} *registered_functions=NULL;
+static int registered_functions_len=0;
+static int registered_functions_maxlen=0;
+
+
+/*
+ * @return Number of the built-in function or -1 if there is no built-in
+ *         function with this name
+ */
+static int builtin_lookup( const char *name){
 	int c;
-	int cnt;
-
-	(*stack_len)-=argc;
-	opqueue=NULL;
-	s=*stack;
-	c=argc;
-	while( c){
-		temp=s;
-		s=s->next;
-		temp->next=opqueue;
-		opqueue=temp;
-		c--;
-	}
-
-	if(NULL==(result=calloc( 1, sizeof(token_t)))){
-		exp_token_free(opqueue);
-		*stack=s;
+
+	c=function_hash[exp_function_hash( name, FUNCTION_HASH_SEED) & (FUNCTION_HASH_SIZE-1)];
+	if( c>=0 && 0==strcmp( function_table[c].name, name)){
+		return c;
+	}
+	return -1;
+}
+
+
+/*
+ * @return Number of the registered function or -1 if no function is
+ *         registered with this name
+ */
+static int registered_lookup( symbol_t *name){
+	int c;
+
+	//names of registered functions are interned, they are compared by pointer
+	for( c=0; c<registered_functions_len; c++){
+		if( registered_functions[c].name==name){
+			return BUILTIN_COUNT+c;
+		}
+	}
+	return -1;
+}
+
+
+int exp_register_function( const char *name, int min_argc, int max_argc, int flags, exp_user_function_f *func, void *user_data){
+	struct registered_function_s *f;
+	char buffer[EXP_NAME_LEN], *lname;
+	symbol_t *s;
+	int c;
+
+	if( NULL==name || NULL==func || min_argc<0 || ( max_argc>=0 && max_argc<min_argc)){
+		return EXP_ER_INVALARGV;
+	}
+	//names in expressions are in lower case, so the name is folded too
+	if( NULL==( lname=exp_name_tolower( name, buffer, sizeof( buffer)))){
 		return EXP_ER_NOMEM;
 	}
+	//built-in functions can not be redefined
+	s=NULL;
+	if( -1 !=builtin_lookup( lname)){
+		c=EXP_ER_INVALFUNC;
+	}else if( NULL==( s=exp_symbol_intern( lname))){
+		c=EXP_ER_NOMEM;
+	}
+	if( lname !=buffer){
+		free( lname);
+	}
+	if( NULL==s){
+		return c;
+	}
+	c=registered_lookup( s);
 
-	c=0;
-	cnt=sizeof( function_table)/sizeof( function_table[0]);
-	while( c<cnt){
-		if( 0==strcmp( function_table[c].name, fname)){
-			status=function_table[c].func( opqueue, &result->param);
-			break;
+	if( c==-1){
+		if( registered_functions_len>=registered_functions_maxlen){
+			if(NULL==( f=realloc( registered_functions, sizeof( struct registered_function_s)*(registered_functions_maxlen+16)))){
+				exp_symbol_release( s);
+				return EXP_ER_NOMEM;
+			}
+			registered_functions=f;
+			registered_functions_maxlen+=16;
+		}
+		//registered function keeps the reference to its name
+		f=&registered_functions[registered_functions_len++];
+		f->name=s;
+	}else{
+		//the function is registered again, expressions that are already
+		//compiled call the new callback
+		exp_symbol_release( s);
+		f=&registered_functions[c-BUILTIN_COUNT];
+	}
+	f->func=func;
+	f->user_data=user_data;
+	f->min_argc=min_argc;
+	f->max_argc=max_argc;
+	f->flags=flags;
+	return 0;
+}
+
+
+/*
+ * Finds built-in or registered function by name. This is done once, when the
+ * expression is compiled.
+ *
+ * @return Number of the function or -1 if there is no built-in or registered
+ *         function with this name
+ */
+int exp_function_lookup( const char *name){
+	symbol_t *s;
+	int c;
+
+	if( -1 !=( c=builtin_lookup( name)) || 0==registered_functions_len){
+		return c;
+	}
+	//a registered function holds a reference to its name, so the name that
+	//is not in the symbol table is not a name of registered function
+	if( NULL==( s=exp_symbol_find( name))){
+		return -1;
+	}
+	c=registered_lookup( s);
+	exp_symbol_release( s);
+	return c;
+}
+
+
+/*
+ * Checks that the function accepts `argc' arguments.
+ *
+ * @return 0 if the number of arguments is valid, EXP_ER_INVALARGCLOW or
+ *         EXP_ER_INVALARGCHIGH otherwise
+ */
+int exp_function_check_argc( int function, int argc){
+	int min_argc, max_argc;
+
+	if( function<BUILTIN_COUNT){
+		min_argc=function_table[function].min_argc;
+		max_argc=function_table[function].max_argc;
+	}else{
+		min_argc=registered_functions[function-BUILTIN_COUNT].min_argc;
+		max_argc=registered_functions[function-BUILTIN_COUNT].max_argc;
+	}
+	if( argc<min_argc){
+		return EXP_ER_INVALARGCLOW;
+	}else if( max_argc>=0 && argc>max_argc){
+		return EXP_ER_INVALARGCHIGH;
+	}
+	return 0;
+}
+
+
+/*
+ * Checks if the function always returns the same result for the same
+ * arguments, so it can be evaluated at compile time.
+ *
+ * @return 1 if the function is pure, 0 otherwise
+ */
+int exp_function_is_pure( int function){
+	if( function<BUILTIN_COUNT){
+		return (function_table[function].flags & FUNCTION_PURE) !=0;
+	}else{
+		return (registered_functions[function-BUILTIN_COUNT].flags & EXP_FUNC_PURE) !=0;
+	}
+}
+
+
+/*
+ * Replaces `argc' arguments on top of the stack with the result of function.
+ */
+static void replace_arguments( value_t *result, int argc, value_t *stack, int *stack_len){
+	value_t *args=stack+(*stack_len)-argc;
+	int c;
+
+	if( result->type==T_REAL && (-0==result->value.real)){
+		result->value.real=0;
+	}
+	for( c=0; c<argc; c++){
+		exp_value_clear( &args[c]);
+	}
+	args[0]=*result;
+	(*stack_len)+=1-argc;
+}
+
+
+/*
+ * Calls registered function. The arguments are passed to the callback without
+ * copying: strings in `argv' point to the strings on the stack.
+ */
+static int call_registered( struct registered_function_s *f, int argc, value_t *args, value_t *result){
+	exp_value_t local_argv[EXP_STACK_LOCAL];
+	exp_value_t *argv=local_argv;
+	exp_value_t exv;
+	int status;
+	int c;
+
+	if( argc>EXP_STACK_LOCAL && NULL==( argv=exp_mem_malloc( sizeof( exp_value_t)*argc))){
+		return EXP_ER_NOMEM;
+	}
+	for( c=0; c<argc; c++){
+		switch( args[c].type){
+			case T_INTEGER: argv[c].type=EXP_INTEGER; argv[c].value.integer=args[c].value.integer; break;
+			case T_REAL:    argv[c].type=EXP_REAL;    argv[c].value.real=args[c].value.real; break;
+			case T_BOOLEAN: argv[c].type=EXP_BOOLEAN; argv[c].value.boolean=args[c].value.boolean; break;
+			case T_STRING:
+				argv[c].type=EXP_STRING;
+				argv[c].value.string=args[c].value.string ? args[c].value.string : "NULL";
+				break;
+			default:        argv[c].type=EXP_NONE; break;
 		}
-		c++;
-	}
-
-	if( c==cnt){
-		// There is no entry in functions table for this function: it is not
-		// defined in this module. It is possible, that the function is defined
-		// in user-space, i.e. it is available by function handler.
-		if( exp->fhandler){
-			exp_value_t *values;
-			exp_value_t exv;
-			if( NULL==(values=calloc( 1, sizeof( exp_value_t) * argc))){
-				status=EXP_ER_NOMEM;
+	}
+	memset( &exv, 0, sizeof( exp_value_t));
+	//there are no arguments to pass if argc is 0
+	status=f->func( f->user_data, argc, argc>0 ? argv : NULL, &exv);
+	if( argv !=local_argv){
+		exp_mem_free( argv);
+	}
+
+	if( 0 !=status){
+		return EXP_ER_USERFUNCERROR;
+	}
+	switch( exv.type){
+		case EXP_INTEGER: result->type=T_INTEGER; result->value.integer=exv.value.integer; break;
+		case EXP_REAL:    result->type=T_REAL;    result->value.real=exv.value.real; break;
+		case EXP_BOOLEAN: result->type=T_BOOLEAN; result->value.boolean=exv.value.boolean; break;
+		case EXP_STRING:
+			//the string is allocated by the callback and now it is owned by the stack
+			result->type=T_STRING;
+			if( NULL==exv.value.string){
+				result->value.string=exp_mem_strdup( "NULL");
 			}else{
-				temp=opqueue;
-				for( c=0; c< argc; c++){
-					exp_value_t *v=&(values[c]);
-					EXPORT_FROM_VALUE_T( &temp->param, v);
-					temp=temp->next;
-				}
-				status=exp->fhandler( exp->user_data, fname, argc, values, &exv);
-				if(0==status){
-					IMPORT_TO_VALUE_T( &exv, &result->param);
-					if( exv.type==EXP_STRING && exv.value.string){
-						free(exv.value.string);
-					}
-					if( result->param.type==T_NONE){
-						status=EXP_ER_INVALRET;
-					}
-				}else{
-					if( status==1){
-						status = EXP_ER_INVALFUNC;
-					}else{
-						status = EXP_ER_USERFUNCERROR;
-					}
-				}
-				for( c=0; c< argc; c++){
-					if( values[c].type==EXP_STRING && values[c].value.string){
-						free(values[c].value.string);
-					}
-				}
-				free(values);
+				result->value.string=exp_mem_import( exv.value.string);
+			}
+			if( NULL==result->value.string){
+				return EXP_ER_NOMEM;
 			}
+			break;
+		default:
+			return EXP_ER_INVALRET;
+	}
+	return 0;
+}
+
+
+/*
+ * Calls built-in or registered function with the arguments on top of the
+ * stack. The number of arguments is already checked with
+ * exp_function_check_argc(). `ctx' is the evaluation context of the caller or
+ * NULL, built-in functions that have state (random()) keep it there. The
+ * arguments are consumed, built-in string functions move the strings out of
+ * them instead of copying (see exp_take_string()).
+ */
+int exp_call_resolved( exp_ctx_t *ctx, int function, int argc, value_t *stack, int *stack_len){
+	value_t result;
+	int status;
 
+	memset( &result, 0, sizeof( value_t));
+	if( function<BUILTIN_COUNT){
+		status=function_table[function].func( ctx, argc, stack+(*stack_len)-argc, &result);
+	}else{
+		status=call_registered( &registered_functions[function-BUILTIN_COUNT], argc, stack+(*stack_len)-argc, &result);
+	}
+	if( 0 !=status){
+		exp_value_clear( &result);
+		return status;
+	}
+	replace_arguments( &result, argc, stack, stack_len);
+	return 0;
+}
+
+
+/*
+ * Calls function that is not built-in, i.e. it is available by function
+ * handler.
+ */
+int exp_call_function( expression_t *exp, char *fname, int argc, value_t *stack, int *stack_len){
+	value_t *args, result;
+	exp_value_t *values;
+	exp_value_t exv;
+	int status;
+	int c;
+
+	args=stack+(*stack_len)-argc;
+	memset( &result, 0, sizeof( value_t));
+
+	if( NULL==exp->fhandler){
+		return EXP_ER_INVALFUNC;
+	}
+	if( NULL==(values=exp_mem_calloc( 1, sizeof( exp_value_t) * argc))){
+		return EXP_ER_NOMEM;
+	}
+	for( c=0; c< argc; c++){
+		exp_value_t *v=&(values[c]);
+		if( args[c].type==T_STRING && args[c].value.string && !args[c].borrowed){
+			//the arguments are consumed, so the strings they own are moved
+			v->type=EXP_STRING;
+			v->value.string=args[c].value.string;
+			args[c].type=T_NONE;
+			args[c].value.string=NULL;
 		}else{
+			EXPORT_FROM_VALUE_T( &args[c], v);
+		}
+	}
+	status=exp->fhandler( exp->user_data, fname, argc, values, &exv);
+	if(0==status){
+		IMPORT_TO_VALUE_T( &exv, &result);
+		if( result.type==T_NONE){
+			status=EXP_ER_INVALRET;
+		}
+	}else{
+		if( status==1){
 			status = EXP_ER_INVALFUNC;
+		}else{
+			status = EXP_ER_USERFUNCERROR;
 		}
 	}
+	for( c=0; c< argc; c++){
+		if( values[c].type==EXP_STRING && values[c].value.string){
+			exp_mem_free(values[c].value.string);
+		}
+	}
+	exp_mem_free(values);
 
 	if( status !=0){
-		exp_token_free(opqueue);
-		exp_token_free(result);
-		*stack=s;
+		exp_value_clear( &result);
 		return status;
-	}else{
-		if( result->param.type==T_REAL && (-0==result->param.value.real)){
-			result->param.value.real=0;
-		}
-//		if( result->param.type==T_REAL){
-//			result->param.type=T_INTEGER;
-//			result->param.value.integer=r;
-//		}
-		exp_token_free(opqueue);
-		result->position=0;
-		result->next=s;
-		*stack=result;
-		(*stack_len)+=1;
-		return 0;
 	}
+	replace_arguments( &result, argc, stack, stack_len);
+	return 0;
 }
 
 
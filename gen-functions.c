@@ -0,0 +1,105 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Build time generator of the perfect hash for names of built-in functions.
+ *
+ * The program reads the table of functions from functions.def, finds a seed
+ * of exp_function_hash() that maps every name to a separate slot of the hash
+ * table, and prints header file functions-hash.h to stdout. The header is
+ * included by functions.c.
+ */
+
+#include "libexpression-private.h"
+
+
+#define FUNCTION( name, func, min, max, flags) name,
+static const char *names[]={
+#include "functions.def"
+};
+#undef FUNCTION
+
+
+/*
+ * Tries to place all names into the hash table of the given size.
+ *
+ * @return 0 if there are no collisions, 1 otherwise
+ */
+static int try_seed( uint32_t seed, int size, int *table){
+	int i, j, slot;
+
+	for( i=0; i<size; i++){
+		table[i]=-1;
+	}
+	for( i=0; i<(int)( sizeof( names)/sizeof( names[0])); i++){
+		slot=exp_function_hash( names[i], seed) & (size-1);
+		if( table[slot] !=-1){
+			//aliases are different names of the same function, but all names
+			//must have distinct slots
+			for( j=0; j<i; j++){
+				if( 0==strcmp( names[j], names[i])){
+					fprintf( stderr, "Function `%s' is defined twice\n", names[i]);
+					exit( 1);
+				}
+			}
+			return 1;
+		}
+		table[slot]=i;
+	}
+	return 0;
+}
+
+
+int main( int argc, char *argv[]){
+	int count=sizeof( names)/sizeof( names[0]);
+	int size, i;
+	int *table;
+	uint32_t seed;
+
+	//The table is at least twice as large as the number of functions, the size
+	//is doubled until a seed without collisions is found
+	for( size=1; size<2*count; size<<=1);
+	for( ;; size<<=1){
+		if( NULL==( table=malloc( sizeof( int)*size))){
+			fprintf( stderr, "Memory error\n");
+			return 1;
+		}
+		for( seed=0; seed<100000; seed++){
+			if( 0==try_seed( seed, size, table)){
+				break;
+			}
+		}
+		if( seed<100000){
+			break;
+		}
+		free( table);
+	}
+
+	printf( "/*\n * Generated by gen-functions from functions.def, do not edit.\n */\n\n");
+	printf( "#define FUNCTION_HASH_SEED %uu\n", (unsigned)seed);
+	printf( "#define FUNCTION_HASH_SIZE %d\n\n", size);
+	printf( "//Index in function_table for every slot of the hash table, -1 if slot is empty\n");
+	printf( "static const short function_hash[FUNCTION_HASH_SIZE]={");
+	for( i=0; i<size; i++){
+		printf( "%s%3d,", i%16 ? " " : "\n\t", table[i]);
+	}
+	printf( "\n};\n");
+	free( table);
+	return 0;
+}
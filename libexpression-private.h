@@ -65,6 +65,8 @@
 
 #include <math.h>
 
+#include <sched.h>
+
 #include "libexpression.h"
 
 
@@ -108,6 +110,33 @@
 		ret;\
 	})
 
+//Hash of the name of built-in function (FNV-1a with final mixing), the seed is chosen by
+//gen-functions so that the hash is perfect for the names in functions.def
+#define exp_function_hash( name, seed) ({\
+		const unsigned char *_s=(const unsigned char *)(name);\
+		uint32_t _h=2166136261u ^ (seed);\
+		while( *_s){\
+			_h=(_h ^ *_s++)*16777619u;\
+		}\
+		_h^=_h>>16;\
+		_h*=0x85ebca6bu;\
+		_h^=_h>>13;\
+		_h;\
+	})
+
+//Flags of built-in functions, see functions.def
+#define FUNCTION_PURE 0x01
+
+//Locks that are held only for a few instructions are spin locks that yield
+//the processor when they are busy
+#define exp_spin_lock( lock) {\
+	while( __atomic_test_and_set( (lock), __ATOMIC_ACQUIRE)){\
+		sched_yield();\
+	}\
+}
+
+#define exp_spin_unlock( lock) __atomic_clear( (lock), __ATOMIC_RELEASE)
+
 
 
 /*
@@ -129,6 +158,7 @@ typedef enum {
 
 	T_IFCONDITION,
 	T_IFSTATEMENT,
+	T_SHORTCUT,
 } token_type_t;
 
 
@@ -163,17 +193,30 @@ typedef enum {
 } operator_t;
 
 
+typedef union{
+	int64_t integer;
+	double real;
+	int boolean;
+	char *string;
+	operator_t operator;
+	char *function;
+	char *parameter;
+} scalar_t;
+
+
+//State of the numeric form of the string cached in value_t
+#define NUMBER_UNKNOWN  0 // the string was not parsed yet
+#define NUMBER_NONE     1 // the string is not a number
+#define NUMBER_INTEGER  2 // cached number is integer
+#define NUMBER_UNSIGNED 3 // cached number is hexademical, it is converted to real as unsigned
+#define NUMBER_REAL     4 // cached number is real
+
 typedef struct {
 	token_type_t type;
-	union{
-		int64_t integer;
-		double real;
-		int boolean;
-		char *string;
-		operator_t operator;
-		char *function;
-		char *parameter;
-	} value;
+	unsigned char borrowed; // the string is owned by the program or by the caller, it is not freed
+	unsigned char number;   // the string was parsed to `parsed', NUMBER_*, see exp_string_number()
+	scalar_t value;
+	scalar_t parsed;
 } value_t;
 
 
@@ -185,16 +228,247 @@ typedef struct token_s{
 } token_t;
 
 
+/*
+ * Arena allocator, see arena.c. Tokens and their strings are allocated in the
+ * arena while expression is compiled, and they are freed all at once.
+ */
+typedef struct arena_block_s{
+	struct arena_block_s *next;
+} arena_block_t;
+
+typedef struct {
+	arena_block_t *blocks;   // blocks allocated on the heap
+	char *next;              // free memory of the current block
+	char *end;
+} arena_t;
+
+
+/*
+ * Interned identifier, see symbol.c. Names of parameters and functions are
+ * stored in the table once for all expressions, so that the programs refer
+ * to the same symbol and compare the names by pointer.
+ */
+typedef struct symbol_s{
+	struct symbol_s *next;   // next symbol in the bucket
+	uint64_t hash;
+	int refs;                // number of programs and registered functions that use the symbol
+	char name[];
+} symbol_t;
+
+//Symbol of the name that is returned by exp_symbol_intern()
+#define SYMBOL_OF( n) ((symbol_t *)((char *)(n)-offsetof( symbol_t, name)))
+
+
 typedef struct function_s{
 	char *name;
 	int argc;
 }function_t;
 
 
+/*
+ * Compiled expression.
+ * exp_create() translates the RPN token list into a flat array of
+ * instructions that exp_solve() executes against a value stack. Literals,
+ * parameter and function names are kept in a separate constant pool and are
+ * referenced from instructions by index.
+ */
+typedef enum {
+	I_PUSH=0,    // push constants[operand]
+	I_PARAM,     // push value of the parameter in slot `operand' (named params[operand])
+	I_OPERATOR,  // evaluate operator `operand'
+	I_CALL,      // call user function named constants[operand] (interned name) with `argc' arguments
+	I_FUNCTION,  // call built-in or registered function number `operand' with `argc' arguments
+	I_JUMP,      // continue at code[operand]
+	I_JUMPIFNOT, // pop condition, continue at code[operand] if it is false
+	I_ENDIF,     // end of conditional expression (`argc' is the number of its branches), normalize its result, continue at code[operand]
+	I_KERNEL,    // evaluate operator `operand' with type specialized kernel `argc', see kernel_t
+	I_SHORTCUT,  // left operand of && or || (operator `argc') decides the result, replace it with boolean and continue at code[operand]
+	I_CONCAT,    // evaluate chain of `argc'-1 + operators (operator `operand'), see exp_eval_concat()
+} opcode_t;
+
+
+//Type specialized operator kernels. Every kernel checks the types of operands
+//and evaluates the operator without conversions if they are of expected type,
+//otherwise the generic operator is evaluated.
+typedef enum {
+	K_ADD=0,     // integer, real or boolean operands
+	K_SUB,
+	K_MUL,
+	K_DIV,
+	K_NEG,
+	K_LT,        // integer, real or boolean operands
+	K_GT,
+	K_LE,
+	K_GE,
+	K_EQ,
+	K_NE,
+	K_AND,       // boolean or integer operands
+	K_OR,
+	K_NOT,
+	K_BITAND,    // boolean or integer operands
+	K_BITOR,
+} kernel_t;
+
+
+//Sets of types that a value can have, they are inferred at compile time
+#define TYPE_INTEGER 0x01
+#define TYPE_REAL    0x02
+#define TYPE_BOOLEAN 0x04
+#define TYPE_STRING  0x08
+#define TYPE_ANY     (TYPE_INTEGER | TYPE_REAL | TYPE_BOOLEAN | TYPE_STRING)
+#define TYPE_OF( t)  ((t)>=T_INTEGER && (t)<=T_STRING ? 1<<((t)-T_INTEGER) : 0)
+
+
+typedef struct {
+	opcode_t opcode;
+	int operand;
+	int argc;
+	int position;
+	int type;    // types that the value produced by instruction can have
+	int flags;   // INSTRUCTION_* flags
+} instruction_t;
+
+//I_SHORTCUT: the right operand is made only of constants, parameters and
+//operators, exp_batch() may evaluate it for every row instead of splitting
+//the selection
+#define INSTRUCTION_DENSE 0x01
+
+
+typedef struct program_s{
+	instruction_t *code;
+	int code_len;
+	int code_maxlen;
+	value_t *constants;
+	int constants_len;
+	int constants_maxlen;
+	symbol_t **params;   // names of parameters, index in this array is the slot of parameter
+	int params_len;
+	int params_maxlen;
+	int max_depth;       // largest number of values on the stack while the program runs
+	uint64_t hash;       // hash of the source text, see exp_hash_text()
+	int refs;            // number of expressions (and cache entries) that share the program
+} program_t;
+
+
+//Largest number of operands of I_CONCAT, longer chains of + operators are
+//split, so that the operands do not take too much of the stack
+#define EXP_CONCAT_MAX 32
+
+
+//Programs that need no more stack than this are executed with the stack
+//allocated in exp_rpn() frame, the others allocate the stack on the heap
+//(or use the stack of the context)
+#define EXP_STACK_LOCAL 64
 
+
+/*
+ * Evaluation context, see exp_ctx_create(). A thread owns its context, so
+ * nothing in it is shared with other threads, and the memory is reused by
+ * every expression solved with the context.
+ */
+struct exp_ctx_s{
+	value_t *stack;            // value stack of exp_rpn(), it grows to the deepest program solved
+	int stack_maxlen;
+	char *buffer;              // scratch buffer of exp_ctx_value_to_string()
+	int buffer_len;
+	uint64_t random[4];        // state of random(), see exp_random_seed()
+	exp_error_t ercode;        // the last error
+	char error[EXP_ERLEN];
+	int error_pos;
+	const exp_allocator_t *allocator; // allocator of the stack and the buffer, NULL is the global one
+};
+
+
+//Allocator and phase that exp_mem_*() routines use. Every API routine that
+//allocates memory selects them with HEAP_ENTER() and restores the previous
+//ones with HEAP_LEAVE(), so the library may be called from handlers.
+typedef struct{
+	const exp_allocator_t *allocator;  // NULL is the C library
+	exp_phase_t phase;
+}heap_t;
+
+#define HEAP_ENTER( _allocator, _phase) \
+	heap_t _heap=exp_heap;\
+	exp_heap.allocator=(_allocator);\
+	exp_heap.phase=(_phase)
+
+#define HEAP_LEAVE() exp_heap=_heap
+
+//The state is used by every call, the library takes it from static TLS
+//instead of calling __tls_get_addr()
+#define HEAP_TLS_MODEL __attribute__(( tls_model( "initial-exec")))
+
+#define ctx_allocator( ctx) ( (ctx) && (ctx)->allocator ? (ctx)->allocator : exp_global_allocator)
+
+
+//Length of the buffer on the stack where names are folded to lower case,
+//see exp_name_tolower()
+#define EXP_NAME_LEN 64
+
+//Length of the buffer where exp_string_view() prints numbers
+#define EXP_NUMBER_LEN 128
+
+
+//Real numbers in this range can be converted to int64_t (2^63 itself can not)
+#define REAL_FITS_INTEGER( d) ((d)<9223372036854775808.0 && (d)>=-9223372036854775808.0)
+
+
+//Number of rows that exp_solve_batch() passes through every instruction at
+//once. The vectors of a usual expression fit in L2 cache. Rows are indexed
+//by unsigned short in selection vectors.
+#define EXP_BATCH_CHUNK 1024
+
+
+//Values of one stack slot for a chunk of rows, columns are stored separately
+//so that the rows of the same type are processed by tight loops
+typedef struct {
+	int types;                               // types of values in the vector, TYPE_*
+	unsigned char type[EXP_BATCH_CHUNK];     // token_type_t of every row
+	unsigned char borrowed[EXP_BATCH_CHUNK]; // see value_t
+	scalar_t value[EXP_BATCH_CHUNK];
+} vector_t;
+
+
+//Iterates over the rows of selection vector `sel' of length `n', all rows are
+//selected if `sel' is NULL
+#define for_selected( r, i, sel, n) \
+	for( (i)=0; (i)<(n) && ((r)=(sel) ? (sel)[i] : (i), 1); (i)++)
+
+#define vector_load( vec, r, v) {\
+	(v)->type=(vec)->type[r];\
+	(v)->borrowed=(vec)->borrowed[r];\
+	(v)->number=NUMBER_UNKNOWN;\
+	(v)->value=(vec)->value[r];\
+}
+
+#define vector_store( vec, r, v) {\
+	(vec)->type[r]=(v)->type;\
+	(vec)->borrowed[r]=(v)->borrowed;\
+	(vec)->value[r]=(v)->value;\
+	(vec)->types|=TYPE_OF( (v)->type);\
+}
+
+//Stores real result in the row of vector, integral values are converted to
+//integer like exp_eval_operator() does
+#define vector_set_real( vec, r, d) {\
+	double _d=(d);\
+	if( REAL_FITS_INTEGER( _d) && _d==(double)(int64_t)_d){\
+		(vec)->type[r]=T_INTEGER;\
+		(vec)->value[r].integer=(int64_t)_d;\
+		(vec)->types|=TYPE_INTEGER;\
+	}else{\
+		(vec)->type[r]=T_REAL;\
+		(vec)->value[r].real=_d;\
+		(vec)->types|=TYPE_REAL;\
+	}\
+}
+
+
+//Imports the value returned by user callback, the string allocated by the
+//callback is moved to the value
 #define IMPORT_TO_VALUE_T( from, to) {\
 	if((to)->type==T_STRING && (to)->value.string){\
-		free( (to)->value.string);\
+		exp_mem_free( (to)->value.string);\
 		(to)->value.string=NULL;\
 	}\
 	if( (from)->type==EXP_INTEGER){\
@@ -208,10 +482,12 @@ typedef struct function_s{
 		(to)->value.boolean=(from)->value.boolean;\
 	}else if( (from)->type==EXP_STRING){\
 		(to)->type=T_STRING;\
+		(to)->number=NUMBER_UNKNOWN;\
 		if((from)->value.string){\
-			(to)->value.string=strdup((from)->value.string);\
+			(to)->value.string=exp_mem_import( (from)->value.string);\
+			(from)->value.string=NULL;\
 		}else{\
-			(to)->value.string=strdup("NULL");\
+			(to)->value.string=exp_mem_strdup("NULL");\
 		}\
 	}else{\
 		(to)->type=T_NONE;\
@@ -220,7 +496,7 @@ typedef struct function_s{
 
 #define EXPORT_FROM_VALUE_T( from, to) {\
 	if((to)->type==EXP_STRING && (to->value.string)){\
-		free( (to)->value.string);\
+		exp_mem_free( (to)->value.string);\
 		(to)->value.string=NULL;\
 	}\
 	if( (from)->type==T_INTEGER){\
@@ -235,9 +511,9 @@ typedef struct function_s{
 	}else if( (from)->type==T_STRING){\
 		(to)->type=EXP_STRING;\
 		if((from)->value.string){\
-			(to)->value.string=strdup((from)->value.string);\
+			(to)->value.string=exp_mem_strdup((from)->value.string);\
 		}else{\
-			(to)->value.string=strdup("NULL");\
+			(to)->value.string=exp_mem_strdup("NULL");\
 		}\
 	}else{\
 		(to)->type=EXP_NONE;\
@@ -251,30 +527,88 @@ typedef struct function_s{
 
 
 
+//from alloc.c
+extern const exp_allocator_t *exp_global_allocator;
+extern __thread heap_t exp_heap HEAP_TLS_MODEL;
+void *exp_mem_malloc( size_t size);
+void *exp_mem_calloc( size_t nmemb, size_t size);
+void *exp_mem_realloc( void *ptr, size_t size);
+void exp_mem_free( void *ptr);
+char *exp_mem_strdup( const char *s);
+char *exp_mem_import( char *s);
+char *exp_mem_export( char *s);
+
+//from arena.c
+void exp_arena_init( arena_t *a, void *buffer, size_t len);
+void *exp_arena_alloc( arena_t *a, size_t size);
+char *exp_arena_strdupn( arena_t *a, const char *s, size_t n);
+void exp_arena_free( arena_t *a);
+
+//from batch.c
+int exp_batch( expression_t *exp, program_t *program, const exp_column_t *columns, int rows, exp_column_t *result, exp_error_t *ercode, char *error, int *error_pos);
+
+//from cache.c
+uint64_t exp_hash_text( const char *s);
+
 //from eval.c
 int exp_to_double( value_t *v, double *ret);
 int exp_to_integer( value_t *v, int64_t *ret);
 int exp_to_boolean(value_t *v, int *ret);
 int exp_to_string(value_t *v, char **ret);
-int exp_eval_operator( token_t **stack, operator_t operator, int *operand_count);
+int exp_take_string( value_t *v, char **ret);
+const char *exp_string_view( value_t *v, char *buffer);
+void exp_value_clear( value_t *v);
+int exp_eval_operator( value_t *stack, operator_t operator, int *stack_len);
+int exp_eval_concat( value_t *stack, int argc, int *stack_len);
+int exp_eval_kernel( value_t *stack, kernel_t kernel, int *stack_len);
+int exp_eval_kernel_vector( vector_t *stack, kernel_t kernel, int *stack_len, int rows, const unsigned short *sel, int n);
 int exp_is_integer( value_t *v, int64_t *i);
+int exp_string_number( value_t *v, int64_t *i, double *d);
+
+//from simd.c
+int exp_simd_kernel( vector_t *a, vector_t *b, kernel_t kernel, int rows, int *types);
 
-//from function.c
-int exp_call_function( expression_t *exp, char *fname, int argc, token_t **stack, int *stack_len);
+//from functions.c
+int exp_function_lookup( const char *name);
+int exp_function_check_argc( int function, int argc);
+int exp_function_is_pure( int function);
+int exp_call_resolved( exp_ctx_t *ctx, int function, int argc, value_t *stack, int *stack_len);
+int exp_call_function( expression_t *exp, char *fname, int argc, value_t *stack, int *stack_len);
+void exp_random_seed( uint64_t *state, uint64_t seed);
+
+//from libexpression.c
+int exp_substitute_parameter( char *parameter_name, value_t *result);
+
+//from program.c
+program_t *exp_program_compile( token_t *input, exp_error_t *ercode, char *error, int *error_pos);
+program_t *exp_program_ref( program_t *program);
+program_t *exp_program_free( program_t *program);
+
+//from libexpression.c
+program_t *exp_compile( const char *e, exp_error_t *ercode, char *error, int *erpos);
 
 //from exp_rpn.c
-int exp_rpn( expression_t *exp, token_t *input, value_t *ret, exp_error_t *ercode, char *error, int *error_pos);
+int exp_bind_parameter( const exp_value_t *param, char *name, value_t *ret, exp_error_t *ercode, char *error);
+int exp_resolve_parameter( expression_t *exp, char *name, value_t *ret, exp_error_t *ercode, char *error);
+void exp_operator_error( int status, operator_t operator, char *error);
+void exp_function_error( int status, char *error);
+void exp_condition_error( int status, char *error);
+int exp_rpn( exp_ctx_t *ctx, expression_t *exp, program_t *program, const exp_value_t *params, value_t *ret, exp_error_t *ercode, char *error, int *error_pos);
 
 //from shunting-yard.c
-token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input, exp_error_t *ercode, char *error, int *error_pos);
+token_t *exp_shunting_yard( arena_t *arena, token_t *input, exp_error_t *ercode, char *error, int *error_pos);
+
+//from symbol.c
+symbol_t *exp_symbol_intern( const char *name);
+symbol_t *exp_symbol_find( const char *name);
+void exp_symbol_release( symbol_t *s);
 
 //from tokenizer.c
 int exp_op_argument_count( operator_t op);
 int exp_op_is_lefttoright( operator_t op);
-token_t *exp_token_free( token_t *head);
-token_t *exp_token_dup( token_t *tok);
 int exp_check( token_t *token, exp_error_t *ercode, char *error, int *error_pos);
-token_t *exp_parse( char *exp, exp_error_t *ercode, char *error, int *error_pos);
+token_t *exp_parse( arena_t *arena, char *exp, exp_error_t *ercode, char *error, int *error_pos);
+char *exp_name_tolower( const char *name, char *buffer, size_t len);
 #ifdef EXP_DEBUG
 void token_print( char *msg, token_t *token, int recur);
 #endif
@@ -31,7 +31,7 @@
  * @param token_t *token Token item which type MUST be T_PARAMETER
  * @return If the parameter name is valide, returns 0, otherwise returns 1
  */
-static int substitute_parameter( char *parameter_name, value_t *result){
+int exp_substitute_parameter( char *parameter_name, value_t *result){
 	if( NULL==parameter_name){
 		return 1;
 	}else{
@@ -61,47 +61,43 @@ static int substitute_parameter( char *parameter_name, value_t *result){
 }
 
 
-static int substitute_parameters_in_expr( expression_t *exp, token_t *t, exp_error_t *ercode, char *error, int *erpos){
-
-	//Substitute parameters
-	while(t){
-		if(t->param.type==T_PARAMETER){
-			char *p=t->param.value.parameter;
-			if( 0 ==substitute_parameter( p, &t->param)){
-				//the parameter was successfully substituted with its value
-				free( p);
-			}else{
-				exp_value_t exv;
-				if( exp->phandler && 0==exp->phandler( exp->user_data, p, &exv)){
-					//the parameter was successfully substituted with its value
-					free( p);
-					IMPORT_TO_VALUE_T( &exv, &t->param);
-					if( exv.type==EXP_STRING && exv.value.string){
-						free(exv.value.string);
-					}
-					if( t->param.type==T_NONE){
-						*erpos=t->position;
-						*ercode=EXP_ER_INVALRET;
-						strcpy( error, "Unknown type was returned by user defined parameter handler");
-						return 1;
-					}
+/*
+ * Compiles the expression into a program
+ *
+ * @param char *e String with the expr
+ * @return program_t* Program if e was parsed successfully or NULL if error
+ *         occured. In the later case error string is set.
+ */
+program_t *exp_compile( const char *e, exp_error_t *ercode, char *error, int *erpos){
+	program_t *p=NULL;
+	token_t *a, *b;
+	char *ecopy;
+	//tokens of usual expressions fit in the buffer on the stack
+	char buffer[4096];
+	arena_t arena;
 
-				}else{
-					//could not subst the parameter
-					*erpos=t->position;
-					*ercode=EXP_ER_INVALPARAM;
-					snprintf( error, EXP_ERLEN, "Unknown parameter '%s'", p);
-					return 1;
+	exp_arena_init( &arena, buffer, sizeof( buffer));
+	if(NULL==(ecopy=exp_arena_strdupn( &arena, e, strlen( e)))){
+		*ercode=EXP_ER_NOMEM;
+		strcpy( error, "Memory error");
+		*erpos=0;
+		return NULL;
+	}
+
+	//strtolower( ecopy);
+
+	if(( a=exp_parse( &arena, ecopy, ercode, error, erpos))){
+		if( 0 ==exp_check( a, ercode, error, erpos)){
+			if(( b=exp_shunting_yard( &arena, a, ercode, error, erpos))){
+				if(( p=exp_program_compile( b, ercode, error, erpos))){
+					p->hash=exp_hash_text( e);
 				}
 			}
-		}else if( t->param.type==T_IFSTATEMENT){
-			if( 0 !=substitute_parameters_in_expr( exp, t->children, ercode, error, erpos)){
-				return 1;
-			}
 		}
-		t=t->next;
 	}
-	return 0;
+	//all tokens are freed at once, only the program is left
+	exp_arena_free( &arena);
+	return p;
 }
 
 
@@ -115,45 +111,230 @@ static int substitute_parameters_in_expr( expression_t *exp, token_t *t, exp_err
  */
 expression_t *exp_create( const char *e, exp_error_t *ercode, char *error, int *erpos){
 	expression_t *ret=NULL;
-	token_t *a, *b;
-	char *ecopy;
+	program_t *p;
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_COMPILE);
+
+	if(( p=exp_compile( e, ercode, error, erpos))){
+		if( NULL==( ret=exp_mem_calloc( 1, sizeof( expression_t))) || NULL==( ret->e=exp_mem_strdup( e))){
+			exp_mem_free( ret);
+			ret=NULL;
+			exp_program_free( p);
+			*ercode=EXP_ER_NOMEM;
+			strcpy( error, "Memory error");
+			*erpos=0;
+		}else{
+			ret->program=p;
+		}
+	}
+	HEAP_LEAVE();
+	return ret;
+}
 
-	if(NULL==(ecopy=strdup( e))){
-		*ercode=EXP_ER_NOMEM;
-		strcpy( error, "Memory error");
-		*erpos=0;
+
+/*
+ * Return 0 if exprs are equal
+ */
+int exp_equals( expression_t *a, expression_t *b){
+	if( exp_hash( a) !=exp_hash( b)){
+		return 1;
+	}
+	return strcmp( a->e, b->e);
+}
+
+
+unsigned long long exp_hash( expression_t *exp){
+	return ((program_t *)exp->program)->hash;
+}
+
+
+int exp_param_count( expression_t *exp){
+	return ((program_t *)exp->program)->params_len;
+}
+
+
+int exp_param_index( expression_t *exp, const char *name){
+	program_t *p=exp->program;
+	char buffer[EXP_NAME_LEN], *lname;
+	symbol_t *s;
+	int i;
+
+	//names of parameters are stored in lower case
+	if( NULL==( lname=exp_name_tolower( name, buffer, sizeof( buffer)))){
+		return -1;
+	}
+	//the name is not interned if no expression uses it
+	s=exp_symbol_find( lname);
+	if( lname !=buffer){
+		free( lname);
+	}
+	if( NULL==s){
+		return -1;
+	}
+	for( i=0; i<p->params_len && p->params[i] !=s; i++);
+	exp_symbol_release( s);
+	return i<p->params_len ? i : -1;
+}
+
+
+const char *exp_param_name( expression_t *exp, int index){
+	program_t *p=exp->program;
+
+	if( index<0 || index>=p->params_len){
 		return NULL;
 	}
+	return p->params[index]->name;
+}
 
-	//strtolower( ecopy);
 
-	if(( a=exp_parse( ecopy, ercode, error, erpos))){
-		if( 0 ==exp_check( a, ercode, error, erpos)){
-			if(( b=exp_shunting_yard( a, 0, NULL, ercode, error, erpos))){
-				if(NULL==( ret=calloc( 1, sizeof( expression_t)))){
-					exp_token_free( b);
+/*
+ * Solve expr with parameters taken from the array indexed by parameter slot
+ * and store result in the structure supplied by the caller
+ * @return 0 if exp_rpn succeeded,
+ *         otherwise -1 is returned and error string is set.
+ *         String result should be freed
+ */
+static int solve_params( exp_ctx_t *ctx, expression_t *exp, const exp_value_t *params, exp_value_t *result, exp_error_t *ercode, char *error, int *erpos){
+	value_t v;
+	char *s;
+	int ret=-1;
+	HEAP_ENTER( ctx_allocator( ctx), EXP_PHASE_SOLVE);
+
+	//call exp_rpn algorithm
+	if( 0==exp_rpn( ctx, exp, exp->program, params, &v, ercode, error, erpos)){
+		ret=0;
+		switch( v.type){
+			case T_INTEGER: result->type=EXP_INTEGER; result->value.integer=v.value.integer; break;
+			case T_REAL:    result->type=EXP_REAL;    result->value.real=v.value.real; break;
+			case T_BOOLEAN: result->type=EXP_BOOLEAN; result->value.boolean=v.value.boolean; break;
+			case T_STRING:
+				//the string is passed to the caller, it is copied only when it
+				//is not allocated by the C library
+				if(( s=exp_mem_export( v.value.string))){
+					result->type=EXP_STRING;
+					result->value.string=s;
+				}else{
 					*ercode=EXP_ER_NOMEM;
-					strcpy( error, "Memory error");
+					strcpy(error, "Memory error");
 					*erpos=0;
-				}else{
-					ret->tokens=b;
-					ret->e=ecopy;
-					ecopy=NULL;
+					ret=-1;
 				}
-			}
+				break;
+			default:
+				*ercode=EXP_ER_INVALEXPR;
+				strcpy(error, "Result type is invalid");
+				*erpos=0;
+				exp_value_clear( &v);
+				ret=-1;
 		}
-		exp_token_free( a);
 	}
-	if( ecopy) free( ecopy);
+	HEAP_LEAVE();
 	return ret;
 }
 
 
+int exp_solve_params( expression_t *exp, const exp_value_t *params, exp_value_t *result, exp_error_t *ercode, char *error, int *erpos){
+	return solve_params( NULL, exp, params, result, ercode, error, erpos);
+}
+
+
 /*
- * Return 0 if exprs are equal
+ * Solve expr with the memory of the context, the error is stored in the
+ * context
+ * @return 0 if exp_rpn succeeded, otherwise -1 is returned.
+ *         String result should be freed
  */
-int exp_equals( expression_t *a, expression_t *b){
-	return strcmp( a->e, b->e);
+int exp_solve_ctx( exp_ctx_t *ctx, expression_t *exp, const exp_value_t *params, exp_value_t *result){
+	return solve_params( ctx, exp, params, result, &ctx->ercode, ctx->error, &ctx->error_pos);
+}
+
+
+exp_ctx_t *exp_ctx_create( void){
+	exp_ctx_t *ctx;
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_SOLVE);
+
+	if(( ctx=exp_mem_calloc( 1, sizeof( exp_ctx_t)))){
+		//every context starts its own sequence of random()
+		exp_random_seed( ctx->random, ((uint64_t)rand()<<32) ^ (uint64_t)rand());
+	}
+	HEAP_LEAVE();
+	return ctx;
+}
+
+
+void exp_ctx_seed( exp_ctx_t *ctx, unsigned long long seed){
+	exp_random_seed( ctx->random, seed);
+}
+
+
+/*
+ * Releases the memory that the context allocated with its allocator
+ */
+static void ctx_release( exp_ctx_t *ctx){
+	HEAP_ENTER( ctx_allocator( ctx), EXP_PHASE_SOLVE);
+
+	exp_mem_free( ctx->stack);
+	exp_mem_free( ctx->buffer);
+	ctx->stack=NULL;
+	ctx->stack_maxlen=0;
+	ctx->buffer=NULL;
+	ctx->buffer_len=0;
+	HEAP_LEAVE();
+}
+
+
+void exp_ctx_set_allocator( exp_ctx_t *ctx, const exp_allocator_t *allocator){
+	ctx_release( ctx);
+	ctx->allocator=allocator;
+}
+
+
+exp_ctx_t *exp_ctx_free( exp_ctx_t *ctx){
+	if( ctx){
+		HEAP_ENTER( exp_global_allocator, EXP_PHASE_SOLVE);
+		ctx_release( ctx);
+		exp_mem_free( ctx);
+		HEAP_LEAVE();
+	}
+	return NULL;
+}
+
+
+const char *exp_ctx_error( exp_ctx_t *ctx, exp_error_t *ercode, int *erpos){
+	if( ercode){
+		*ercode=ctx->ercode;
+	}
+	if( erpos){
+		*erpos=ctx->error_pos;
+	}
+	return ctx->error;
+}
+
+
+/*
+ * Solve expr for every row of the columns of parameters and store results in
+ * the column supplied by the caller
+ * @return 0 if exp_batch succeeded,
+ *         otherwise -1 is returned and error string is set.
+ *         String results should be freed
+ */
+int exp_solve_batch( expression_t *exp, const exp_column_t *columns, int rows, exp_column_t *result, exp_error_t *ercode, char *error, int *erpos){
+	int ret;
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_SOLVE);
+
+	ret=exp_batch( exp, exp->program, columns, rows, result, ercode, error, erpos);
+	HEAP_LEAVE();
+	return ret;
+}
+
+
+/*
+ * Solve expr and store result in the structure supplied by the caller
+ * @return 0 if exp_rpn succeeded,
+ *         otherwise -1 is returned and error string is set.
+ *         String result should be freed
+ */
+int exp_solve_r( expression_t *exp, exp_value_t *result, exp_error_t *ercode, char *error, int *erpos){
+	return exp_solve_params( exp, NULL, result, ercode, error, erpos);
 }
 
 
@@ -164,37 +345,17 @@ int exp_equals( expression_t *a, expression_t *b){
  *         Returned value should be freed
  */
 exp_value_t *exp_solve( expression_t *exp, exp_error_t *ercode, char *error, int *erpos){
-	int status;
-	value_t v;
-	token_t *tokens;
-	exp_value_t *result=NULL;
-
-	tokens=exp_token_dup( exp->tokens);
+	exp_value_t *result;
 
-	if( 0==substitute_parameters_in_expr( exp, tokens, ercode, error, erpos)){
-		//call exp_rpn algorithm
-		if(0 ==(status=exp_rpn( exp, tokens, &v, ercode, error, erpos))){
-
-			if( NULL==( result=calloc(1, sizeof(exp_value_t)))){
-				*ercode=EXP_ER_NOMEM;
-				strcpy(error, "Memory error");
-				if( v.type==T_STRING && v.value.string) free( v.value.string);
-				*erpos=0;
+	if( NULL==( result=calloc(1, sizeof(exp_value_t)))){
+		*ercode=EXP_ER_NOMEM;
+		strcpy(error, "Memory error");
+		*erpos=0;
 
-			}else{
-				EXPORT_FROM_VALUE_T( &v, result);
-				if( v.type==T_STRING && v.value.string) free( v.value.string);
-				if( result->type==EXP_NONE){
-					*ercode=EXP_ER_INVALEXPR;
-					strcpy(error, "Result type is invalid");
-					*erpos=0;
-					free( result);
-					result=NULL;
-				}
-			}
-		}
+	}else if( 0 !=exp_solve_r( exp, result, ercode, error, erpos)){
+		free( result);
+		result=NULL;
 	}
-	exp_token_free( tokens);
 	return result;
 }
 
@@ -240,11 +401,13 @@ char *exp_value_to_string_r( exp_value_t *ev, char *buffer, int buffer_max_len){
 	}
 }
 
-static char *temp_buffer=NULL;
-static int temp_buffer_len=0;
-char *exp_value_to_string( exp_value_t *ev){
-
+/*
+ * Converts the value to string in the buffer that grows to fit the result
+ */
+static char *value_to_buffer( exp_value_t *ev, char **buffer, int *buffer_len){
+	char *b;
 	int new_buffer_len;
+
 	if(ev->type==EXP_STRING){
 		new_buffer_len=strlen( ev->value.string)+1;
 	}else{
@@ -252,25 +415,49 @@ char *exp_value_to_string( exp_value_t *ev){
 	}
 
 	//Alloc temporary buffer
-	if( temp_buffer_len <new_buffer_len){
-		if((temp_buffer=realloc(temp_buffer, new_buffer_len))){
-			temp_buffer_len=new_buffer_len;
+	if( *buffer_len <new_buffer_len){
+		if((b=exp_mem_realloc( *buffer, new_buffer_len))){
+			*buffer=b;
+			*buffer_len=new_buffer_len;
 
 		}else{
-			temp_buffer_len=0;
 			errno=ENOMEM;
 			return NULL;
 		}
 	}
 
-	return exp_value_to_string_r( ev, temp_buffer, temp_buffer_len);
+	return exp_value_to_string_r( ev, *buffer, *buffer_len);
+}
+
+//The buffer lives as long as the process, so it is allocated by the C library
+static char *temp_buffer=NULL;
+static int temp_buffer_len=0;
+char *exp_value_to_string( exp_value_t *ev){
+	char *ret;
+	HEAP_ENTER( NULL, EXP_PHASE_SOLVE);
+
+	ret=value_to_buffer( ev, &temp_buffer, &temp_buffer_len);
+	HEAP_LEAVE();
+	return ret;
+}
+
+char *exp_ctx_value_to_string( exp_ctx_t *ctx, exp_value_t *ev){
+	char *ret;
+	HEAP_ENTER( ctx_allocator( ctx), EXP_PHASE_SOLVE);
+
+	ret=value_to_buffer( ev, &ctx->buffer, &ctx->buffer_len);
+	HEAP_LEAVE();
+	return ret;
 }
 
 
 expression_t *exp_free( expression_t *exp){
-	exp_token_free( exp->tokens);
-	free( exp->e);
-	free( exp);
+	HEAP_ENTER( exp_global_allocator, EXP_PHASE_COMPILE);
+
+	exp_program_free( exp->program);
+	exp_mem_free( exp->e);
+	exp_mem_free( exp);
+	HEAP_LEAVE();
 	return NULL;
 }
 
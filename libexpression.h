@@ -24,6 +24,8 @@
 #ifndef LIBEXPRESSION_H_
 #define LIBEXPRESSION_H_
 
+#include <stddef.h>
+
 
 
 /**
@@ -299,6 +301,41 @@ typedef struct{
 	} value; /**< @brief Union with a special field for every type of variable. */
 }exp_value_t;
 
+/**
+ * @brief Column of values of the same type, used by exp_solve_batch().
+ *
+ * The column does not store the number of values, it is passed to
+ * exp_solve_batch() separately. The field of @c data that matches @c type
+ * points to the array of values.
+ */
+typedef struct{
+	/**
+	 * @brief Type of all values in the column. Column of parameter with type
+	 * @c EXP_NONE is resolved with the parameter handler.
+	 */
+	exp_value_type_t type;
+
+	union{
+		/**
+		 * @brief Values of integer column.
+		 */
+		long long int *integer;
+		/**
+		 * @brief Values of floating point column.
+		 */
+		double *real;
+		/**
+		 * @brief Values of boolean column.
+		 */
+		int *boolean;
+		/**
+		 * @brief Values of string column. NULL string is the same as "NULL".
+		 */
+		char **string;
+
+	} data; /**< @brief Union with a pointer to array for every type of column. */
+}exp_column_t;
+
 /**
  * @brief A definition of user supplied callback that exp_solve()
  * calls to evaluate unknown functions in an expression.
@@ -306,6 +343,21 @@ typedef struct{
  */
 typedef int exp_function_handler_f( void *user_data, char *function_name, int argc, exp_value_t *argv, exp_value_t *result);
 
+/**
+ * @brief A definition of user function registered with exp_register_function().
+ * See exp_register_function() for more information.
+ */
+typedef int exp_user_function_f( void *user_data, int argc, const exp_value_t *argv, exp_value_t *result);
+
+/**
+ * @brief Flag of registered function: the function always returns the same
+ * result for the same arguments.
+ *
+ * Such function is evaluated when the expression is created if all its
+ * arguments are constants. See exp_register_function().
+ */
+#define EXP_FUNC_PURE 0x01
+
 /**
  * @brief A definition of user supplied callback that exp_solve()
  * calls to evaluate unknown parameters or variable names in an expression.
@@ -328,9 +380,9 @@ typedef struct expression_s{
 	 */
 	void *user_data;
 	/**
-	 * @brief Linked list of tokens that expression consist of.
+	 * @brief Compiled program that exp_solve() executes.
 	 */
-	void *tokens;
+	void *program;
 	/**
 	 * @brief Pointer to a buffer containing copy of the supplied expression.
 	 */
@@ -347,6 +399,16 @@ typedef struct expression_s{
 	exp_parameter_handler_f *phandler;
 }expression_t;
 
+/**
+ * @brief Evaluation context.
+ *
+ * The context holds the memory and the state that libexpression uses while
+ * it solves expressions: the value stack, the buffer for string
+ * representation of results, the state of @c random() and the last error. The
+ * fields of this structure are private. See exp_ctx_create().
+ */
+typedef struct exp_ctx_s exp_ctx_t;
+
 /**
  * @brief Parse an expression and construct a libexpression structure.
  *
@@ -434,6 +496,451 @@ expression_t *exp_create( const char *e, exp_error_t *ercode, char *error, int *
  */
 exp_value_t *exp_solve( expression_t *exp, exp_error_t *ercode, char *error, int *erpos);
 
+/**
+ * @brief Solve the expression and store its result in the supplied structure.
+ *
+ * The exp_solve_r() routine is similar to exp_solve(), but instead of
+ * allocating a structure for the result, it stores the result in a structure
+ * supplied by the caller. Expressions that do not use strings are solved
+ * without any heap allocations, so this routine is preferred when the same
+ * expression is solved many times.
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param result Pointer to a structure where the result is stored. If the type
+ *    of the result is @c EXP_STRING, then the string must be freed with free()
+ *    when it is no longer needed. The structure is not changed if error occurs.
+ * @param ercode Pointer to an integer where exp_solve_r() can store error code
+ *    if error occurs. See exp_solve().
+ * @param error Pointer to a buffer where exp_solve_r() can store error message
+ *    if error occurs. See exp_solve().
+ * @param erpos Pointer to an integer value where exp_solve_r() can store
+ *    position of the first error in the expression. See exp_solve().
+ * @return 0 if the expression was solved or -1 if error occured.
+ */
+int exp_solve_r( expression_t *exp, exp_value_t *result, exp_error_t *ercode, char *error, int *erpos);
+
+/**
+ * @brief Get the number of parameters used in the expression.
+ *
+ * When the expression is created, every parameter (or variable name) of the
+ * expression gets a slot, i.e. an index starting from 0. All occurrences of
+ * the parameter share the same slot. Built-in constants, such as Pi and True,
+ * are not parameters and they do not get a slot. Parameters that appear only
+ * in a branch of conditional expression that is never evaluated (because the
+ * condition is constant) do not get a slot too.
+ *
+ * Slots allow to pass values of parameters to exp_solve_params() in an array,
+ * without calling the parameter handler for every occurrence of a parameter.
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @return Number of parameter slots. Slots are numbered from 0 to
+ *    exp_param_count()-1.
+ */
+int exp_param_count( expression_t *exp);
+
+/**
+ * @brief Get the slot of the parameter with the given name.
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param name Name of the parameter. Names are case insensitive, like the
+ *    names of parameters in expressions.
+ * @return Slot of the parameter or -1 if the expression does not use this
+ *    parameter.
+ */
+int exp_param_index( expression_t *exp, const char *name);
+
+/**
+ * @brief Get the name of the parameter in the given slot.
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param index Slot of the parameter.
+ * @return Name of the parameter in lower case or NULL if the slot is out of
+ *    range. The string belongs to the expression and must not be freed.
+ */
+const char *exp_param_name( expression_t *exp, int index);
+
+/**
+ * @brief Solve the expression with values of parameters supplied in an array.
+ *
+ * The exp_solve_params() routine is similar to exp_solve_r(), but the values
+ * of parameters are taken from the array @c params indexed by parameter slot
+ * (see exp_param_index()). The values are used as is: the parameter handler
+ * is not called and strings are not copied. A slot with type @c EXP_NONE is
+ * resolved with the parameter handler as usual.
+ *
+ * @code
+expression_t *exp=exp_create( "price*count", &ercode, error, &error_pos);
+exp_value_t params[2], result;
+int price=exp_param_index( exp, "price");
+int count=exp_param_index( exp, "count");
+
+params[price].type=EXP_REAL;
+params[price].value.real=9.95;
+params[count].type=EXP_INTEGER;
+params[count].value.integer=3;
+if( 0==exp_solve_params( exp, params, &result, &ercode, error, &error_pos)){
+	printf( "%f\n", result.value.real);
+}
+@endcode
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param params Array of exp_param_count() values. The strings in the array
+ *    must not be freed or changed while exp_solve_params() runs. May be NULL,
+ *    then all parameters are resolved with the parameter handler.
+ * @param result Pointer to a structure where the result is stored. See
+ *    exp_solve_r().
+ * @param ercode Pointer to an integer where exp_solve_params() can store error
+ *    code if error occurs. See exp_solve().
+ * @param error Pointer to a buffer where exp_solve_params() can store error
+ *    message if error occurs. See exp_solve().
+ * @param erpos Pointer to an integer value where exp_solve_params() can store
+ *    position of the first error in the expression. See exp_solve().
+ * @return 0 if the expression was solved or -1 if error occured.
+ */
+int exp_solve_params( expression_t *exp, const exp_value_t *params, exp_value_t *result, exp_error_t *ercode, char *error, int *erpos);
+
+/**
+ * @brief Solve the expression for many rows of parameters at once.
+ *
+ * The exp_solve_batch() routine evaluates the expression for every row of
+ * the columns of parameters and stores the results in the column @c result.
+ * The rows are processed in chunks: every operator is evaluated for the whole
+ * chunk before the next one, so the cost of interpreting the expression is
+ * paid once per chunk instead of once per row. The results are the same as if
+ * exp_solve_params() were called for every row.
+ *
+ * @code
+double price[ROWS], total[ROWS];
+long long int count[ROWS];
+exp_column_t columns[2], result;
+
+columns[exp_param_index( exp, "price")]=(exp_column_t){ EXP_REAL, { .real=price}};
+columns[exp_param_index( exp, "count")]=(exp_column_t){ EXP_INTEGER, { .integer=count}};
+result=(exp_column_t){ EXP_REAL, { .real=total}};
+if( 0 !=exp_solve_batch( exp, columns, ROWS, &result, &ercode, error, &error_pos)){
+	fprintf( stderr, "Error at %d: %s\n", error_pos+1, error);
+}
+@endcode
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param columns Array of exp_param_count() columns indexed by parameter slot
+ *    (see exp_param_index()). Every column must have at least @c rows values,
+ *    strings are not copied. May be NULL, then all parameters are resolved with
+ *    the parameter handler for every row.
+ * @param rows Number of rows.
+ * @param result Column where the results are stored. The caller sets the type
+ *    of the column and the array of at least @c rows values. Every result is
+ *    converted to the type of the column. Strings stored in the column are
+ *    allocated and should be freed.
+ * @param ercode Pointer to an integer where exp_solve_batch() can store error
+ *    code if error occurs. See exp_solve().
+ * @param error Pointer to a buffer where exp_solve_batch() can store error
+ *    message if error occurs. See exp_solve().
+ * @param erpos Pointer to an integer value where exp_solve_batch() can store
+ *    position of the first error in the expression. See exp_solve().
+ * @return 0 if the expression was solved for all rows or -1 if error occured.
+ *    In the later case no strings are left in the column @c result.
+ */
+int exp_solve_batch( expression_t *exp, const exp_column_t *columns, int rows, exp_column_t *result, exp_error_t *ercode, char *error, int *erpos);
+
+/**
+ * @brief Cache of compiled expressions.
+ *
+ * The fields of this structure are private. See exp_cache_create().
+ */
+typedef struct exp_cache_s exp_cache_t;
+
+/**
+ * @brief Create cache of compiled expressions.
+ *
+ * Applications that create expressions from the same texts many times may
+ * create them with exp_create_cached() instead of exp_create(). The
+ * expression is parsed and compiled only when its text is not found in the
+ * cache, otherwise the new expression shares the compiled program with the
+ * other expressions created from the same text. Compiled programs are
+ * immutable, so the expressions may be used in different threads; every
+ * expression still has its own handlers and user data.
+ *
+ * The cache is thread-safe. When the cache is full, the expression that was
+ * not requested for the longest time is removed from it. The expressions
+ * that were already created from it remain valid. Caches of 128 and more
+ * expressions are split into up to 16 shards by the hash of the text, so
+ * that threads rarely wait for each other. Every shard gets an equal part
+ * of the capacity, and the least recently used expression is removed from
+ * the shard that is full.
+ *
+ * @param capacity Maximum number of expressions in the cache.
+ * @return Pointer to the cache or NULL if memory error occured or capacity is
+ *    less than 1. The cache should be freed with exp_cache_free().
+ */
+exp_cache_t *exp_cache_create( int capacity);
+
+/**
+ * @brief Free the cache created with exp_cache_create().
+ *
+ * Expressions created with exp_create_cached() remain valid after the cache
+ * is freed, they should be freed with exp_free() as usual.
+ *
+ * @param cache Pointer to the cache.
+ * @return Always returns NULL.
+ */
+exp_cache_t *exp_cache_free( exp_cache_t *cache);
+
+/**
+ * @brief Create expression with the compiled program from the cache.
+ *
+ * The routine is the same as exp_create(), but the compiled program is taken
+ * from the cache if the same text was compiled before. Expressions with errors
+ * are not cached.
+ *
+ * @param cache Pointer to the cache returned by exp_cache_create().
+ * @param e Expression, see exp_create().
+ * @param ercode Pointer to an integer where error code is stored if error
+ *    occurs. See exp_create().
+ * @param error Pointer to a buffer where error message is stored if error
+ *    occurs. See exp_create().
+ * @param erpos Pointer to an integer where position of error is stored if
+ *    error occurs. See exp_create().
+ * @return A structure containing all the information about the expression.
+ *    It should be freed with exp_free().
+ */
+expression_t *exp_create_cached( exp_cache_t *cache, const char *e, exp_error_t *ercode, char *error, int *erpos);
+
+/**
+ * @brief Get statistics of the cache.
+ *
+ * @param cache Pointer to the cache returned by exp_cache_create().
+ * @param hits Pointer to a variable where the number of expressions found in
+ *    the cache is stored.
+ * @param misses Pointer to a variable where the number of expressions that
+ *    were compiled is stored.
+ * @param len Pointer to a variable where the number of expressions in the
+ *    cache is stored.
+ */
+void exp_cache_stats( exp_cache_t *cache, unsigned long long *hits, unsigned long long *misses, int *len);
+
+/**
+ * @brief Create evaluation context.
+ *
+ * A thread creates the context once and passes it to exp_solve_ctx() and
+ * exp_ctx_value_to_string(). The memory of the context is reused by every
+ * call, so solving an expression with the context does not allocate memory
+ * for the value stack again, and threads that use their own contexts do not
+ * share any mutable state. One expression may be solved in many threads at
+ * the same time, if every thread uses its own context.
+ *
+ * The context must not be used by two threads at the same time, and it must
+ * not be used by the function or parameter handler while it solves an
+ * expression.
+ *
+ * Every context has its own generator of pseudo-random numbers returned by
+ * @c random(). The generator is seeded with a number taken from @c rand(), so
+ * call @c srand() before contexts are created, or seed the context with
+ * exp_ctx_seed().
+ *
+ * @code
+exp_ctx_t *ctx=exp_ctx_create();
+exp_value_t result;
+
+if( 0==exp_solve_ctx( ctx, exp, NULL, &result)){
+	printf( "%s\n", exp_ctx_value_to_string( ctx, &result));
+	if( result.type==EXP_STRING){
+		free( result.value.string);
+	}
+}else{
+	int error_pos;
+	const char *error=exp_ctx_error( ctx, NULL, &error_pos);
+	fprintf( stderr, "Error at %d: %s\n", error_pos+1, error);
+}
+exp_ctx_free( ctx);
+@endcode
+ *
+ * @return Pointer to the context or NULL if memory error occured. The
+ *    context should be freed with exp_ctx_free().
+ */
+exp_ctx_t *exp_ctx_create( void);
+
+/**
+ * @brief Free evaluation context created with exp_ctx_create().
+ *
+ * @param ctx Pointer to the context.
+ * @return Always returns NULL.
+ */
+exp_ctx_t *exp_ctx_free( exp_ctx_t *ctx);
+
+/**
+ * @brief Seed the generator of pseudo-random numbers of the context.
+ *
+ * Functions @c random() and @c rand() of expressions solved with the context
+ * return the same sequence of numbers after the context is seeded with the
+ * same seed. The generator is xoshiro256**, the numbers do not depend on
+ * @c srand() and on other contexts.
+ *
+ * @param ctx Pointer to the context returned by exp_ctx_create().
+ * @param seed Any number.
+ */
+void exp_ctx_seed( exp_ctx_t *ctx, unsigned long long seed);
+
+/**
+ * @brief Solve the expression with the evaluation context.
+ *
+ * The exp_solve_ctx() routine is similar to exp_solve_params(), but it uses
+ * the memory and the state of the context. If error occurs, the error is
+ * stored in the context, see exp_ctx_error().
+ *
+ * @param ctx Pointer to the context returned by exp_ctx_create().
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @param params Array of values of parameters or NULL. See exp_solve_params().
+ * @param result Pointer to a structure where the result is stored. See
+ *    exp_solve_r().
+ * @return 0 if the expression was solved or -1 if error occured.
+ */
+int exp_solve_ctx( exp_ctx_t *ctx, expression_t *exp, const exp_value_t *params, exp_value_t *result);
+
+/**
+ * @brief Get the last error that occured in exp_solve_ctx().
+ *
+ * @param ctx Pointer to the context returned by exp_ctx_create().
+ * @param ercode Pointer to an integer where the error code is stored, may be
+ *    NULL.
+ * @param erpos Pointer to an integer where the position of the error is
+ *    stored, may be NULL. See exp_solve().
+ * @return Error message. The string belongs to the context, it is valid until
+ *    the next error.
+ */
+const char *exp_ctx_error( exp_ctx_t *ctx, exp_error_t *ercode, int *erpos);
+
+/**
+ * @brief Allocator of the memory that libexpression uses.
+ *
+ * By default libexpression allocates memory with @c malloc(), @c realloc()
+ * and @c free() of the C library. An application may supply its own
+ * allocator to exp_set_allocator() or exp_ctx_set_allocator(). The callbacks
+ * receive @c opaque as the first argument. The allocator must return memory
+ * aligned like @c malloc() does, it may be called from every thread that
+ * uses the library.
+ *
+ * Strings that are passed between the application and the library are
+ * allocated by the C library whatever allocator is set: strings of results
+ * are freed with @c free() and strings returned by handlers and registered
+ * functions are allocated with @c malloc(), as usual. The names of parameters
+ * and functions, the table of registered functions and the buffer of
+ * exp_value_to_string() live as long as the process, so they are allocated
+ * by the C library as well.
+ */
+typedef struct{
+	/**
+	 * @brief Allocate @c size bytes, return NULL if memory error occured.
+	 */
+	void *(*malloc)( void *opaque, size_t size);
+	/**
+	 * @brief Resize the block to @c size bytes like @c realloc() does,
+	 * @c ptr may be NULL.
+	 */
+	void *(*realloc)( void *opaque, void *ptr, size_t size);
+	/**
+	 * @brief Release the block, @c ptr is never NULL.
+	 */
+	void (*free)( void *opaque, void *ptr);
+	/**
+	 * @brief Pointer that is passed to the callbacks.
+	 */
+	void *opaque;
+}exp_allocator_t;
+
+/**
+ * @brief Phases in which libexpression allocates memory.
+ */
+typedef enum{
+	EXP_PHASE_COMPILE=0, /**< @brief Expression is created or freed. */
+	EXP_PHASE_SOLVE,     /**< @brief Expression is solved. */
+	EXP_PHASES           /**< @brief Number of phases. */
+}exp_phase_t;
+
+/**
+ * @brief Counters of allocations made in one phase.
+ */
+typedef struct{
+	unsigned long long calls; /**< @brief Calls of malloc and realloc. */
+	unsigned long long frees; /**< @brief Calls of free. */
+	unsigned long long bytes; /**< @brief Bytes requested by malloc and realloc. */
+}exp_alloc_count_t;
+
+/**
+ * @brief Allocator that counts allocations.
+ *
+ * The counting allocator passes every call to the parent allocator and
+ * counts it in the phase that made it. Counters are updated atomically, so
+ * one counting allocator may be used by many threads. See
+ * exp_counting_allocator_init().
+ */
+typedef struct{
+	/**
+	 * @brief The allocator to pass to exp_set_allocator() or
+	 * exp_ctx_set_allocator().
+	 */
+	exp_allocator_t allocator;
+	/**
+	 * @brief Allocator that allocates the memory or NULL for the C library.
+	 */
+	const exp_allocator_t *parent;
+	/**
+	 * @brief Counters indexed by @c exp_phase_t.
+	 */
+	exp_alloc_count_t count[EXP_PHASES];
+}exp_counting_allocator_t;
+
+/**
+ * @brief Set the allocator of the library.
+ *
+ * The allocator is used for compiled expressions, the cache and for solving
+ * expressions without a context or with a context that has no allocator of
+ * its own. Like exp_register_function(), exp_set_allocator() is not
+ * thread-safe: set the allocator when the program starts, before expressions
+ * are created. The allocator must stay valid while memory allocated with it
+ * is in use.
+ *
+ * @param allocator Pointer to the allocator or NULL to use the C library.
+ */
+void exp_set_allocator( const exp_allocator_t *allocator);
+
+/**
+ * @brief Set the allocator of the evaluation context.
+ *
+ * Memory that exp_solve_ctx() allocates while it solves expressions, the
+ * value stack and the buffer of exp_ctx_value_to_string() are allocated with
+ * this allocator. The structure of the context is allocated with the
+ * allocator of the library. The memory of the context that was allocated
+ * with the previous allocator is released first, so a context may switch to
+ * a new arena allocator for every request.
+ *
+ * @code
+exp_counting_allocator_t counter;
+
+exp_counting_allocator_init( &counter, NULL);
+exp_ctx_set_allocator( ctx, &counter.allocator);
+exp_solve_ctx( ctx, exp, params, &result);
+printf( "%llu allocations\n", counter.count[EXP_PHASE_SOLVE].calls);
+@endcode
+ *
+ * @param ctx Pointer to the context returned by exp_ctx_create().
+ * @param allocator Pointer to the allocator or NULL to use the allocator of
+ *    the library, see exp_set_allocator().
+ */
+void exp_ctx_set_allocator( exp_ctx_t *ctx, const exp_allocator_t *allocator);
+
+/**
+ * @brief Initialize the counting allocator.
+ *
+ * All counters are set to zero. Set them to zero again to start new
+ * measurement.
+ *
+ * @param counter Pointer to the counting allocator.
+ * @param parent Allocator that allocates the memory or NULL to use the C
+ *    library.
+ */
+void exp_counting_allocator_init( exp_counting_allocator_t *counter, const exp_allocator_t *parent);
+
 /**
  * @brief Test two expressions for equality.
  *
@@ -445,6 +952,17 @@ exp_value_t *exp_solve( expression_t *exp, exp_error_t *ercode, char *error, int
  */
 int exp_equals( expression_t *a, expression_t *b);
 
+/**
+ * @brief Get hash of the text of the expression.
+ *
+ * The hash is computed when the expression is created. Expressions with
+ * different hashes are not equal, see exp_equals().
+ *
+ * @param exp Pointer to a structure that was returned by exp_create().
+ * @return 64-bit hash of the text of the expression.
+ */
+unsigned long long exp_hash( expression_t *exp);
+
 /**
  * @brief Convert evaluation result to its string representation.
  *
@@ -456,7 +974,7 @@ int exp_equals( expression_t *a, expression_t *b);
  * <i>exp_value_to_string() is not thread-safe</i>. It retuns a pointer to a static
  * buffer that is reused every time exp_value_to_string() is called.
  * If you need a thread-safe version of this routine, use
- * exp_value_to_string_r().
+ * exp_value_to_string_r() or exp_ctx_value_to_string().
  *
  * @see exp_value_to_string_r().
  *
@@ -487,6 +1005,23 @@ char *exp_value_to_string( exp_value_t *ev);
  */
 char *exp_value_to_string_r( exp_value_t *ev, char *buffer, int buffer_max_len);
 
+/**
+ * @brief Convert evaluation result to its string representation in the
+ * buffer of the evaluation context.
+ *
+ * The routine is similar to exp_value_to_string(), but the buffer belongs to
+ * the context, so the routine is safe to use in threads that have their own
+ * contexts.
+ *
+ * @param ctx Pointer to the context returned by exp_ctx_create().
+ * @param ev Pointer to a structure containing result.
+ * @return Pointer to the buffer of the context with the result converted into
+ *    its string representation. The buffer is reused every time the routine
+ *    is called with the context. If error occurs, the routine returns NULL and
+ *    sets errno.
+ */
+char *exp_ctx_value_to_string( exp_ctx_t *ctx, exp_value_t *ev);
+
 /**
  * @brief Free previously allocated expression structure.
  *
@@ -625,6 +1160,73 @@ int main( int argc, char *argv[]){
  */
 #define exp_set_function_handler( exp, f) {(exp)->fhandler=(f);}
 
+/**
+ * @brief Register user function that can be used in all expressions.
+ *
+ * Unlike the function handler set by exp_set_function_handler(), registered
+ * function is found by name only once, when expression is created by
+ * exp_create(), and the number of arguments is checked at the same time. When
+ * the expression is solved, the callback is called directly. The arguments are
+ * not copied, so strings in @c argv belong to the library: they must not be
+ * freed or changed and they are valid only while the callback runs.
+ *
+ * Registered functions are available in all expressions created after the
+ * function is registered. Built-in functions can not be redefined. If the
+ * function with the same name is registered again, the new callback replaces
+ * the previous one, also in expressions that were already created.
+ *
+ * exp_register_function() is not thread-safe. Register all functions when
+ * the program starts, before expressions are created or solved.
+ *
+@code
+static int avg( void *user_data, int argc, const exp_value_t *argv, exp_value_t *result){
+	double sum=0;
+	int i;
+
+	for( i=0; i<argc; i++){
+		if( argv[i].type==EXP_INTEGER){
+			sum+=argv[i].value.integer;
+		}else if( argv[i].type==EXP_REAL){
+			sum+=argv[i].value.real;
+		}else{
+			return 2;
+		}
+	}
+	result->type=EXP_REAL;
+	result->value.real=sum/argc;
+	return 0;
+}
+
+//avg() takes one or more arguments
+exp_register_function( "avg", 1, -1, EXP_FUNC_PURE, avg, NULL);
+@endcode
+ *
+ * @param name Name of the function. Names are case insensitive, like the
+ *    names of functions in expressions.
+ * @param min_argc Minimum number of arguments.
+ * @param max_argc Maximum number of arguments, or -1 if the number of
+ *    arguments is not limited.
+ * @param flags Zero or @c EXP_FUNC_PURE.
+ * @param func Callback that evaluates the function. The arguments to the
+ * callback are:
+ *    @li @c user_data - the pointer passed to exp_register_function().
+ *    @li @c argc - number of arguments passed to the function.
+ *    @li @c argv - array of @c exp_value_t structures with arguments.
+ *    @li @c result - pointer to a @c exp_value_t structure that must be filled
+ *        with result. If the type of the result is String, the buffer that
+ *        will contain the result must be allocated with malloc(). It will be
+ *        freed automatically.
+ * @par
+ * Callback should return 0 if the function was evaluated, and non-zero value
+ * if arguments are invalid. In the later case exp_solve() generates error
+ * @c EXP_ER_USERFUNCERROR.
+ * @param user_data Pointer that is passed to the callback.
+ * @return 0 if the function was registered, @c EXP_ER_INVALARGV if arguments
+ *    are invalid, @c EXP_ER_INVALFUNC if the name is the name of built-in
+ *    function, @c EXP_ER_NOMEM if memory error occured.
+ */
+int exp_register_function( const char *name, int min_argc, int max_argc, int flags, exp_user_function_f *func, void *user_data);
+
 /**
  * @brief Define a callback that exp_solve() will call to evaluate unknown
  * parameters or constants.
@@ -0,0 +1,1007 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Compile RPN token list into a flat program. Parts of the expression that
+ * consist only of constants are evaluated at compile time.
+ */
+
+#include "libexpression-private.h"
+
+
+#define COMPILE_ERROR( _ercode, _estring, _epos) {\
+	*ercode=(_ercode);\
+	strcpy( error, _estring);\
+	*error_pos=(_epos);\
+}
+
+
+/*
+ * Copies the value, string is duplicated and its numeric form is cached,
+ * parameter name and function name are interned.
+ *
+ * @return 0 on success or -1 if memory error occured
+ */
+static int copy_value( value_t *to, value_t *from){
+	symbol_t *s;
+	int64_t i;
+	double d;
+
+	memcpy( to, from, sizeof( value_t));
+	to->borrowed=0;
+	to->number=NUMBER_UNKNOWN;
+	if( from->type==T_STRING){
+		if( from->value.string && NULL==( to->value.string=exp_mem_strdup( from->value.string))){
+			return -1;
+		}
+		//numeric form of the string constant is cached once, it is not
+		//parsed again when the constant is pushed
+		exp_string_number( to, &i, &d);
+	}else if( from->type==T_PARAMETER || from->type==T_FUNCTION){
+		//parameter name and function name share the same union field
+		if( from->value.string){
+			if( NULL==( s=exp_symbol_intern( from->value.string))){
+				return -1;
+			}
+			to->value.string=s->name;
+		}
+	}
+	return 0;
+}
+
+
+static void free_constant( value_t *c){
+	if( c->type==T_STRING && c->value.string){
+		exp_mem_free( c->value.string);
+	}else if(( c->type==T_PARAMETER || c->type==T_FUNCTION) && c->value.string){
+		exp_symbol_release( SYMBOL_OF( c->value.string));
+	}
+}
+
+
+/*
+ * Appends a copy of the value to the constant pool of the program.
+ *
+ * @return Index of the constant in the pool or -1 if memory error occured
+ */
+static int add_constant( program_t *p, value_t *v){
+	value_t *c;
+
+	if( p->constants_len>=p->constants_maxlen){
+		if(NULL==( c=exp_mem_realloc( p->constants, sizeof( value_t)*(p->constants_maxlen+128)))){
+			return -1;
+		}
+		p->constants=c;
+		p->constants_maxlen+=128;
+	}
+	if( -1==copy_value( &p->constants[p->constants_len], v)){
+		return -1;
+	}
+	return p->constants_len++;
+}
+
+
+/*
+ * Finds the slot of the parameter, the slot is added if the parameter is used
+ * for the first time.
+ *
+ * @return Slot of the parameter or -1 if memory error occured
+ */
+static int add_parameter( program_t *p, char *name){
+	symbol_t **n, *s;
+	int i;
+
+	if( NULL==( s=exp_symbol_intern( name))){
+		return -1;
+	}
+	for( i=0; i<p->params_len; i++){
+		if( p->params[i]==s){
+			exp_symbol_release( s);
+			return i;
+		}
+	}
+	if( p->params_len>=p->params_maxlen){
+		if(NULL==( n=exp_mem_realloc( p->params, sizeof( symbol_t *)*(p->params_maxlen+16)))){
+			exp_symbol_release( s);
+			return -1;
+		}
+		p->params=n;
+		p->params_maxlen+=16;
+	}
+	p->params[p->params_len]=s;
+	return p->params_len++;
+}
+
+
+/*
+ * Appends an instruction to the program.
+ *
+ * @return Index of the instruction or -1 if memory error occured
+ */
+static int emit( program_t *p, opcode_t opcode, int operand, int argc, int position){
+	instruction_t *i;
+
+	if( p->code_len>=p->code_maxlen){
+		if(NULL==( i=exp_mem_realloc( p->code, sizeof( instruction_t)*(p->code_maxlen+128)))){
+			return -1;
+		}
+		p->code=i;
+		p->code_maxlen+=128;
+	}
+	i=&p->code[p->code_len];
+	i->opcode=opcode;
+	i->operand=operand;
+	i->argc=argc;
+	i->position=position;
+	i->type=TYPE_ANY;
+	i->flags=0;
+	return p->code_len++;
+}
+
+
+/*
+ * Removes the instructions, the constants and the parameters that were added
+ * to the program after it had the given length.
+ */
+static void truncate_program( program_t *p, int code_len, int constants_len, int params_len){
+	while( p->constants_len>constants_len){
+		free_constant( &p->constants[--p->constants_len]);
+	}
+	while( p->params_len>params_len){
+		exp_symbol_release( p->params[--p->params_len]);
+	}
+	p->code_len=code_len;
+}
+
+
+/*
+ * Evaluates operator or built-in function at compile time. This is possible
+ * when all operands are constants, i.e. they are pushed by the last `argc'
+ * instructions, and the function is pure. The instructions that push the
+ * operands are replaced with a single instruction that pushes the result.
+ *
+ * The operands pushed by the trailing I_PUSH instructions are always the last
+ * entries of the constant pool, so they are removed from the pool too.
+ *
+ * @return 1 if the operator or function was folded, 0 if it could not be
+ *         folded (in this case the program is not changed and evaluation
+ *         errors are reported by exp_solve()), -1 if memory error occured
+ */
+static int fold( program_t *p, opcode_t opcode, int operand, int argc){
+	value_t *stack;
+	int stack_len;
+	int status;
+	int i, c;
+
+	if( p->code_len<argc){
+		return 0;
+	}
+	for( i=p->code_len-argc; i<p->code_len; i++){
+		if( p->code[i].opcode !=I_PUSH){
+			return 0;
+		}
+	}
+	if( opcode==I_FUNCTION && !exp_function_is_pure( operand)){
+		return 0;
+	}
+
+	//The operands are evaluated on a copy, so that the program stays intact
+	//if evaluation fails
+	if( NULL==( stack=exp_mem_calloc( argc>0 ? argc : 1, sizeof( value_t)))){
+		return -1;
+	}
+	status=0;
+	for( stack_len=0; stack_len<argc; stack_len++){
+		if( -1==copy_value( &stack[stack_len], &p->constants[p->code[p->code_len-argc+stack_len].operand])){
+			status=-1;
+			break;
+		}
+	}
+	if( status==0){
+		if( opcode==I_OPERATOR){
+			status=exp_eval_operator( stack, operand, &stack_len);
+		}else{
+			status=exp_call_resolved( NULL, operand, argc, stack, &stack_len);
+		}
+		if( status==0){
+			truncate_program( p, p->code_len-argc, argc>0 ? p->code[p->code_len-argc].operand : p->constants_len, p->params_len);
+			//a folded result has no position, like results of the evaluator
+			if( -1==( c=add_constant( p, &stack[0])) || -1==emit( p, I_PUSH, c, 0, 0)){
+				status=-1;
+			}else{
+				status=1;
+			}
+		}else{
+			status=0;
+		}
+	}
+	while( stack_len){
+		exp_value_clear( &stack[--stack_len]);
+	}
+	exp_mem_free( stack);
+	return status;
+}
+
+
+/*
+ * Removes the instruction from the program, the jumps over the instruction
+ * are adjusted. Jumps are not allowed to target the instruction itself.
+ */
+static void remove_instruction( program_t *p, int pc){
+	int i;
+
+	memmove( &p->code[pc], &p->code[pc+1], sizeof( instruction_t)*( p->code_len-pc-1));
+	p->code_len--;
+	for( i=0; i<p->code_len; i++){
+		if(( p->code[i].opcode==I_JUMP || p->code[i].opcode==I_JUMPIFNOT || p->code[i].opcode==I_SHORTCUT) &&
+				p->code[i].operand>pc){
+			p->code[i].operand--;
+		}
+	}
+}
+
+
+//Conditional expression whose branch is being compiled, see compile_tokens()
+typedef struct {
+	token_t *t;          // T_IFSTATEMENT of the true branch
+	int branch;          // 1 or 2 while the true or the false branch is compiled
+	int condition;       // value of constant condition or -1 if it is not constant
+	int jump_false;      // I_JUMPIFNOT and I_JUMP that are resolved when the branches are compiled
+	int jump_end;
+	int code_len;        // length of the program before the branch, see truncate_program()
+	int constants_len;
+	int params_len;
+	int base;            // state of the enclosing expression
+	int depth;
+	int shortcut;
+} conditional_t;
+
+//Stack of nested conditional expressions
+typedef struct {
+	conditional_t *frames;
+	int len;
+	int maxlen;
+} nesting_t;
+
+
+/*
+ * Records the largest number of values the stack holds while the program runs,
+ * exp_rpn() uses it to allocate the stack only once.
+ */
+#define update_max_depth( p, base, depth) {\
+	if( (base)+(depth)>(p)->max_depth){\
+		(p)->max_depth=(base)+(depth);\
+	}\
+}
+
+/*
+ * Emits instructions for the list of tokens in RPN form.
+ *
+ * The routine follows the stack effect of every token, so that exp_rpn() does
+ * not have to check that operators and functions have enough operands.
+ * `depth' is the number of values on the stack, it is updated as the tokens
+ * are compiled. `base' is the number of values left on the stack by the
+ * enclosing expression (when a branch of conditional expression is compiled).
+ *
+ * Branches of conditional expressions are compiled in the same loop, the
+ * state of the enclosing expression is kept in `nesting', so that deeply
+ * nested conditional expressions do not use the stack of the process.
+ */
+static int compile_tokens( program_t *p, token_t *t, nesting_t *nesting, int *depth, exp_error_t *ercode, char *error, int *error_pos){
+	int c, b, argc, jump_end;
+	int base=0;
+	int shortcut=-1;
+	conditional_t *n;
+	value_t v;
+
+	for(;;){
+		if( NULL==t){
+			//The expression or the branch of conditional expression must
+			//leave exactly one value on the stack
+			if( *depth==0){
+				COMPILE_ERROR( EXP_ER_INVALEXPR, "Expression is possibly malformed, it has too many operators", 0);
+				return -1;
+
+			}else if( *depth>1){
+				COMPILE_ERROR( EXP_ER_INVALEXPR, "Expression is possibly malformed, it has too many operands", 0);
+				return -1;
+			}
+			if( 0==nesting->len){
+				return 0;
+			}
+
+			n=&nesting->frames[nesting->len-1];
+			t=n->t;
+			if( n->branch==1){
+				//The true branch is compiled, the false one follows
+				if( n->condition==-1){
+					if( -1==( n->jump_end=emit( p, I_JUMP, 0, 0, t->next->next->position))){
+						COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+						return -1;
+					}
+					p->code[n->jump_false].operand=p->code_len;
+				}else if( !n->condition){
+					truncate_program( p, n->code_len, n->constants_len, n->params_len);
+				}
+				n->code_len=p->code_len;
+				n->constants_len=p->constants_len;
+				n->params_len=p->params_len;
+				n->branch=2;
+				*depth=0;
+				shortcut=-1;
+				t=t->next->children;
+				continue;
+			}
+
+			//The both branches are compiled
+			if( n->condition==-1){
+				p->code[n->jump_end].operand=p->code_len;
+				if( -1==emit( p, I_ENDIF, 0, 2, t->next->next->position)){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+			}else{
+				if( n->condition){
+					truncate_program( p, n->code_len, n->constants_len, n->params_len);
+				}
+				//The branch that is kept is either a single I_PUSH, then the
+				//constant is normalized right now, or it is terminated
+				//with I_ENDIF (unless it already ends with one)
+				if( p->code[p->code_len-1].opcode==I_PUSH){
+					value_t *r=&p->constants[p->code[p->code_len-1].operand];
+					int64_t i;
+					if( r->type==T_REAL && 0==exp_is_integer( r, &i)){
+						r->type=T_INTEGER;
+						r->value.integer=i;
+					}
+				}else if( p->code[p->code_len-1].opcode !=I_ENDIF &&
+						-1==emit( p, I_ENDIF, 0, 1, t->next->next->position)){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+			}
+			//condition is replaced with the result of the branch
+			base=n->base;
+			*depth=n->depth;
+			shortcut=n->shortcut;
+			nesting->len--;
+			t=t->next->next->next;
+			continue;
+		}
+
+		switch( t->param.type){
+			case T_INTEGER:
+				if( t->next && t->next->param.type==T_FUNCTION){
+					//This is the number of arguments of the function that follows
+					argc=t->param.value.integer;
+					if( *depth<argc){
+						COMPILE_ERROR( EXP_ER_INVALEXPR, "Algorithm error: stack length is less than arguments count", t->next->position);
+						return -1;
+					}
+					if( -1 !=( c=exp_function_lookup( t->next->param.value.function))){
+						//Built-in and registered functions are resolved now, other
+						//functions are passed by name to the function handler
+						//when the expression is solved
+						if( EXP_ER_INVALARGCLOW==( b=exp_function_check_argc( c, argc))){
+							COMPILE_ERROR( b, "Too few arguments passed to function", t->next->position);
+							return -1;
+						}else if( EXP_ER_INVALARGCHIGH==b){
+							COMPILE_ERROR( b, "Too many arguments passed to function", t->next->position);
+							return -1;
+						}
+						if( -1==( b=fold( p, I_FUNCTION, c, argc)) ||
+								( b==0 && -1==emit( p, I_FUNCTION, c, argc, t->next->position))){
+							COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+							return -1;
+						}
+					}else if( -1==( c=add_constant( p, &t->next->param)) || -1==emit( p, I_CALL, c, argc, t->next->position)){
+						COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+						return -1;
+					}
+					(*depth)+=1-argc;
+					update_max_depth( p, base, *depth);
+					t=t->next;
+					break;
+				}
+				//no break
+			case T_BOOLEAN:
+			case T_REAL:
+			case T_STRING:
+				if( -1==( c=add_constant( p, &t->param)) || -1==emit( p, I_PUSH, c, 0, t->position)){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+				(*depth)++;
+				update_max_depth( p, base, *depth);
+				break;
+
+			case T_PARAMETER:
+				if( 0==exp_substitute_parameter( t->param.value.parameter, &v)){
+					//Built-in constants are known at compile time
+					if( -1==( c=add_constant( p, &v)) || -1==emit( p, I_PUSH, c, 0, t->position)){
+						COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+						return -1;
+					}
+				}else if( -1==( c=add_parameter( p, t->param.value.parameter)) || -1==emit( p, I_PARAM, c, 0, t->position)){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+				(*depth)++;
+				update_max_depth( p, base, *depth);
+				break;
+
+			case T_OPERATOR:
+				c=exp_op_argument_count( t->param.value.operator);
+				if( *depth<c){
+					COMPILE_ERROR( EXP_ER_INVALEXPR, "Operator does not have sufficient number of operands", t->position);
+					return -1;
+				}
+				jump_end=-1;
+				if(( t->param.value.operator==O_BOOLAND || t->param.value.operator==O_BOOLOR) && shortcut !=-1){
+					//the right operand of && or || is complete, the shortcut
+					//of the left operand jumps over it
+					jump_end=shortcut;
+					shortcut=p->code[jump_end].operand;
+					if( p->code[jump_end-1].opcode==I_PUSH &&
+							0==exp_to_boolean( &p->constants[p->code[jump_end-1].operand], &b)){
+						if( b==( t->param.value.operator==O_BOOLOR)){
+							//The left operand is constant and decides the result,
+							//the right operand is removed
+							truncate_program( p, jump_end-1, p->code[jump_end-1].operand, p->code[jump_end].argc);
+							v.type=T_BOOLEAN;
+							v.borrowed=0;
+							v.value.boolean=b;
+							if( -1==( c=add_constant( p, &v)) || -1==emit( p, I_PUSH, c, 0, t->position)){
+								COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+								return -1;
+							}
+							(*depth)--;
+							break;
+						}
+						//The left operand is constant and never decides the
+						//result, so the operator may be folded
+						remove_instruction( p, jump_end);
+						jump_end=-1;
+					}
+				}
+				if( -1==( b=fold( p, I_OPERATOR, t->param.value.operator, c)) ||
+						( b==0 && -1==emit( p, I_OPERATOR, t->param.value.operator, c, t->position))){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+				if( jump_end !=-1){
+					//emit() may move the code, so the shortcut is updated after it
+					if( -1==( b=emit( p, I_ENDIF, 0, 2, t->position))){
+						COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+						return -1;
+					}
+					p->code[jump_end].argc=t->param.value.operator;
+					p->code[jump_end].operand=b;
+				}
+				(*depth)-=c-1;
+				break;
+
+			case T_SHORTCUT:
+				//Left operand of && or || is on the stack. The shortcut is
+				//resolved when the operator is compiled, until then operand
+				//of I_SHORTCUT links the shortcuts that are not resolved yet
+				//(they are nested) and `argc' is the number of parameters of
+				//the program before the right operand.
+				if( *depth<1){
+					COMPILE_ERROR( EXP_ER_INVALEXPR, "Operator does not have sufficient number of operands", t->position);
+					return -1;
+				}
+				if( -1==( c=emit( p, I_SHORTCUT, shortcut, p->params_len, t->position))){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+				shortcut=c;
+				break;
+
+			case T_FUNCTION:
+				COMPILE_ERROR( EXP_ER_INVALEXPR, "Algorithm error: no argument count found for function", t->position);
+				return -1;
+
+			case T_IFSTATEMENT:
+				//Conditional expression is a sequence of two statements (true
+				//and false branches) followed by the condition token. The
+				//condition value is already on the stack. The branches become
+				//instructions guarded by jumps:
+				//    JUMPIFNOT else; <true branch>; JUMP end; else: <false branch>; end: ENDIF
+				if( *depth<1 || NULL==t->next || t->next->param.type !=T_IFSTATEMENT ||
+						NULL==t->next->next || t->next->next->param.type !=T_IFCONDITION){
+					COMPILE_ERROR( EXP_ER_INVALEXPR, "Conditional expression does not have sufficient number of operands", t->position);
+					return -1;
+				}
+				if( nesting->len>=nesting->maxlen){
+					if( NULL==( n=exp_mem_realloc( nesting->frames, sizeof( conditional_t)*( nesting->maxlen ? nesting->maxlen*2 : 16)))){
+						COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+						return -1;
+					}
+					nesting->frames=n;
+					nesting->maxlen=nesting->maxlen ? nesting->maxlen*2 : 16;
+				}
+				n=&nesting->frames[nesting->len++];
+				n->t=t;
+				n->branch=1;
+				n->condition=-1;
+				n->base=base;
+				n->depth=*depth;
+				n->shortcut=shortcut;
+				if( p->code_len>0 && p->code[p->code_len-1].opcode==I_PUSH &&
+						0==exp_to_boolean( &p->constants[p->code[p->code_len-1].operand], &b)){
+					//The condition is constant, so only one branch is kept.
+					//Both branches are compiled to report errors in any of them.
+					truncate_program( p, p->code_len-1, p->code[p->code_len-1].operand, p->params_len);
+					n->condition=b;
+				}else if( -1==( n->jump_false=emit( p, I_JUMPIFNOT, 0, 0,
+						//errors are reported at the condition operand, results of
+						//operators and functions have no position
+						p->code_len>0 && ( p->code[p->code_len-1].opcode==I_PUSH || p->code[p->code_len-1].opcode==I_PARAM) ?
+						p->code[p->code_len-1].position : 0))){
+					COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+					return -1;
+				}
+				n->code_len=p->code_len;
+				n->constants_len=p->constants_len;
+				n->params_len=p->params_len;
+				//the branches are compiled without the condition on the stack
+				base+=*depth-1;
+				*depth=0;
+				shortcut=-1;
+				t=t->children;
+				continue;
+
+			default:
+				COMPILE_ERROR( EXP_ER_INVALEXPR, "Invalid or unsupported token", t->position);
+				return -1;
+		}
+		t=t->next;
+	}
+}
+
+
+/*
+ * Emits instructions for the complete expression, that must leave exactly one
+ * value on the stack.
+ */
+static int compile_expression( program_t *p, token_t *t, exp_error_t *ercode, char *error, int *error_pos){
+	nesting_t nesting={ NULL, 0, 0};
+	int depth=0;
+	int status;
+
+	status=compile_tokens( p, t, &nesting, &depth, ercode, error, error_pos);
+	exp_mem_free( nesting.frames);
+	return status;
+}
+
+
+#define TYPE_NUMERIC (TYPE_INTEGER | TYPE_REAL | TYPE_BOOLEAN)
+
+
+static int value_type( value_t *v){
+	switch( v->type){
+		case T_INTEGER: return TYPE_INTEGER;
+		case T_REAL:    return TYPE_REAL;
+		case T_BOOLEAN: return TYPE_BOOLEAN;
+		case T_STRING:  return TYPE_STRING;
+		default:        return TYPE_ANY;
+	}
+}
+
+
+/*
+ * Infers types of the result of operator from types of its operands and
+ * selects specialized kernel for the operator. `kernel' is set to -1 if the
+ * operands can never have types that kernels expect.
+ *
+ * @return Types that the result of operator can have
+ */
+static int operator_type( operator_t op, int t1, int t2, int *kernel){
+	*kernel=-1;
+	switch( op){
+		case O_PLUS:
+			if(( t1 & TYPE_NUMERIC) && ( t2 & TYPE_NUMERIC)){
+				*kernel=K_ADD;
+			}
+			//strings are concatenated
+			return TYPE_INTEGER | TYPE_REAL | (( t1 | t2) & TYPE_STRING);
+
+		case O_MINUS:
+		case O_MUL:
+		case O_DIV:
+			if(( t1 & TYPE_NUMERIC) && ( t2 & TYPE_NUMERIC)){
+				*kernel=op==O_MINUS ? K_SUB : op==O_MUL ? K_MUL : K_DIV;
+			}
+			return TYPE_INTEGER | TYPE_REAL;
+
+		case O_UMINUS:
+			if( t1 & ( TYPE_INTEGER | TYPE_REAL)){
+				*kernel=K_NEG;
+			}
+			return TYPE_INTEGER | TYPE_REAL;
+
+		case O_UPLUS:
+		case O_HAT:
+			return TYPE_INTEGER | TYPE_REAL;
+
+		case O_BITAND:
+		case O_BITOR:
+			if(( t1 & ( TYPE_INTEGER | TYPE_BOOLEAN)) && ( t2 & ( TYPE_INTEGER | TYPE_BOOLEAN))){
+				*kernel=op==O_BITAND ? K_BITAND : K_BITOR;
+			}
+			return TYPE_INTEGER;
+
+		case O_BITNOT:
+		case O_MOD:
+		case O_SHIFTLEFT:
+		case O_SHIFTRIGHT:
+			return TYPE_INTEGER;
+
+		case O_LT:
+		case O_GT:
+		case O_LE:
+		case O_GE:
+		case O_EQUALS:
+		case O_BOOLEQUALS:
+		case O_NOTEQUALS:
+			if(( t1 & TYPE_NUMERIC) && ( t2 & TYPE_NUMERIC)){
+				switch( op){
+					case O_LT: *kernel=K_LT; break;
+					case O_GT: *kernel=K_GT; break;
+					case O_LE: *kernel=K_LE; break;
+					case O_GE: *kernel=K_GE; break;
+					case O_NOTEQUALS: *kernel=K_NE; break;
+					default:   *kernel=K_EQ; break;
+				}
+			}
+			return TYPE_BOOLEAN;
+
+		case O_BOOLAND:
+		case O_BOOLOR:
+			if(( t1 & ( TYPE_INTEGER | TYPE_BOOLEAN)) && ( t2 & ( TYPE_INTEGER | TYPE_BOOLEAN))){
+				*kernel=op==O_BOOLAND ? K_AND : K_OR;
+			}
+			return TYPE_BOOLEAN;
+
+		case O_BOOLNOT:
+			if( t1 & ( TYPE_INTEGER | TYPE_BOOLEAN)){
+				*kernel=K_NOT;
+			}
+			return TYPE_BOOLEAN;
+
+		default:
+			return TYPE_ANY;
+	}
+}
+
+
+/*
+ * Type inference pass. The program is executed symbolically: instead of
+ * values, sets of types that values can have are put on the stack. Every
+ * instruction is annotated with the types of value that it produces, and
+ * operators are replaced with type specialized kernels where operands can
+ * have expected types. Kernels still check the types when the expression is
+ * solved, because types of parameters and functions are not known until then.
+ *
+ * Branches of conditional expression start with the same stack, so the type
+ * of the result of the first branch is saved at I_JUMP and merged with the
+ * type of the other branch at I_ENDIF.
+ *
+ * @return 0 on success or -1 if memory error occured
+ */
+static int infer_types( program_t *p){
+	instruction_t *i;
+	int *types, *saved;
+	int len=0, saved_len=0;
+	int pc, kernel;
+
+	if( NULL==( types=exp_mem_malloc( sizeof( int)*( p->max_depth+1)))){
+		return -1;
+	}
+	if( NULL==( saved=exp_mem_malloc( sizeof( int)*( p->code_len+1)))){
+		exp_mem_free( types);
+		return -1;
+	}
+	for( pc=0; pc<p->code_len; pc++){
+		i=&p->code[pc];
+		switch( i->opcode){
+			case I_PUSH:
+				types[len++]=value_type( &p->constants[i->operand]);
+				break;
+			case I_PARAM:
+				types[len++]=TYPE_ANY;
+				break;
+			case I_FUNCTION:
+			case I_CALL:
+				len-=i->argc;
+				types[len++]=TYPE_ANY;
+				break;
+			case I_OPERATOR:
+				if( i->argc==1){
+					types[len-1]=operator_type( i->operand, types[len-1], 0, &kernel);
+				}else{
+					len--;
+					types[len-1]=operator_type( i->operand, types[len-1], types[len], &kernel);
+				}
+				if( kernel !=-1){
+					i->opcode=I_KERNEL;
+					i->argc=kernel;
+				}
+				break;
+			case I_JUMPIFNOT:
+				len--;
+				break;
+			case I_JUMP:
+				saved[saved_len++]=types[--len];
+				break;
+			case I_SHORTCUT:
+				//the result is boolean when the right operand is skipped
+				saved[saved_len++]=TYPE_BOOLEAN;
+				break;
+			case I_ENDIF:
+				if( i->argc==2){
+					types[len-1]|=saved[--saved_len];
+				}
+				//integral real result is converted to integer
+				if( types[len-1] & TYPE_REAL){
+					types[len-1]|=TYPE_INTEGER;
+				}
+				break;
+			default:
+				break;
+		}
+		if( i->opcode !=I_JUMPIFNOT && i->opcode !=I_JUMP && i->opcode !=I_SHORTCUT){
+			i->type=types[len-1];
+		}
+	}
+	exp_mem_free( saved);
+	exp_mem_free( types);
+	return 0;
+}
+
+
+/*
+ * Replaces chains of + operators that build strings, like a+"-"+b+"-"+c,
+ * with I_CONCAT instruction that builds the string at once, see
+ * exp_eval_concat(). The left operand of + is a chain too when the last
+ * instruction of its code is + or I_CONCAT, that is the instruction just
+ * before the code of the right operand. So the first instruction of the code
+ * of every value on the stack is tracked (like types are tracked by
+ * infer_types()), conditional expression starts with its condition and
+ * shortcut of && and || starts with its left operand.
+ *
+ * Only chains with an operand that is always a string are fused, numeric
+ * additions keep their kernels.
+ *
+ * Operands of I_CONCAT stay on the stack until the whole chain is evaluated,
+ * so the depth of the stack is computed again.
+ *
+ * @return 0 on success or -1 if memory error occured
+ */
+static int fuse_concat( program_t *p){
+	instruction_t *i, *prev;
+	int *first, *text, *saved;
+	int len=0, saved_len=0, fused=0;
+	int pc, c;
+
+	first=exp_mem_malloc( sizeof( int)*( p->max_depth+1));
+	text=exp_mem_malloc( sizeof( int)*( p->max_depth+1));
+	saved=exp_mem_malloc( sizeof( int)*( p->code_len+1));
+	if( NULL==first || NULL==text || NULL==saved){
+		exp_mem_free( first);
+		exp_mem_free( text);
+		exp_mem_free( saved);
+		return -1;
+	}
+	for( pc=0; pc<p->code_len; pc++){
+		i=&p->code[pc];
+		switch( i->opcode){
+			case I_PUSH:
+			case I_PARAM:
+				first[len++]=pc;
+				break;
+			case I_FUNCTION:
+			case I_CALL:
+				if( i->argc==0){
+					first[len++]=pc;
+				}else{
+					len-=i->argc-1;
+				}
+				break;
+			case I_OPERATOR:
+			case I_KERNEL:
+				if( i->operand==O_PLUS){
+					//`text' of the chain is set if one of its operands is a string
+					text[len-2]=text[len-2] || text[len-1];
+					prev=&p->code[first[len-1]-1];
+					if( text[len-2] && (( prev->operand==O_PLUS && ( prev->opcode==I_OPERATOR || prev->opcode==I_KERNEL)) ||
+							( prev->opcode==I_CONCAT && prev->argc<EXP_CONCAT_MAX))){
+						c=prev->opcode==I_CONCAT ? prev->argc+1 : 3;
+						remove_instruction( p, first[len-1]-1);
+						i=&p->code[--pc];
+						i->opcode=I_CONCAT;
+						i->argc=c;
+						fused=1;
+					}
+					len--;
+					continue;
+				}
+				len-=exp_op_argument_count( i->operand)-1;
+				break;
+			case I_JUMPIFNOT:
+				saved[saved_len++]=first[--len];
+				continue;
+			case I_JUMP:
+				len--;
+				continue;
+			case I_SHORTCUT:
+				saved[saved_len++]=first[len-1];
+				continue;
+			case I_ENDIF:
+				if( i->argc==2){
+					first[len-1]=saved[--saved_len];
+				}
+				break;
+			default:
+				break;
+		}
+		text[len-1]=i->type==TYPE_STRING;
+	}
+
+	if( fused){
+		len=0;
+		for( pc=0; pc<p->code_len; pc++){
+			i=&p->code[pc];
+			switch( i->opcode){
+				case I_PUSH:
+				case I_PARAM:     len++; break;
+				case I_FUNCTION:
+				case I_CALL:      len+=1-i->argc; break;
+				case I_OPERATOR:
+				case I_KERNEL:    len-=exp_op_argument_count( i->operand)-1; break;
+				case I_CONCAT:    len-=i->argc-1; break;
+				case I_JUMPIFNOT:
+				case I_JUMP:      len--; break;
+				default:          break;
+			}
+			update_max_depth( p, 0, len);
+		}
+	}
+	exp_mem_free( saved);
+	exp_mem_free( text);
+	exp_mem_free( first);
+	return 0;
+}
+
+
+/*
+ * Marks the shortcuts of && and || whose right operand is made only of
+ * constants, parameters and operators. Skipping such operand saves less than
+ * splitting the selection costs in exp_batch(), the operand and the operator
+ * are cheaper to evaluate for all rows with vector kernels. The right operand
+ * is the code between I_SHORTCUT and I_ENDIF that ends it.
+ */
+static void mark_dense( program_t *p){
+	int i, pc;
+
+	for( i=0; i<p->code_len; i++){
+		if( p->code[i].opcode==I_SHORTCUT){
+			for( pc=i+1; pc<p->code[i].operand; pc++){
+				if( p->code[pc].opcode !=I_PUSH && p->code[pc].opcode !=I_PARAM &&
+						p->code[pc].opcode !=I_KERNEL && p->code[pc].opcode !=I_OPERATOR){
+					break;
+				}
+			}
+			if( pc==p->code[i].operand){
+				p->code[i].flags|=INSTRUCTION_DENSE;
+			}
+		}
+	}
+}
+
+
+/*
+ * Stores in the operand of every I_ENDIF the instruction where the execution
+ * continues after it. A nested conditional expression that ends a branch is
+ * followed by I_JUMP and I_ENDIF of the outer one, they only normalize the
+ * same result again. exp_rpn() skips them, so the result of the branch that is
+ * nested N levels deep is not passed through N instructions. exp_batch()
+ * executes every I_ENDIF, it ignores the operand.
+ */
+static void link_endif( program_t *p){
+	int i, pc;
+
+	//jumps go forward, so the instructions are linked from the end
+	for( i=p->code_len-1; i>=0; i--){
+		if( p->code[i].opcode==I_ENDIF){
+			pc=i+1;
+			while( pc<p->code_len && p->code[pc].opcode==I_JUMP){
+				pc=p->code[pc].operand;
+			}
+			if( pc<p->code_len && p->code[pc].opcode==I_ENDIF){
+				pc=p->code[pc].operand;
+			}
+			p->code[i].operand=pc;
+		}
+	}
+}
+
+
+/*
+ * Translates RPN list of tokens returned by exp_shunting_yard() into a program
+ * that can be executed by exp_rpn().
+ *
+ * @return Compiled program or NULL if error occured. In the later case
+ *         error string is set.
+ */
+program_t *exp_program_compile( token_t *input, exp_error_t *ercode, char *error, int *error_pos){
+	program_t *p;
+
+	if( NULL==( p=exp_mem_calloc( 1, sizeof( program_t)))){
+		COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+		return NULL;
+	}
+	p->refs=1;
+	if( 0 !=compile_expression( p, input, ercode, error, error_pos)){
+		return exp_program_free( p);
+	}
+	if( 0 !=infer_types( p) || 0 !=fuse_concat( p)){
+		COMPILE_ERROR( EXP_ER_NOMEM, "Memory error", 0);
+		return exp_program_free( p);
+	}
+	mark_dense( p);
+	link_endif( p);
+	return p;
+}
+
+
+/*
+ * Programs are immutable after they are compiled, so they are shared by the
+ * expressions created from the same text (see exp_cache_create()). The
+ * reference counter is updated atomically, because the expressions may be
+ * freed in different threads.
+ */
+program_t *exp_program_ref( program_t *p){
+	__atomic_add_fetch( &p->refs, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+
+/*
+ * Releases the reference to the program, the program is freed when it is no
+ * longer used.
+ */
+program_t *exp_program_free( program_t *p){
+	int i;
+
+	if( p && 0==__atomic_sub_fetch( &p->refs, 1, __ATOMIC_ACQ_REL)){
+		for( i=0; i<p->constants_len; i++){
+			free_constant( &p->constants[i]);
+		}
+		for( i=0; i<p->params_len; i++){
+			exp_symbol_release( p->params[i]);
+		}
+		exp_mem_free( p->constants);
+		exp_mem_free( p->params);
+		exp_mem_free( p->code);
+		exp_mem_free( p);
+	}
+	return NULL;
+}
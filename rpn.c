@@ -56,316 +56,303 @@
 })
 
 
-static int exp_eval_if( expression_t *exp, token_t **stack, int *stack_len, exp_error_t *ercode, char *error, int *error_pos){
-	token_t *s=*stack;
-	token_t *temp, *opqueue, *result;
-	int c=3;
-	int b1;
-	int ret;
-	int64_t r;
-
-	(*stack_len)-=c;
-	opqueue=NULL;
-	while( c){
-		temp=s;
-		s=s->next;
-
-		temp->next=opqueue;
-		opqueue=temp;
-
-		c--;
-	}
+#define RPN_ERROR( _ercode, _epos) {\
+	*ercode=(_ercode);\
+	*error_pos=(_epos);\
+	while( stack_len){\
+		exp_value_clear( &stack[--stack_len]);\
+	}\
+	if( stack !=local_stack && ( NULL==ctx || stack !=ctx->stack)){\
+		exp_mem_free( stack);\
+	}\
+}
 
-	if(NULL==(result=calloc( 1, sizeof(token_t)))){
-		exp_token_free(opqueue);
-		*stack=s;
-		*ercode=EXP_ER_NOMEM;
-		strcpy(error, "Memory error");
-		*error_pos=0;
-		return 1;
-	}
 
-	if( 0 !=(ret=exp_to_boolean( &opqueue->param, &b1))){
-		exp_token_free(opqueue);
-		exp_token_free(result);
-		*stack=s;
-		*error_pos=opqueue->position;
-		*ercode=ret;
-		switch( ret){
-			case EXP_ER_NONBOOLEAN:  sprintf(error, "Conditional statement requires boolean operand"); break;
-			case EXP_ER_INVALARGV:   strcpy(error, "Invalid operand provided to evaluate conditional statement"); break;
-			default: strcpy(error, "Error occured"); break;
+/*
+ * Resolves value of the parameter with the user supplied parameter handler.
+ * Built-in constants are substituted at compile time.
+ */
+int exp_resolve_parameter( expression_t *exp, char *name, value_t *ret, exp_error_t *ercode, char *error){
+	exp_value_t exv;
+
+	ret->borrowed=0;
+	ret->number=NUMBER_UNKNOWN;
+	if( exp->phandler && 0==exp->phandler( exp->user_data, name, &exv)){
+		//the parameter was successfully substituted with its value
+		ret->type=T_NONE;
+		IMPORT_TO_VALUE_T( &exv, ret);
+		if( ret->type==T_NONE){
+			*ercode=EXP_ER_INVALRET;
+			strcpy( error, "Unknown type was returned by user defined parameter handler");
+			return 1;
 		}
-		return 1;
+		return 0;
 
 	}else{
-		if( b1){
-			if( 0 !=exp_rpn( exp, opqueue->next->children, &result->param, ercode, error, error_pos)){
-				exp_token_free(opqueue);
-				exp_token_free(result);
-				*stack=s;
-				return 1;
-			}
-		}else{
-			if( 0 !=exp_rpn( exp, opqueue->next->next->children, &result->param, ercode, error, error_pos)){
-				exp_token_free(opqueue);
-				exp_token_free(result);
-				*stack=s;
-				return 1;
-			}
-		}
+		//could not subst the parameter
+		*ercode=EXP_ER_INVALPARAM;
+		snprintf( error, EXP_ERLEN, "Unknown parameter '%s'", name);
+		return 1;
+	}
+}
 
 
-		if( result->param.type==T_REAL && 0==exp_is_integer( &result->param, &r)){
-			result->param.type=T_INTEGER;
-			result->param.value.integer=r;
-		}
-		result->position=opqueue->position;
-		exp_token_free(opqueue);
-		result->next=s;
-		*stack=result;
-		(*stack_len)+=1;
-		return 0;
+/*
+ * Stores the value of the parameter that is bound by the caller. Strings are
+ * not copied, they are owned by the caller.
+ */
+int exp_bind_parameter( const exp_value_t *param, char *name, value_t *ret, exp_error_t *ercode, char *error){
+	ret->borrowed=0;
+	ret->number=NUMBER_UNKNOWN;
+	switch( param->type){
+		case EXP_INTEGER: ret->type=T_INTEGER; ret->value.integer=param->value.integer; break;
+		case EXP_REAL:    ret->type=T_REAL;    ret->value.real=param->value.real; break;
+		case EXP_BOOLEAN: ret->type=T_BOOLEAN; ret->value.boolean=param->value.boolean; break;
+		case EXP_STRING:
+			ret->type=T_STRING;
+			ret->value.string=param->value.string ? param->value.string : "NULL";
+			ret->borrowed=1;
+			break;
+		default:
+			*ercode=EXP_ER_INVALPARAM;
+			snprintf( error, EXP_ERLEN, "Invalid type of parameter '%s'", name);
+			return 1;
 	}
+	return 0;
 }
 
-int exp_rpn( expression_t *exp, token_t *input, value_t *ret, exp_error_t *ercode, char *error, int *error_pos){
-	token_t *in, *curr, *stack;
-	int stack_len;
-	int status;
 
-	in=exp_token_dup( input);
-	stack=NULL;
-	stack_len=0;
+/*
+ * Sets error message for the status returned by operator
+ */
+void exp_operator_error( int status, operator_t operator, char *error){
+	switch( status){
+		case EXP_ER_INVALARGC:     sprintf(error, "%s operator does not have sufficient number of operands", operator_to_string(operator)); break;
+		case EXP_ER_INVALARGV:     strcpy(error, "Invalid operand provided to evaluate expression with operator"); break;
+		case EXP_ER_INVALOPERATOR: strcpy(error, "Invalid operator"); break;
+		case EXP_ER_NOMEM:         strcpy(error, "Memory error occured while expression was evaluated"); break;
+		case EXP_ER_COMPLEX:       strcpy(error, "Complex result when evaluating expression"); break;
+		case EXP_ER_DIVBYZERO:     strcpy(error, "Division by zero"); break;
+		case EXP_ER_NONINTEGER:    sprintf(error, "%s operator requires integer operands", operator_to_string(operator)); break;
+		case EXP_ER_NONNUMERIC:    sprintf(error, "%s operator requires numeric or boolean operands", operator_to_string(operator)); break;
+		case EXP_ER_NONBOOLEAN:    sprintf(error, "%s operator requires boolean operands", operator_to_string(operator)); break;
+		case EXP_ER_NONSTRING:     sprintf(error, "%s operator requires string operands", operator_to_string(operator)); break;
+		case EXP_ER_INTOVERFLOW:   strcpy(error, "Overflow occurs when converting operator to integer"); break;
+		default: strcpy(error, "Error occured"); break;
+	}
+}
 
-	//While there are input tokens left
-	while(in){
-		//Read the next token from input.
-		curr=in;
-		in=in->next;
-		curr->next=NULL;
 
-		switch( curr->param.type){
-			//case T_PARAMETER:
-			//All parameters were substituded on the previous step
+/*
+ * Sets error message for the status returned by function
+ */
+void exp_function_error( int status, char *error){
+	switch( status){
+		case EXP_ER_INVALARGV:     strcpy(error, "Invalid function argument" ); break;
+		case EXP_ER_INVALARGCHIGH: strcpy(error, "Too many arguments passed to function" ); break;
+		case EXP_ER_INVALARGCLOW:  strcpy(error, "Too few arguments passed to function" ); break;
+		case EXP_ER_INVALFUNC:     strcpy(error, "Unknown function" ); break;
+		case EXP_ER_TRIGONOMETRIC: strcpy(error, "Function argument is not in range" ); break;
+		case EXP_ER_COMPLEX:       strcpy(error, "Complex result when evaluating function"); break;
+		case EXP_ER_INTOVERFLOW:   strcpy(error, "Overflow occurs when converting argument to integer"); break;
+		case EXP_ER_NONINTEGER:    strcpy(error, "Function requires integer operands"); break;
+		case EXP_ER_NONNUMERIC:    strcpy(error, "Function requires numeric or boolean operands"); break;
+		case EXP_ER_NONBOOLEAN:    strcpy(error, "Function requires boolean operands"); break;
+		case EXP_ER_NONSTRING:     strcpy(error, "Function requires string operands"); break;
+		case EXP_ER_NOMEM:         strcpy(error, "Memory error occured while expression was evaluated"); break;
+		case EXP_ER_INVALRET:      strcpy(error, "Unknown type was returned by user defined function handler"); break;
+		case EXP_ER_USERFUNCERROR: strcpy(error, "Error in user defined function handler"); break;
+		case EXP_ER_DIVBYZERO:     strcpy(error, "Division by zero"); break;
+		default: sprintf(error, "Error occured (%d)", status); break;
+	}
+}
 
-			case T_BOOLEAN:
-			case T_INTEGER:
-			case T_REAL:
-			case T_STRING:
-			case T_IFSTATEMENT:
-				//If the token is a value
-				//	Push it onto the stack
 
-				curr->next=stack;
-				stack=curr;
-				stack_len++;
-				break;
+/*
+ * Sets error message for the status returned when condition is evaluated
+ */
+void exp_condition_error( int status, char *error){
+	switch( status){
+		case EXP_ER_NONBOOLEAN:  sprintf(error, "Conditional statement requires boolean operand"); break;
+		case EXP_ER_INVALARGV:   strcpy(error, "Invalid operand provided to evaluate conditional statement"); break;
+		default: strcpy(error, "Error occured"); break;
+	}
+}
 
-			case T_OPERATOR:
-				//Otherwise, the token is an operator (operator here includes both operators, and functions).
-				//	It is known a priori that the operator takes n arguments.
-				//	If there are fewer than n values on the stack
-				//		The user has not input sufficient values in the expression
-				//	Else, Pop the top n values from the stack.
-				//		Evaluate the operator, with the values as arguments.
-				//		Push the returned results, if any, back onto the stack
 
-				if(stack_len>=exp_op_argument_count( curr->param.value.operator)){
-					status=exp_eval_operator( &stack, curr->param.value.operator, &stack_len);
-					if( 0 !=status){
-						*ercode=status;
-						switch( status){
-							case EXP_ER_INVALARGC:     sprintf(error, "%s operator does not have sufficient number of operands", operator_to_string(curr->param.value.operator)); break;
-							case EXP_ER_INVALARGV:     strcpy(error, "Invalid operand provided to evaluate expression with operator"); break;
-							case EXP_ER_INVALOPERATOR: strcpy(error, "Invalid operator"); break;
-							case EXP_ER_NOMEM:         strcpy(error, "Memory error occured while expression was evaluated"); break;
-							case EXP_ER_COMPLEX:       strcpy(error, "Complex result when evaluating expression"); break;
-							case EXP_ER_DIVBYZERO:     strcpy(error, "Division by zero"); break;
-							case EXP_ER_NONINTEGER:    sprintf(error, "%s operator requires integer operands", operator_to_string(curr->param.value.operator)); break;
-							case EXP_ER_NONNUMERIC:    sprintf(error, "%s operator requires numeric or boolean operands", operator_to_string(curr->param.value.operator)); break;
-							case EXP_ER_NONBOOLEAN:    sprintf(error, "%s operator requires boolean operands", operator_to_string(curr->param.value.operator)); break;
-							case EXP_ER_NONSTRING:     sprintf(error, "%s operator requires string operands", operator_to_string(curr->param.value.operator)); break;
-							case EXP_ER_INTOVERFLOW:   strcpy(error, "Overflow occurs when converting operator to integer"); break;
+/*
+ * Executes the compiled program.
+ *
+ * exp_program_compile() has already verified that every operator and function
+ * has enough operands on the stack and that the program leaves exactly one
+ * value, so the stack is used without further checks here. The compiler also
+ * knows the maximum depth of the stack, so the stack is allocated once: in the
+ * frame of this routine for usual expressions and on the heap for very
+ * long ones. Numeric expressions are evaluated without heap allocations.
+ * If the context `ctx' is not NULL, long programs use the stack of the
+ * context, which is allocated once and reused.
+ *
+ * Parameters are taken from `params' array indexed by parameter slot. If the
+ * array is NULL or the type of the value is EXP_NONE, the parameter is
+ * resolved with the parameter handler.
+ */
+int exp_rpn( exp_ctx_t *ctx, expression_t *exp, program_t *program, const exp_value_t *params, value_t *ret, exp_error_t *ercode, char *error, int *error_pos){
+	instruction_t *code=program->code;
+	instruction_t *curr;
+	value_t local_stack[EXP_STACK_LOCAL];
+	value_t *stack=local_stack, *temp;
+	int stack_len=0;
+	int pc=0;
+	int status;
+	int b1;
+	int64_t r;
 
+	if( program->max_depth>EXP_STACK_LOCAL){
+		if( ctx && ctx->stack_maxlen<program->max_depth){
+			if( NULL==( stack=exp_mem_realloc( ctx->stack, sizeof( value_t)*program->max_depth))){
+				*ercode=EXP_ER_NOMEM;
+				strcpy(error, "Memory error");
+				*error_pos=0;
+				return -1;
+			}
+			ctx->stack=stack;
+			ctx->stack_maxlen=program->max_depth;
+		}else if( ctx){
+			stack=ctx->stack;
+		}else if( NULL==( stack=exp_mem_malloc( sizeof( value_t)*program->max_depth))){
+			*ercode=EXP_ER_NOMEM;
+			strcpy(error, "Memory error");
+			*error_pos=0;
+			return -1;
+		}
+	}
 
-							default: strcpy(error, "Error occured"); break;
-						}
-						*error_pos=curr->position;
-						exp_token_free(curr);
-						exp_token_free(stack);
-						exp_token_free(in);
-						return -1;
+	while( pc<program->code_len){
+		curr=&code[pc++];
 
-					}else{
-						//we should free operator token
-						exp_token_free( curr);
-					}
+		switch( curr->opcode){
+			case I_PUSH:
+				//string constants are owned by the program, they are not copied
+				stack[stack_len]=program->constants[curr->operand];
+				stack[stack_len].borrowed=1;
+				stack_len++;
+				break;
 
+			case I_PARAM:
+				if( params && params[curr->operand].type !=EXP_NONE){
+					status=exp_bind_parameter( &params[curr->operand], program->params[curr->operand]->name, &stack[stack_len], ercode, error);
 				}else{
-					*ercode=EXP_ER_INVALEXPR;
-					strcpy(error, "Operator does not have sufficient number of operands");
-					*error_pos=curr->position;
-					exp_token_free(curr);
-					exp_token_free(stack);
-					exp_token_free(in);
+					status=exp_resolve_parameter( exp, program->params[curr->operand]->name, &stack[stack_len], ercode, error);
+				}
+				if( 0 !=status){
+					RPN_ERROR( *ercode, curr->position);
 					return -1;
 				}
+				stack_len++;
 				break;
 
-			case T_IFCONDITION:
-				if(stack_len>=3 && stack->param.type==T_IFSTATEMENT && stack->next->param.type==T_IFSTATEMENT){
-					status=exp_eval_if( exp, &stack, &stack_len, ercode, error, error_pos);
-					if( 0 !=status){
-						exp_token_free(curr);
-						exp_token_free(stack);
-						exp_token_free(in);
-						return -1;
-
-					}else{
-						//we should free operator token
-						exp_token_free( curr);
-					}
-
+			case I_OPERATOR:
+			case I_KERNEL:
+			case I_CONCAT:
+				if( curr->opcode==I_KERNEL){
+					status=exp_eval_kernel( stack, curr->argc, &stack_len);
+				}else if( curr->opcode==I_CONCAT){
+					status=exp_eval_concat( stack, curr->argc, &stack_len);
 				}else{
-					*ercode=EXP_ER_INVALEXPR;
-					strcpy(error, "Conditional expression does not have sufficient number of operands");
-					*error_pos=curr->position;
-					exp_token_free(curr);
-					exp_token_free(stack);
-					exp_token_free(in);
+					status=exp_eval_operator( stack, curr->operand, &stack_len);
+				}
+				if( 0 !=status){
+					exp_operator_error( status, curr->operand, error);
+					RPN_ERROR( status, curr->position);
 					return -1;
 				}
 				break;
 
-			case T_FUNCTION:
-				if(stack_len>=1 && stack->param.type==T_INTEGER){
-					token_t *temp;
-					int argc, i;
-
-					//pop argc
-					argc=stack->param.value.integer;
-					temp=stack;
-					stack=stack->next;
-					stack_len--;
-					temp->next=NULL;
-					exp_token_free( temp);
-
-					//test for tokens in stack
-					if( argc>stack_len){
-						*ercode=EXP_ER_INVALEXPR;
-						sprintf(error, "Algorithm error: stack length is less than arguments count");
-						*error_pos=curr->position;
-						exp_token_free(curr);
-						exp_token_free(stack);
-						exp_token_free(in);
-						return -1;
-					}
+			case I_FUNCTION:
+			case I_CALL:
+				if( curr->opcode==I_FUNCTION){
+					status=exp_call_resolved( ctx, curr->operand, curr->argc, stack, &stack_len);
+				}else{
+					status=exp_call_function( exp, program->constants[curr->operand].value.function, curr->argc, stack, &stack_len);
+				}
+				if( 0 !=status){
+					exp_function_error( status, error);
+					RPN_ERROR( status, curr->position);
+					return -1;
+				}
+				break;
 
-					temp=stack;
-					i=argc;
-					while( temp && i){
-						if( !(temp->param.type==T_BOOLEAN ||temp->param.type==T_INTEGER ||
-								temp->param.type==T_REAL ||temp->param.type==T_STRING)){
-							*ercode=EXP_ER_INVALEXPR;
-							sprintf(error, "Algorithm error: unsupported function argument in stack");
-							*error_pos=curr->position;
-							exp_token_free(curr);
-							exp_token_free(stack);
-							exp_token_free(in);
-							return -1;
-						}
-						i--;
-						temp=temp->next;
+			case I_JUMPIFNOT:
+				if( stack[stack_len-1].type==T_BOOLEAN){
+					//comparisons leave boolean condition, there is nothing to release
+					if( !stack[--stack_len].value.boolean){
+						pc=curr->operand;
 					}
+					break;
+				}
+				if( 0 !=( status=exp_to_boolean( &stack[stack_len-1], &b1))){
+					exp_condition_error( status, error);
+					RPN_ERROR( status, curr->position);
+					return -1;
+				}
+				exp_value_clear( &stack[--stack_len]);
+				if( !b1){
+					pc=curr->operand;
+				}
+				break;
 
-					status=exp_call_function( exp, curr->param.value.function, argc, &stack, &stack_len);
-					if( 0 !=status){
-						*ercode=status;
-						switch( status){
-							case EXP_ER_INVALARGV:     strcpy(error, "Invalid function argument" ); break;
-							case EXP_ER_INVALARGCHIGH: strcpy(error, "Too many arguments passed to function" ); break;
-							case EXP_ER_INVALARGCLOW:  strcpy(error, "Too few arguments passed to function" ); break;
-							case EXP_ER_INVALFUNC:     strcpy(error, "Unknown function" ); break;
-							case EXP_ER_TRIGONOMETRIC: strcpy(error, "Function argument is not in range" ); break;
-							case EXP_ER_COMPLEX:       strcpy(error, "Complex result when evaluating function"); break;
-							case EXP_ER_INTOVERFLOW:   strcpy(error, "Overflow occurs when converting argument to integer"); break;
-							case EXP_ER_NONINTEGER:    strcpy(error, "Function requires integer operands"); break;
-							case EXP_ER_NONNUMERIC:    strcpy(error, "Function requires numeric or boolean operands"); break;
-							case EXP_ER_NONBOOLEAN:    strcpy(error, "Function requires boolean operands"); break;
-							case EXP_ER_NONSTRING:     strcpy(error, "Function requires string operands"); break;
-							case EXP_ER_NOMEM:         strcpy(error, "Memory error occured while expression was evaluated"); break;
-							case EXP_ER_INVALRET:      strcpy(error, "Unknown type was returned by user defined function handler"); break;
-							case EXP_ER_USERFUNCERROR: strcpy(error, "Error in user defined function handler"); break;
-							case EXP_ER_DIVBYZERO:     strcpy(error, "Division by zero"); break;
-							default: sprintf(error, "Error occured (%d)", status); break;
-						}
-						*error_pos=curr->position;
-						exp_token_free(curr);
-						exp_token_free(stack);
-						exp_token_free(in);
-						return -1;
-					}else{
-						exp_token_free( curr);
-					}
+			case I_JUMP:
+				pc=curr->operand;
+				break;
 
-				}else{
-					*ercode=EXP_ER_INVALEXPR;
-					sprintf(error, "Algorithm error: no argument count found for function");
-					*error_pos=curr->position;
-					exp_token_free(curr);
-					exp_token_free(stack);
-					exp_token_free(in);
+			case I_SHORTCUT:
+				if( 0 !=( status=exp_to_boolean( &stack[stack_len-1], &b1))){
+					exp_operator_error( status, curr->argc, error);
+					RPN_ERROR( status, curr->position);
 					return -1;
 				}
+				if( b1==( curr->argc==O_BOOLOR)){
+					//the right operand is skipped
+					temp=&stack[stack_len-1];
+					exp_value_clear( temp);
+					temp->type=T_BOOLEAN;
+					temp->value.boolean=b1;
+					pc=curr->operand;
+				}
+				break;
+
+			case I_ENDIF:
+				temp=&stack[stack_len-1];
+				if( temp->type==T_REAL && 0==exp_is_integer( temp, &r)){
+					temp->type=T_INTEGER;
+					temp->value.integer=r;
+				}
+				//the enclosing conditional expressions that end here are skipped
+				pc=curr->operand;
 				break;
 
 			default:
-				*ercode=EXP_ER_INVALEXPR;
-				strcpy(error, "Invalid or unsupported token");
-				*error_pos=curr->position;
-				exp_token_free(curr);
-				exp_token_free(stack);
-				exp_token_free(in);
+				strcpy(error, "Invalid or unsupported instruction");
+				RPN_ERROR( EXP_ER_INVALEXPR, curr->position);
 				return -1;
-				break;
 		}
 	}
-	if(stack_len==0){
-		*ercode=EXP_ER_INVALEXPR;
-		strcpy(error, "Expression is possibly malformed, it has too many operators");
-		*error_pos=0;
-		return -1;
 
-	}else if(stack_len>1){
-		*ercode=EXP_ER_INVALEXPR;
-		strcpy(error, "Expression is possibly malformed, it has too many operands");
-		*error_pos=0;
-		exp_token_free( stack);
-		return -1;
-
-	}else if( stack->param.type==T_BOOLEAN ||stack->param.type==T_INTEGER ||
-			stack->param.type==T_REAL ||stack->param.type==T_STRING){
-		if(stack->param.type==T_STRING){
-			ret->type=stack->param.type;
-			if( stack->param.value.string){
-				ret->value.string=strdup(stack->param.value.string);
-			}else{
-				ret->value.string=strdup("NULL");
+	//The program leaves exactly one value on the stack, it is the result
+	memcpy( ret, &stack[0], sizeof( value_t));
+	if( ret->type==T_STRING){
+		//the result is owned by the caller
+		if( ret->borrowed || NULL==ret->value.string){
+			if( NULL==( ret->value.string=exp_mem_strdup( ret->value.string ? ret->value.string : "NULL"))){
+				strcpy(error, "Memory error");
+				RPN_ERROR( EXP_ER_NOMEM, 0);
+				return -1;
 			}
-		}else{
-			memcpy( ret, &stack->param, sizeof( value_t));
+			ret->borrowed=0;
 		}
-		exp_token_free( stack);
-		return 0;
-
-	}else{
-		*ercode=EXP_ER_INVALEXPR;
-		strcpy(error, "Expression is possibly malformed");
-		*error_pos=0;
-		exp_token_free( stack);
-		return -1;
 	}
+	if( stack !=local_stack && ( NULL==ctx || stack !=ctx->stack)){
+		exp_mem_free( stack);
+	}
+	return 0;
 }
-
-
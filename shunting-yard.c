@@ -63,7 +63,7 @@ static int op_precedence( operator_t op){
 
 #define STACK_PUSH( stack, stacklen, maxlen, val) ({\
 	if(stacklen>=maxlen){\
-		if((stack=realloc( stack, sizeof( int*)*(maxlen+128)))){\
+		if((stack=exp_mem_realloc( stack, sizeof( int*)*(maxlen+128)))){\
 			maxlen+=128;\
 		}else{\
 			maxlen=0;\
@@ -79,16 +79,152 @@ static int op_precedence( operator_t op){
 #define ERROR_OCCURED( _estring, _epos) {\
 	strcpy(error, _estring);\
 	*error_pos=(_epos);\
-	exp_token_free( stack);\
-	exp_token_free( out_head);\
-	exp_token_free( in);\
-	exp_token_free( curr);\
-	if( argc_stack) free( argc_stack);\
-	if( found_stack) free( found_stack);\
+	if( argc_stack) exp_mem_free( argc_stack);\
+	if( found_stack) exp_mem_free( found_stack);\
+	unwind_frames( frames, frames_len, if_operand, ercode, error, error_pos);\
 }
 
-token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input, exp_error_t *ercode, char *error, int *error_pos){
-	token_t *in, *in1, *curr=NULL;
+
+//Conversion of the expression that is suspended while an operand of the
+//conditional operator is converted
+typedef struct {
+	token_t *stack;
+	token_t *out_head, *out_tail;
+	int *found_stack;
+	int found_maxlen;
+	int found_len;
+	int *argc_stack;
+	int argc_maxlen;
+	int argc_len;
+	int if_operand;   // 1 or 2 if the expression is true or false operand of the enclosing conditional operator
+	token_t *ifthen;  // the conditional operator
+	token_t *iftrue;  // converted true operand
+} frame_t;
+
+
+/*
+ * Releases the suspended conversions when error occurs. Error in the true
+ * operand of conditional operator is reported as missing colon.
+ */
+static void unwind_frames( frame_t *frames, int frames_len, int if_operand, exp_error_t *ercode, char *error, int *error_pos){
+	while( frames_len--){
+		if( if_operand==1){
+			*ercode=EXP_ER_INVALEXPR;
+			strcpy( error, "Colon was not found in conditional expression");
+			*error_pos=frames[frames_len].ifthen->position;
+		}
+		if_operand=frames[frames_len].if_operand;
+		if( frames[frames_len].argc_stack) exp_mem_free( frames[frames_len].argc_stack);
+		if( frames[frames_len].found_stack) exp_mem_free( frames[frames_len].found_stack);
+	}
+	exp_mem_free( frames);
+}
+
+//Suspends the conversion of the expression, the operand of conditional
+//operator `ifthen' is converted next with empty stacks
+#define SUSPEND( _if_operand) ({\
+	frame_t *_f=frames;\
+	if( frames_len>=frames_maxlen &&\
+			( _f=exp_mem_realloc( frames, sizeof( frame_t)*( frames_maxlen ? frames_maxlen*2 : 16)))){\
+		frames=_f;\
+		frames_maxlen=frames_maxlen ? frames_maxlen*2 : 16;\
+	}\
+	if( _f){\
+		_f=&frames[frames_len++];\
+		_f->stack=stack;\
+		_f->out_head=out_head;\
+		_f->out_tail=out_tail;\
+		_f->found_stack=found_stack;\
+		_f->found_maxlen=found_maxlen;\
+		_f->found_len=found_len;\
+		_f->argc_stack=argc_stack;\
+		_f->argc_maxlen=argc_maxlen;\
+		_f->argc_len=argc_len;\
+		_f->if_operand=if_operand;\
+		_f->ifthen=ifthen;\
+		_f->iftrue=iftrue;\
+		stack=out_head=out_tail=NULL;\
+		found_stack=argc_stack=NULL;\
+		found_maxlen=found_len=argc_maxlen=argc_len=0;\
+		if_operand=(_if_operand);\
+	}\
+	(_f);\
+})
+
+
+/*
+ * Moves the operators that are left on the stack to the output queue, when
+ * the expression or the operand of conditional operator is read. `closing'
+ * is the right parenthesis that ends the operand, if any.
+ *
+ * @return Returns the output queue or NULL if error occured
+ */
+static token_t *finish_operand( token_t *out_head, token_t *out_tail, token_t *stack, int if_operand, token_t *closing, exp_error_t *ercode, char *error, int *error_pos){
+	token_t *curr;
+
+	//When there are no more tokens to read:
+	//	While there are still operator tokens in the stack:
+	//		If the operator token on the top of the stack is a parenthesis, then there are mismatched parentheses.
+	//		Pop the operator onto the output queue
+
+	curr=stack;
+	while( curr){
+		stack=stack->next;
+		curr->next=NULL;
+		switch(curr->param.type){
+			case T_LPAREN:
+				*ercode=EXP_ER_INVALEXPR;
+				if( if_operand==1){
+					strcpy( error, "Non-closed left parenthesis in conditional expression");
+				}else{
+					strcpy( error, "Left parenthesis is opened but right parenthesis was not found");
+				}
+				*error_pos=curr->position;
+				return NULL;
+			case T_RPAREN:
+				*ercode=EXP_ER_INVALEXPR;
+				strcpy( error, "Unexpected right parenthesis");
+				*error_pos=curr->position;
+				return NULL;
+			default:
+				if(out_tail){
+					out_tail->next=curr;
+					out_tail=curr;
+				}else{
+					out_tail=out_head=curr;
+				}
+				break;
+		}
+		curr=stack;
+	}
+
+	if(NULL==out_head){
+		*ercode=EXP_ER_INVALEXPR;
+		if( closing){
+			strcpy(error, "Empty clause");
+			*error_pos=closing->position;
+		}else{
+			strcpy(error, "Empty expression was provided");
+			*error_pos=0;
+		}
+	}
+	return out_head;
+}
+
+
+/*
+ * Tokens of the input list are moved to the output list, the input list is
+ * consumed. New tokens are allocated in the arena, where the input tokens
+ * are, so no token is freed here.
+ *
+ * Operands of the conditional operator are converted separately, they are
+ * attached to T_IFSTATEMENT tokens. The conversion of the enclosing expression
+ * is suspended in the array of frames meanwhile, so deeply nested conditional
+ * expressions do not use the stack of the process, and time and memory are
+ * linear in the number of tokens.
+ */
+token_t *exp_shunting_yard( arena_t *arena, token_t *input, exp_error_t *ercode, char *error, int *error_pos){
+	token_t *in, *curr=NULL;
 	token_t *stack=NULL;
 	token_t *out_head=NULL, *out_tail=NULL;
 	token_t *temp;
@@ -100,14 +236,115 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 	int argc_maxlen=0;
 	int argc_len=0;
 	int colon_found=0;
+	token_t *closing=NULL;
+	//suspended conversions of the enclosing expressions
+	frame_t *frames=NULL, *f;
+	int frames_len=0;
+	int frames_maxlen=0;
+	int if_operand=0;
+	token_t *ifthen=NULL;
+	token_t *iftrue=NULL;
+	int finished;
 
 
-	//dup input queue
-	in=exp_token_dup( input);
+	in=input;
 
 	//Shunting-yard algorthm:
 	//While there are tokens to be read
-	while(in && 0==colon_found){
+	for(;;){
+		if( NULL==in || colon_found){
+			//The expression or the operand of conditional operator is read
+			if( NULL==( temp=finish_operand( out_head, out_tail, stack, if_operand, closing, ercode, error, error_pos))){
+				if( argc_stack) exp_mem_free( argc_stack);
+				if( found_stack) exp_mem_free( found_stack);
+				unwind_frames( frames, frames_len, if_operand, ercode, error, error_pos);
+				return NULL;
+			}
+			if( argc_stack) exp_mem_free( argc_stack);
+			if( found_stack) exp_mem_free( found_stack);
+			if( 0==frames_len){
+				exp_mem_free( frames);
+				return temp;
+			}
+
+			//resume the conversion of the enclosing expression
+			finished=if_operand;
+			f=&frames[--frames_len];
+			stack=f->stack;
+			out_head=f->out_head;
+			out_tail=f->out_tail;
+			found_stack=f->found_stack;
+			found_maxlen=f->found_maxlen;
+			found_len=f->found_len;
+			argc_stack=f->argc_stack;
+			argc_maxlen=f->argc_maxlen;
+			argc_len=f->argc_len;
+			if_operand=f->if_operand;
+			ifthen=f->ifthen;
+			iftrue=f->iftrue;
+			closing=NULL;
+
+			if( finished==1){
+				//the colon is consumed, the false operand follows it
+				if( !colon_found){
+					*ercode=EXP_ER_INVALEXPR;
+					ERROR_OCCURED( "Colon was not found in conditional expression", ifthen->position);
+					return NULL;
+				}
+				if( NULL==( iftrue=exp_arena_alloc( arena, sizeof( token_t)))){
+					*ercode=EXP_ER_NOMEM;
+					ERROR_OCCURED( "Memory error", 0);
+					return NULL;
+				}
+				iftrue->position=ifthen->position;
+				iftrue->param.type=T_IFSTATEMENT;
+				iftrue->children=temp;
+				colon_found=0;
+				if( NULL==SUSPEND( 2)){
+					*ercode=EXP_ER_NOMEM;
+					ERROR_OCCURED( "Memory error", 0);
+					return NULL;
+				}
+				continue;
+
+			}else{
+				//the colon or the right parenthesis that ends the false
+				//operand is left for the enclosing expression
+				token_t *iffalse;
+
+				if( !colon_found){
+					in=NULL;
+				}
+				colon_found=0;
+				if( NULL==( iffalse=exp_arena_alloc( arena, sizeof( token_t)))){
+					*ercode=EXP_ER_NOMEM;
+					ERROR_OCCURED( "Memory error", 0);
+					return NULL;
+				}
+				iffalse->position=ifthen->position;
+				iffalse->param.type=T_IFSTATEMENT;
+				iffalse->children=temp;
+
+				if(out_tail){
+					out_tail->next=iftrue;
+					out_tail=iftrue;
+				}else{
+					out_tail=out_head=iftrue;
+				}
+				iftrue->next=NULL;
+
+				out_tail->next=iffalse;
+				out_tail=iffalse;
+				iffalse->next=NULL;
+
+				ifthen->param.type=T_IFCONDITION;
+				out_tail->next=ifthen;
+				out_tail=ifthen;
+				ifthen->next=NULL;
+				continue;
+			}
+		}
+
 		//Read a token
 		curr=in;
 		in=in->next;
@@ -191,8 +428,7 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 					return NULL;
 				}
 
-				//free comma-token
-				exp_token_free( curr);
+				//drop comma-token
 				curr=NULL;
 				break;
 
@@ -211,7 +447,6 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 						return NULL;
 
 					}else if( 1==if_operand){
-						exp_token_free( curr);
 						colon_found=1;
 						break;
 
@@ -243,88 +478,39 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 					}
 				}
 
-				// if the operator is O_IF then for all two its operands call S-Y algorith separately
-				// and push them onto output queue
+				// if the operator is O_IF then its operands are converted
+				// separately and pushed onto output queue
 				if( curr->param.value.operator==O_IFTHEN){
-					char estr[EXP_ERLEN];
-					int epos;
-					token_t *t;
-
-					in1=NULL;
-					if(NULL==(t=exp_shunting_yard( in, 1, &in1, ercode, estr, &epos)) || in1==NULL){
-						if( in1==NULL){
-							*ercode=EXP_ER_INVALEXPR;
-							ERROR_OCCURED( "Colon was not found in conditional expression", curr->position);
-						}else{
-							ERROR_OCCURED( estr, epos);
-						}
-						exp_token_free( in1);
-						exp_token_free( t);
+					ifthen=curr;
+					iftrue=NULL;
+					if( NULL==SUSPEND( 1)){
+						*ercode=EXP_ER_NOMEM;
+						ERROR_OCCURED( "Memory error", 0);
 						return NULL;
-					}else{
-						token_t *iftrue;
+					}
 
-						exp_token_free( in);
-						in=in1;
-						in1=NULL;
-						if( NULL==( iftrue=calloc( 1, sizeof( token_t)))){
+				}else{
+					// left operand of && and || is complete on the output queue now,
+					// it is followed by a marker, so that the right operand can be
+					// skipped when the left one decides the result
+					if( curr->param.value.operator==O_BOOLAND || curr->param.value.operator==O_BOOLOR){
+						token_t *shortcut;
+
+						if( NULL==( shortcut=exp_arena_alloc( arena, sizeof( token_t)))){
 							*ercode=EXP_ER_NOMEM;
 							ERROR_OCCURED( "Memory error", 0);
-							exp_token_free( t);
 							return NULL;
-
+						}
+						shortcut->position=curr->position;
+						shortcut->param.type=T_SHORTCUT;
+						shortcut->param.value.operator=curr->param.value.operator;
+						if(out_tail){
+							out_tail->next=shortcut;
+							out_tail=shortcut;
 						}else{
-							iftrue->position=curr->position;
-							iftrue->param.type=T_IFSTATEMENT;
-							iftrue->children=t;
-
-							in1=NULL;
-							if(NULL==(t=exp_shunting_yard( in, 2, &in1, ercode, estr, &epos))){
-								ERROR_OCCURED( estr, epos);
-								exp_token_free( iftrue);
-								exp_token_free( in1);
-								return NULL;
-							}else{
-								token_t *iffalse;
-
-								exp_token_free( in);
-								in=in1;
-								in1=NULL;
-								if( NULL==( iffalse=calloc( 1, sizeof( token_t)))){
-									*ercode=EXP_ER_NOMEM;
-									ERROR_OCCURED( "Memory error", 0);
-									exp_token_free( iftrue);
-									exp_token_free( t);
-									return NULL;
-
-								}else{
-									iffalse->position=curr->position;
-									iffalse->param.type=T_IFSTATEMENT;
-									iffalse->children=t;
-
-
-									if(out_tail){
-										out_tail->next=iftrue;
-										out_tail=iftrue;
-									}else{
-										out_tail=out_head=iftrue;
-									}
-									iftrue->next=NULL;
-
-									out_tail->next=iffalse;
-									out_tail=iffalse;
-									iffalse->next=NULL;
-
-									curr->param.type=T_IFCONDITION;
-									out_tail->next=curr;
-									out_tail=curr;
-									curr->next=NULL;
-								}
-							}
+							out_tail=out_head=shortcut;
 						}
 					}
-
-				}else{
 					curr->next=stack;
 					stack=curr;
 				}
@@ -354,17 +540,13 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 				}
 				if(stack==NULL || stack->param.type !=T_LPAREN){
 					if( stack==NULL && if_operand==2){
+						//the parenthesis ends the false operand, it is left
+						//for the enclosing expression like the colon
 						curr->next=in;
 						in=curr;
-						*new_input=in;
-						if( argc_stack) free( argc_stack);
-						if( found_stack) free( found_stack);
-						if(NULL==out_head){
-							*ercode=EXP_ER_INVALEXPR;
-							strcpy(error, "Empty clause");
-							*error_pos=curr->position;
-						}
-						return out_head;
+						closing=curr;
+						colon_found=1;
+						break;
 					}else{
 						*ercode=EXP_ER_INVALEXPR;
 						ERROR_OCCURED("Unexpected right parenthesis", curr->position);
@@ -372,11 +554,7 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 					}
 				}
 				//	Pop the left parenthesis from the stack, but not onto the output queue.
-				temp=stack;
 				stack=stack->next;
-				temp->next=NULL;
-				exp_token_free( temp);
-				exp_token_free( curr);
 				curr=NULL;
 				//If the token at the top of the stack is a function token
 				// MOD:Pop stack into f
@@ -391,7 +569,7 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 					stack=stack->next;
 
 					if( argc_len && found_len){
-						if(( argc=calloc( 1, sizeof( token_t)))){
+						if(( argc=exp_arena_alloc( arena, sizeof( token_t)))){
 							argc->param.type=T_INTEGER;
 							argc->param.value.integer=STACK_POP( argc_stack, argc_len)+
 									(STACK_POP(found_stack, found_len)? 1 : 0);
@@ -408,13 +586,11 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 						}else{
 							*ercode=EXP_ER_NOMEM;
 							ERROR_OCCURED( "Memory error", 0);
-							exp_token_free( func);
 							return NULL;
 						}
 					}else{
 						*ercode=EXP_ER_NOMEM;
 						ERROR_OCCURED( "Algorithm error", 0);
-						exp_token_free( func);
 						return NULL;
 					}
 
@@ -434,59 +610,4 @@ token_t *exp_shunting_yard( token_t *input, int if_operand, token_t **new_input,
 				return NULL;
 		}
 	}
-
-
-	//When there are no more tokens to read:
-	//	While there are still operator tokens in the stack:
-	//		If the operator token on the top of the stack is a parenthesis, then there are mismatched parentheses.
-	//		Pop the operator onto the output queue
-
-	curr=stack;
-	while( curr){
-		stack=stack->next;
-		curr->next=NULL;
-		switch(curr->param.type){
-			case T_LPAREN:
-				if( if_operand==1){
-					*ercode=EXP_ER_INVALEXPR;
-					ERROR_OCCURED("Non-closed left parenthesis in conditional expression", curr->position);
-				}else{
-					*ercode=EXP_ER_INVALEXPR;
-					ERROR_OCCURED("Left parenthesis is opened but right parenthesis was not found", curr->position);
-
-				}
-				return NULL;
-			case T_RPAREN:
-				*ercode=EXP_ER_INVALEXPR;
-				ERROR_OCCURED("Unexpected right parenthesis", curr->position);
-				return NULL;
-			default:
-				if(out_tail){
-					out_tail->next=curr;
-					out_tail=curr;
-				}else{
-					out_tail=out_head=curr;
-				}
-				break;
-		}
-		curr=stack;
-	}
-
-	if( argc_stack) free( argc_stack);
-	if( found_stack) free( found_stack);
-	if(NULL==out_head){
-		*ercode=EXP_ER_INVALEXPR;
-		strcpy(error, "Empty expression was provided");
-		*error_pos=0;
-		return NULL;
-	}else{
-		if( if_operand){
-			if( colon_found){
-				*new_input=in;
-			}else{
-				*new_input=NULL;
-			}
-		}
-		return out_head;
-	}
 }
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Vector kernels of exp_solve_batch(). This file is included by simd.c once
+ * for every instruction set: SIMD_KERNEL is the name of the function and
+ * SIMD_WIDTH is the size of vector registers in bytes.
+ */
+
+#define SIMD_LANES (SIMD_WIDTH/8)
+
+
+/*
+ * Evaluates kernel for the rows of vectors that contain only integers, only
+ * reals or only booleans. Results are stored in `a'.
+ *
+ * @return Number of evaluated rows
+ */
+static int SIMD_KERNEL( vector_t *a, vector_t *b, kernel_t kernel, int rows, int *types){
+	typedef int64_t vi __attribute__(( vector_size( SIMD_WIDTH)));
+	typedef uint64_t vu __attribute__(( vector_size( SIMD_WIDTH)));
+	typedef double vd __attribute__(( vector_size( SIMD_WIDTH)));
+	typedef unsigned char vb __attribute__(( vector_size( SIMD_LANES)));
+	int done=rows - rows % SIMD_LANES;
+	int r, l;
+	vi x, y, m, acc={ 0}, acc_real={ 0};
+	vd dx, dy, d;
+	vb t;
+
+	*types=0;
+	if( done<=0){
+		return 0;
+	}
+	if( a->types==TYPE_INTEGER && b->types==TYPE_INTEGER){
+		for( r=0; r<done; r+=SIMD_LANES){
+			memcpy( &x, &a->value[r], sizeof( x));
+			memcpy( &y, &b->value[r], sizeof( y));
+			switch( kernel){
+				case K_ADD:
+					m=(vi)(( vu)x + ( vu)y);
+					//sign of the result differs from signs of both operands
+					acc|=( x ^ m) & ( y ^ m);
+					break;
+				case K_SUB:
+					m=(vi)(( vu)x - ( vu)y);
+					acc|=( x ^ y) & ( x ^ m);
+					break;
+				case K_BITAND: m=x & y; break;
+				case K_BITOR:  m=x | y; break;
+				case K_LT:     m=( x<y) & 1; break;
+				case K_GT:     m=( x>y) & 1; break;
+				case K_LE:     m=( x<=y) & 1; break;
+				case K_GE:     m=( x>=y) & 1; break;
+				case K_EQ:     m=( x==y) & 1; break;
+				case K_NE:     m=( x !=y) & 1; break;
+				case K_AND:    m=( x !=0) & ( y !=0) & 1; break;
+				case K_OR:     m=(( x !=0) | ( y !=0)) & 1; break;
+				default:
+					return 0;
+			}
+			memcpy( &a->value[r], &m, sizeof( m));
+		}
+		if( kernel>=K_LT && kernel<=K_OR){
+			memset( a->type, T_BOOLEAN, done);
+		}
+		for( l=0; l<SIMD_LANES; l++){
+			if( acc[l]<0){
+				//overflow: the wrapped results are evaluated again as reals
+				for( r=0; r<done; r++){
+					int64_t i2=b->value[r].integer, i1, i;
+					i1=( int64_t)( kernel==K_ADD ? ( uint64_t)a->value[r].integer - ( uint64_t)i2 :
+							( uint64_t)a->value[r].integer + ( uint64_t)i2);
+					if( kernel==K_ADD ? __builtin_add_overflow( i1, i2, &i) : __builtin_sub_overflow( i1, i2, &i)){
+						vector_set_real( a, r, kernel==K_ADD ? (double)i1 + (double)i2 : (double)i1 - (double)i2);
+					}
+				}
+				*types=a->types;
+				break;
+			}
+		}
+		return done;
+
+	}else if( a->types==TYPE_REAL && b->types==TYPE_REAL){
+		for( r=0; r<done; r+=SIMD_LANES){
+			memcpy( &dx, &a->value[r], sizeof( dx));
+			memcpy( &dy, &b->value[r], sizeof( dy));
+			switch( kernel){
+				case K_ADD: d=dx + dy; break;
+				case K_SUB: d=dx - dy; break;
+				case K_MUL: d=dx * dy; break;
+				case K_DIV: d=dx / dy; break;
+				case K_LT:  m=( dx<dy) & 1; break;
+				case K_GT:  m=( dx>dy) & 1; break;
+				case K_LE:  m=( dx<=dy) & 1; break;
+				case K_GE:  m=( dx>=dy) & 1; break;
+				case K_EQ:  m=( dx==dy) & 1; break;
+				case K_NE:  m=( dx !=dy) & 1; break;
+				default:
+					return 0;
+			}
+			if( kernel<=K_DIV){
+				//integral results are converted to integer, see vector_set_real()
+				vi fits=( d<9223372036854775808.0) & ( d>=-9223372036854775808.0);
+				vi i=__builtin_convertvector(( vd)(( vi)d & fits), vi);
+				vi integral=fits & ( __builtin_convertvector( i, vd)==d);
+
+				m=( i & integral) | (( vi)d & ~integral);
+				t=__builtin_convertvector( T_REAL - ( integral & ( T_REAL - T_INTEGER)), vb);
+				memcpy( &a->type[r], &t, sizeof( t));
+				acc|=integral;
+				acc_real|=~integral;
+			}
+			memcpy( &a->value[r], &m, sizeof( m));
+		}
+		if( kernel<=K_DIV){
+			for( l=0; l<SIMD_LANES; l++){
+				*types|=( acc[l] ? TYPE_INTEGER : 0) | ( acc_real[l] ? TYPE_REAL : 0);
+			}
+		}else{
+			memset( a->type, T_BOOLEAN, done);
+		}
+		return done;
+
+	}else if( a->types==TYPE_BOOLEAN && b->types==TYPE_BOOLEAN){
+		for( r=0; r<done; r+=SIMD_LANES){
+			//only the low half of the lane holds the value of boolean
+			memcpy( &x, &a->value[r], sizeof( x));
+			memcpy( &y, &b->value[r], sizeof( y));
+			x=( x & 0xffffffff) !=0;
+			y=( y & 0xffffffff) !=0;
+			switch( kernel){
+				case K_EQ:  m=( x==y) & 1; break;
+				case K_NE:  m=( x !=y) & 1; break;
+				case K_AND: m=( x & y) & 1; break;
+				case K_OR:  m=( x | y) & 1; break;
+				default:
+					return 0;
+			}
+			memcpy( &a->value[r], &m, sizeof( m));
+		}
+		return done;
+	}
+	return 0;
+}
+
+#undef SIMD_LANES
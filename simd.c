@@ -0,0 +1,96 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Vector kernels of exp_solve_batch() with runtime selection of the
+ * instruction set.
+ */
+
+#include "libexpression-private.h"
+
+
+#if defined( __GNUC__) && ( defined( __x86_64__) || defined( __i386__))
+
+//The kernels are the same code in simd-kernel.h compiled for every
+//instruction set, GCC vector extensions are translated into SSE2, AVX2 or
+//AVX-512 instructions.
+#define SIMD_WIDTH 16
+#define SIMD_KERNEL simd_kernel_sse2
+#include "simd-kernel.h"
+#undef SIMD_WIDTH
+#undef SIMD_KERNEL
+
+#pragma GCC push_options
+#pragma GCC target( "avx2")
+#define SIMD_WIDTH 32
+#define SIMD_KERNEL simd_kernel_avx2
+#include "simd-kernel.h"
+#undef SIMD_WIDTH
+#undef SIMD_KERNEL
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target( "avx512f,avx512dq")
+#define SIMD_WIDTH 64
+#define SIMD_KERNEL simd_kernel_avx512
+#include "simd-kernel.h"
+#undef SIMD_WIDTH
+#undef SIMD_KERNEL
+#pragma GCC pop_options
+
+
+typedef int simd_kernel_f( vector_t *a, vector_t *b, kernel_t kernel, int rows, int *types);
+
+static simd_kernel_f *simd_kernel=NULL;
+
+
+/*
+ * Evaluates binary kernel for the rows of vectors with the widest vector
+ * instructions that the processor supports. The instruction set is detected
+ * once, when the first kernel is evaluated.
+ *
+ * @return Number of evaluated rows, the kernel for other rows is evaluated by
+ *         the caller. `types' is set to the types of evaluated results.
+ */
+int exp_simd_kernel( vector_t *a, vector_t *b, kernel_t kernel, int rows, int *types){
+	simd_kernel_f *f=__atomic_load_n( &simd_kernel, __ATOMIC_RELAXED);
+
+	if( NULL==f){
+		__builtin_cpu_init();
+		if( __builtin_cpu_supports( "avx512f") && __builtin_cpu_supports( "avx512dq")){
+			f=simd_kernel_avx512;
+		}else if( __builtin_cpu_supports( "avx2")){
+			f=simd_kernel_avx2;
+		}else{
+			f=simd_kernel_sse2;
+		}
+		__atomic_store_n( &simd_kernel, f, __ATOMIC_RELAXED);
+	}
+	return f( a, b, kernel, rows, types);
+}
+
+#else
+
+int exp_simd_kernel( vector_t *a, vector_t *b, kernel_t kernel, int rows, int *types){
+	//no vector kernels for this processor, all rows are evaluated by the caller
+	*types=0;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2011 Sergey Kolotsey.
+ *
+ * This file is part of libexpression library.
+ *
+ * libexpression is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libexpression is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public Licenise
+ * along with libexpression. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * =====================================================================
+ *
+ * Table of interned identifiers.
+ */
+
+#include "libexpression-private.h"
+
+
+//The table grows when it has more symbols than buckets
+#define SYMBOL_BUCKETS 64
+
+
+//Symbols of all expressions, the table is shared by the threads. It is
+//allocated by the C library, the allocator of the library is not used.
+static struct {
+	char lock;
+	symbol_t **buckets;
+	int buckets_len;                 // power of two
+	int len;
+} symbols={0, NULL, 0, 0};
+
+
+/*
+ * Doubles the number of buckets, the table is locked by the caller. The table
+ * keeps working with the old buckets if memory error occurs.
+ */
+static void symbols_grow( void){
+	symbol_t **buckets, *s, *next;
+	int len=symbols.buckets_len ? symbols.buckets_len*2 : SYMBOL_BUCKETS;
+	int i;
+
+	if( NULL==( buckets=calloc( len, sizeof( symbol_t *)))){
+		return;
+	}
+	for( i=0; i<symbols.buckets_len; i++){
+		for( s=symbols.buckets[i]; s; s=next){
+			next=s->next;
+			s->next=buckets[s->hash & ( len-1)];
+			buckets[s->hash & ( len-1)]=s;
+		}
+	}
+	free( symbols.buckets);
+	symbols.buckets=buckets;
+	symbols.buckets_len=len;
+}
+
+
+/*
+ * Finds the symbol, the table is locked by the caller
+ */
+static symbol_t *symbols_find( const char *name, uint64_t hash){
+	symbol_t *s=NULL;
+
+	if( symbols.buckets_len){
+		for( s=symbols.buckets[hash & ( symbols.buckets_len-1)]; s; s=s->next){
+			if( s->hash==hash && 0==strcmp( s->name, name)){
+				break;
+			}
+		}
+	}
+	return s;
+}
+
+
+/*
+ * Returns the symbol with the given name, the symbol is added to the table if
+ * the name is used for the first time. Every name is stored once, so symbols
+ * are compared by pointer. The caller owns a reference to the symbol and
+ * releases it with exp_symbol_release().
+ *
+ * @return Symbol or NULL if memory error occured
+ */
+symbol_t *exp_symbol_intern( const char *name){
+	uint64_t hash=exp_hash_text( name);
+	size_t len=strlen( name);
+	symbol_t *s;
+
+	exp_spin_lock( &symbols.lock);
+	if( NULL==( s=symbols_find( name, hash))){
+		if( symbols.len>=symbols.buckets_len){
+			symbols_grow();
+		}
+		if( symbols.buckets_len && ( s=malloc( sizeof( symbol_t)+len+1))){
+			s->hash=hash;
+			s->refs=0;
+			memcpy( s->name, name, len+1);
+			s->next=symbols.buckets[hash & ( symbols.buckets_len-1)];
+			symbols.buckets[hash & ( symbols.buckets_len-1)]=s;
+			symbols.len++;
+		}
+	}
+	if( s){
+		s->refs++;
+	}
+	exp_spin_unlock( &symbols.lock);
+	return s;
+}
+
+
+/*
+ * Returns the symbol with the given name if it is in the table. The caller
+ * owns a reference to the symbol like with exp_symbol_intern().
+ *
+ * @return Symbol or NULL if no expression uses the name
+ */
+symbol_t *exp_symbol_find( const char *name){
+	uint64_t hash=exp_hash_text( name);
+	symbol_t *s;
+
+	exp_spin_lock( &symbols.lock);
+	if(( s=symbols_find( name, hash))){
+		s->refs++;
+	}
+	exp_spin_unlock( &symbols.lock);
+	return s;
+}
+
+
+/*
+ * Releases the reference to the symbol, the symbol is removed from the table
+ * when it is no longer used.
+ */
+void exp_symbol_release( symbol_t *s){
+	symbol_t **prev;
+
+	if( s){
+		exp_spin_lock( &symbols.lock);
+		if( 0==--s->refs){
+			for( prev=&symbols.buckets[s->hash & ( symbols.buckets_len-1)]; *prev !=s; prev=&(*prev)->next);
+			*prev=s->next;
+			symbols.len--;
+			free( s);
+		}
+		exp_spin_unlock( &symbols.lock);
+	}
+}
@@ -24,62 +24,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include "libexpression-private.h"
 
-static char *strdupn( char *s, size_t n){
-	char *ret=NULL;
-	char *p;
+/*
+ * Copies `n' characters of the string literal to `d' and removes the slashes
+ * in one pass. The backslash that is left by the escaped backslash is examined
+ * again with the next character. `d' must be at least `n'+1 bytes long.
+ */
+static void stripslashes( char *d, const char *s, size_t n){
+	const char *end=s+n;
 
-	if((ret=malloc( n+1))){
-		p=ret;
-		while( *s && n){
-			*p++=*s++;
-			n--;
+	while( s<end){
+		if( *s !='\\'){
+			*d++=*s++;
+			continue;
 		}
-		*p=0;
-	}
-	return ret;
-}
-
-static void stripslashes( char *s){
-	char c;
-	while( *s){
-		if( *s=='\\'){
-			c=*(s+1);
-			switch (c){
-				case 'n':
-					*s='\n';
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				case 'r':
-					*s='\r';
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				case 't':
-					*s='\t';
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				case '\\':
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				case '\'':
-					*s='\'';
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				case '"':
-					*s='"';
-					memmove( s+1, s+2, strlen(s+2)+1);
-					break;
-				default:
-					s+=2;
-					break;
-			}
-
-		}else{
-			s++;
+		if( s+1==end){
+			*d++=*s++;
+			break;
+		}
+		switch( s[1]){
+			case 'n':  *d++='\n'; s+=2; break;
+			case 'r':  *d++='\r'; s+=2; break;
+			case 't':  *d++='\t'; s+=2; break;
+			case '\'': *d++='\''; s+=2; break;
+			case '"':  *d++='"';  s+=2; break;
+			case '\\': s++; break;
+			default:
+				*d++=*s++;
+				*d++=*s++;
+				break;
 		}
 	}
+	*d=0;
 }
 
 int exp_op_argument_count( operator_t op){
@@ -158,79 +135,6 @@ int exp_op_is_lefttoright( operator_t op){
 
 
 
-token_t *exp_token_free( token_t *head){
-	token_t *t;
-	while(head){
-		t=head;
-		head=head->next;
-
-		if(t->param.type==T_STRING && t->param.value.string){
-			free(t->param.value.string);
-		}
-		if(t->param.type==T_PARAMETER && t->param.value.parameter){
-			free(t->param.value.parameter);
-		}
-		if(t->param.type==T_FUNCTION && t->param.value.function){
-			free(t->param.value.function);
-		}
-		if(t->param.type==T_IFSTATEMENT){
-			exp_token_free( t->children);
-		}
-		free(t);
-	}
-	return NULL;
-}
-
-
-
-token_t *exp_token_dup( token_t *tok){
-	token_t *ret=NULL, *ret_tail=NULL, *c;
-
-	while( tok){
-		if( NULL==(c=calloc(1, sizeof( token_t)))){
-			break;
-		}
-
-		if(tok->param.type==T_STRING){
-			c->param.type=tok->param.type;
-			c->position=tok->position;
-			if( tok->param.value.string){
-				c->param.value.string=strdup(tok->param.value.string);
-			}
-		}else if(tok->param.type==T_PARAMETER){
-			c->param.type=tok->param.type;
-			c->position=tok->position;
-			if( tok->param.value.parameter){
-				c->param.value.parameter=strdup(tok->param.value.parameter);
-			}
-		}else if(tok->param.type==T_FUNCTION){
-			c->param.type=tok->param.type;
-			c->position=tok->position;
-			if( tok->param.value.function){
-				c->param.value.function=strdup(tok->param.value.function);
-			}
-		}else if( tok->param.type==T_IFSTATEMENT){
-			c->param.type=tok->param.type;
-			c->position=tok->position;
-			c->children=exp_token_dup( tok->children);
-
-		}else{
-			memcpy( c, tok, sizeof( token_t));
-		}
-		c->next=NULL;
-
-		if(ret_tail){
-			ret_tail->next=c;
-			ret_tail=c;
-		}else{
-			ret=ret_tail=c;
-		}
-		tok=tok->next;
-	}
-	return ret;
-}
-
-
 #ifdef EXP_DEBUG
 
 
@@ -333,6 +237,8 @@ void token_print( char *msg, token_t *token, int recursion){
 
 		}else if( t->param.type==T_IFCONDITION){
 			printf("?");
+		}else if( t->param.type==T_SHORTCUT){
+			printf("%s| ", operator_to_string( t->param.value.operator, op));
 		}else if( t->param.type==T_IFSTATEMENT){
 			printf("{");
 			token_print( "", t->children, recursion+1);
@@ -354,14 +260,35 @@ void token_print( char *msg, token_t *token, int recursion){
 
 
 
-static void strtolower( char *str){
-	while( *str){
-		*str=tolower(*str);
-		str++;
-	}
-}
+//Tokens are recognized by the first character, the class of the character
+//selects the only routine that can accept the token
+#define CHAR_OTHER    0
+#define CHAR_PAREN    1
+#define CHAR_COMMA    2
+#define CHAR_OPERATOR 3
+#define CHAR_NUMBER   4
+#define CHAR_ALPHA    5
+#define CHAR_QUOTE    6
+#define CHAR_CLASS    0x0f // mask of the class
+#define CHAR_NAME     0x10 // the character may follow the first one in the name of parameter or function
+#define CHAR_UPPER    0x20 // upper case letter, this is the bit that turns it to lower case
 
-static token_t *is_parenthesis( char *s, size_t slen, int *toklen){
+static const unsigned char char_class[256]={
+	['(']=CHAR_PAREN, [')']=CHAR_PAREN,
+	[',']=CHAR_COMMA,
+	['+']=CHAR_OPERATOR, ['-']=CHAR_OPERATOR, ['/']=CHAR_OPERATOR, ['%']=CHAR_OPERATOR,
+	['*']=CHAR_OPERATOR, ['^']=CHAR_OPERATOR, ['~']=CHAR_OPERATOR, ['?']=CHAR_OPERATOR,
+	[':']=CHAR_OPERATOR, ['>']=CHAR_OPERATOR, ['<']=CHAR_OPERATOR, ['=']=CHAR_OPERATOR,
+	['!']=CHAR_OPERATOR, ['&']=CHAR_OPERATOR, ['|']=CHAR_OPERATOR,
+	['0' ... '9']=CHAR_NUMBER | CHAR_NAME,
+	['.']=CHAR_NUMBER | CHAR_NAME,
+	['a' ... 'z']=CHAR_ALPHA | CHAR_NAME,
+	['A' ... 'Z']=CHAR_ALPHA | CHAR_NAME | CHAR_UPPER,
+	['_']=CHAR_ALPHA | CHAR_NAME,
+	['"']=CHAR_QUOTE, ['\'']=CHAR_QUOTE,
+};
+
+static token_t *is_parenthesis( arena_t *arena, char *s, size_t slen, int *toklen){
 	if(slen){
 		token_type_t type;
 		token_t *ret;
@@ -372,7 +299,7 @@ static token_t *is_parenthesis( char *s, size_t slen, int *toklen){
 			default: return NULL;
 		}
 		*toklen=1;
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			ret->param.type=type;
 		}
 		return ret;
@@ -380,7 +307,7 @@ static token_t *is_parenthesis( char *s, size_t slen, int *toklen){
 	return NULL;
 }
 
-static token_t *is_comma( char *s, size_t slen, int *toklen){
+static token_t *is_comma( arena_t *arena, char *s, size_t slen, int *toklen){
 	if(slen){
 		token_type_t type;
 		token_t *ret;
@@ -390,7 +317,7 @@ static token_t *is_comma( char *s, size_t slen, int *toklen){
 			default: return NULL;
 		}
 		*toklen=1;
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			ret->param.type=type;
 		}
 		return ret;
@@ -398,7 +325,7 @@ static token_t *is_comma( char *s, size_t slen, int *toklen){
 	return NULL;
 }
 
-static token_t *is_operator( char *s, size_t slen, int *toklen){
+static token_t *is_operator( arena_t *arena, char *s, size_t slen, int *toklen){
 	if(slen){
 		int rlen;
 		token_t *ret;
@@ -480,7 +407,7 @@ static token_t *is_operator( char *s, size_t slen, int *toklen){
 			default:
 				return NULL;
 		}
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			*toklen=rlen;
 			ret->param.type=T_OPERATOR;
 			ret->param.value.operator=value;
@@ -491,7 +418,7 @@ static token_t *is_operator( char *s, size_t slen, int *toklen){
 	}
 }
 
-static token_t *is_number( char *s, size_t slen, int *toklen){
+static token_t *is_number( arena_t *arena, char *s, size_t slen, int *toklen){
 	int rlen;
 	token_t *ret;
 	int c;
@@ -508,7 +435,7 @@ static token_t *is_number( char *s, size_t slen, int *toklen){
 			s++;
 			rlen++;
 		}
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			*toklen=rlen;
 			ret->param.type=T_INTEGER;
 			ret->param.value.integer=num;
@@ -527,7 +454,7 @@ static token_t *is_number( char *s, size_t slen, int *toklen){
 			s++;
 			rlen++;
 		}
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			*toklen=rlen;
 			ret->param.type=T_INTEGER;
 			ret->param.value.integer=num;
@@ -546,7 +473,7 @@ static token_t *is_number( char *s, size_t slen, int *toklen){
 			s++;
 			rlen++;
 		}
-		if((ret=calloc(1, sizeof( token_t)))){
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 			*toklen=rlen;
 			ret->param.type=T_INTEGER;
 			ret->param.value.integer=num;
@@ -599,7 +526,7 @@ static token_t *is_number( char *s, size_t slen, int *toklen){
 
 		}else{
 			//ok, it's a number
-			if((ret=calloc(1, sizeof( token_t)))){
+			if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
 				char buf[rlen+1];
 
 				*toklen=rlen;
@@ -618,20 +545,25 @@ static token_t *is_number( char *s, size_t slen, int *toklen){
 	}
 }
 
-static token_t *is_parameter( char *s, size_t slen, int *toklen){
-	char *p=s;
+static token_t *is_parameter( arena_t *arena, char *s, size_t slen, int *toklen){
+	char *p=s, *d;
 	token_t *ret;
 
 	if(IS_ALPHA( *p)){
 		p++;
-		while( IS_ALPHANUMERIC(*p) || *p=='.') p++;
-		if((ret=calloc(1, sizeof( token_t)))){
-			if(NULL==(ret->param.value.parameter=strdupn( s, p-s))){
-				free(ret);
+		while( char_class[(unsigned char)*p] & CHAR_NAME) p++;
+		if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
+			if(NULL==(d=exp_arena_alloc( arena, p-s+1))){
 				ret=NULL;
 			}else{
-				strtolower( ret->param.value.parameter);
+				//names are case insensitive, they are stored in lower case
+				ret->param.value.parameter=d;
 				*toklen=p-s;
+				while( s<p){
+					*d++=*s | ( char_class[(unsigned char)*s] & CHAR_UPPER);
+					s++;
+				}
+				*d=0;
 				ret->param.type=T_PARAMETER;
 			}
 		}
@@ -640,7 +572,26 @@ static token_t *is_parameter( char *s, size_t slen, int *toklen){
 	return NULL;
 }
 
-static token_t *is_string( char *s, size_t slen, int *toklen){
+/*
+ * Copies the name of parameter or function in lower case, the way exp_parse()
+ * stores names. The name is copied to the buffer of `len' bytes if it fits
+ * there, otherwise to allocated memory that the caller frees.
+ *
+ * @return The name in lower case or NULL if memory error occured
+ */
+char *exp_name_tolower( const char *name, char *buffer, size_t len){
+	size_t n=strlen( name), i;
+	char *ret=n<len ? buffer : malloc( n+1);
+
+	if( ret){
+		for( i=0; i<=n; i++){
+			ret[i]=name[i] | ( char_class[(unsigned char)name[i]] & CHAR_UPPER);
+		}
+	}
+	return ret;
+}
+
+static token_t *is_string( arena_t *arena, char *s, size_t slen, int *toklen){
 	char *p=s;
 	token_t *ret;
 	char c;
@@ -665,13 +616,11 @@ static token_t *is_string( char *s, size_t slen, int *toklen){
 
 		if(c==*p){
 			//string found
-			if((ret=calloc(1, sizeof( token_t)))){
-				if(NULL==(ret->param.value.string=strdupn( s+1, p-s-1))){
-					free(ret);
+			if((ret=exp_arena_alloc( arena, sizeof( token_t)))){
+				if(NULL==(ret->param.value.string=exp_arena_alloc( arena, p-s))){
 					ret=NULL;
 				}else{
-					//try removing slashes
-					stripslashes(ret->param.value.string);
+					stripslashes( ret->param.value.string, s+1, p-s-1);
 					*toklen=p-s+1;
 					ret->param.type=T_STRING;
 				}
@@ -790,9 +739,10 @@ int exp_check( token_t *token, exp_error_t *ercode, char *error, int *error_pos)
 /*
  * Parses expr and explodes it on tokens. Function returns linked list of tokens
  * if expr is parsed successfully. Function returns NULL if error occured
- * and sets error to specific error  string.
+ * and sets error to specific error  string. The tokens are allocated in the
+ * arena, they are freed with the arena.
  */
-token_t *exp_parse( char *expression, exp_error_t *ercode, char *error, int *error_pos){
+token_t *exp_parse( arena_t *arena, char *expression, exp_error_t *ercode, char *error, int *error_pos){
 	int elen, l;
 	char *exp;
 	token_t *token, *head=NULL, *tail=NULL;
@@ -811,27 +761,26 @@ token_t *exp_parse( char *expression, exp_error_t *ercode, char *error, int *err
 
 	}else{
 		while( elen>0){
-			if(NULL==(token=is_parenthesis( exp, elen, &l))){
-				if(NULL==(token=is_comma( exp, elen, &l))){
-					if(NULL==(token=is_operator( exp, elen, &l))){
-						if(NULL==(token=is_number(exp, elen, &l))){
-							if(NULL==(token=is_parameter(exp, elen, &l))){
-								if(NULL==(token=is_string(exp, elen, &l))){
-									if( *exp=='"' || *exp=='\''){
-										*ercode=EXP_ER_INVALEXPR;
-										strcpy(error, "Missing terminating quote character");
-									}else{
-										*ercode=EXP_ER_INVALEXPR;
-										sprintf(error, "Invalid or unsupported token '%c'", *exp);
-									}
-									*error_pos=exp-expression;
-									head=exp_token_free( head);
-									break;
-								}
-							}
-						}
-					}
+			switch( char_class[(unsigned char)*exp] & CHAR_CLASS){
+				case CHAR_PAREN:    token=is_parenthesis( arena, exp, elen, &l); break;
+				case CHAR_COMMA:    token=is_comma( arena, exp, elen, &l); break;
+				case CHAR_OPERATOR: token=is_operator( arena, exp, elen, &l); break;
+				case CHAR_NUMBER:   token=is_number( arena, exp, elen, &l); break;
+				case CHAR_ALPHA:    token=is_parameter( arena, exp, elen, &l); break;
+				case CHAR_QUOTE:    token=is_string( arena, exp, elen, &l); break;
+				default:            token=NULL; break;
+			}
+			if(NULL==token){
+				if( *exp=='"' || *exp=='\''){
+					*ercode=EXP_ER_INVALEXPR;
+					strcpy(error, "Missing terminating quote character");
+				}else{
+					*ercode=EXP_ER_INVALEXPR;
+					sprintf(error, "Invalid or unsupported token '%c'", *exp);
 				}
+				*error_pos=exp-expression;
+				head=NULL;
+				break;
 			}
 			token->position=exp-expression;
 